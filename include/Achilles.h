@@ -5,6 +5,8 @@
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
 #include <sys/utsname.h>
 
 #define NAME "Achilles"
@@ -19,6 +21,9 @@
 #ifndef MIN
 #	define MIN(a, b) ((a) < (b) ? (a) : (b))
 #endif
+#ifndef MAX
+#	define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
 typedef enum
 {
     FLAG_BOOL,
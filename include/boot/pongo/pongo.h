@@ -4,6 +4,7 @@
 #include <Achilles.h>
 #include <boot/lz4/lz4hc.h>
 #include <usb/usb.h>
+#include <utils/timeline.h>
 #include <exploit/dfu.h>
 #include <time.h>
 
@@ -4,6 +4,7 @@
 #include <Achilles.h>
 
 #include <usb/usb.h>
+#include <utils/timeline.h>
 
 #include <errno.h>
 #include <fcntl.h>              // open
@@ -18,9 +19,11 @@
 #include <sys/stat.h>           // fstst
 #include <dirent.h>             // opendir, readdir, closedir
 
+#ifndef ACHILLES_USBFS
 #include <IOKit/IOKitLib.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/IOCFPlugIn.h>
+#endif
 
 // ******************************************************
 // Function: issuePongoCommand()
@@ -0,0 +1,91 @@
+#ifndef ABORT_MODEL_H
+#define ABORT_MODEL_H
+
+#include <Achilles.h>
+#include <utils/log.h>
+#include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
+
+#define ABORT_MODEL_FILE ".achilles/abort-model" // Relative to $HOME
+#define ABORT_MODEL_BUCKET_WIDTH 250 // Microseconds
+#define ABORT_MODEL_BUCKETS 44 // Covers 0-11ms, the range the race loops sweep through
+#define ABORT_MODEL_MAX_ATTEMPTS 1000 // Counts are halved past this, so old runs fade out
+#define ABORT_MODEL_MAX_MISSES 20 // Losses in a row before a stage goes back to the full sweep
+
+typedef enum {
+	ABORT_STAGE_STALL,
+	ABORT_STAGE_TRIGGER,
+	ABORT_STAGE_COUNT
+} abort_stage_t;
+
+typedef struct {
+	uint16_t cpid;
+	uint32_t host;
+	uint32_t attempts[ABORT_STAGE_COUNT][ABORT_MODEL_BUCKETS];
+	uint32_t successes[ABORT_STAGE_COUNT][ABORT_MODEL_BUCKETS];
+	uint32_t misses[ABORT_STAGE_COUNT]; // Losses since the last win, not saved
+} abort_model_t;
+
+// ******************************************************
+// Function: loadAbortModel()
+//
+// Purpose: Load the learned abort delays for a CPID and host controller from the state file
+//
+// Parameters:
+//      abort_model_t *model: the model to fill in
+//      uint16_t cpid: the CPID of the device
+//      uint32_t host: the host controller the device is connected to
+//
+// Returns:
+//      bool: true if a saved model was found, false if the model starts empty
+// ******************************************************
+bool loadAbortModel(abort_model_t *model, uint16_t cpid, uint32_t host);
+
+// ******************************************************
+// Function: saveAbortModel()
+//
+// Purpose: Write a model back to the state file, keeping entries for other devices and hosts
+//
+// Parameters:
+//      abort_model_t *model: the model to save
+//
+// Returns:
+//      bool: true if the model was saved, false otherwise
+// ******************************************************
+bool saveAbortModel(abort_model_t *model);
+
+// ******************************************************
+// Function: sampleAbortDelay()
+//
+// Purpose: Pick the next abort delay to try for a race stage
+//
+// Parameters:
+//      abort_model_t *model: the model to sample from
+//      abort_stage_t stage: the race stage
+//      unsigned fallback: the delay to use while the stage has no recorded successes, in microseconds
+//
+// Returns:
+//      unsigned: the abort delay in microseconds
+//
+// Buckets are chosen with a weight that grows with their observed success rate, and the
+// neighbouring buckets are occasionally tried so the model can move if the host changes.
+// After ABORT_MODEL_MAX_MISSES losses in a row the fallback is used until the next win,
+// so timing that moved further than a neighbour is still found by the sweep
+// ******************************************************
+unsigned sampleAbortDelay(abort_model_t *model, abort_stage_t stage, unsigned fallback);
+
+// ******************************************************
+// Function: recordAbortResult()
+//
+// Purpose: Record whether an abort delay won the race
+//
+// Parameters:
+//      abort_model_t *model: the model to update
+//      abort_stage_t stage: the race stage
+//      unsigned delay: the abort delay in microseconds
+//      bool won: whether the attempt won the race
+// ******************************************************
+void recordAbortResult(abort_model_t *model, abort_stage_t stage, unsigned delay, bool won);
+
+#endif // ABORT_MODEL_H
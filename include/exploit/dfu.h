@@ -2,8 +2,10 @@
 #define DFU_H
 
 #include <Achilles.h>
+#ifndef ACHILLES_USBFS
 #include <IOKit/IOKitLib.h>
 #include <CoreFoundation/CoreFoundation.h>
+#endif
 #include <usb/usb.h>
 #include <usb/device.h>
 
@@ -19,9 +21,16 @@
 #define EP0_MAX_PACKET_SIZE 0x40
 #define DFU_MAX_TRANSFER_SIZE 0x800
 #define DFU_STATUS_OK 0
+#define DFU_STATUS_ERR_UNKNOWN 0xE
+#define DFU_STATE_IDLE 2
+#define DFU_STATE_DNLOAD_SYNC 3
+#define DFU_STATE_DNLOAD_IDLE 5
 #define DFU_STATE_MANIFEST_SYNC 6
 #define DFU_STATE_MANIFEST 7
 #define DFU_STATE_MANIFEST_WAIT_RESET 8
+#define DFU_STATE_ERROR 10
+
+#define DFU_ENTRY_TIMEOUT 30000 // Milliseconds to wait for DFU mode after the button prompts
 
 struct dfu_serial_t
 { // CPID:8011 CPRV:10 CPFM:03 SCEP:01 BDID:04 ECID:000C24A8000B883A IBFL:3C SRTG:[iBoot-3135.0.0.2.3]
@@ -32,13 +41,15 @@ struct dfu_serial_t
     unsigned long long ecid;
     int ibfl;
     char srtg[0x20];
-    char pwnd[];
+    char pwnd[0x20]; // Empty unless the device is pwned
 };
 typedef struct dfu_serial_t dfu_serial_t;
 
 struct dfu_device_t
 {
+#ifndef ACHILLES_USBFS
     io_service_t service;
+#endif
     dfu_serial_t serial;
 };
 typedef struct dfu_device_t dfu_device_t;
@@ -69,6 +80,20 @@ bool isSerialNumberPwned(char *serialNumber);
 // ******************************************************
 bool isInDownloadMode(char *serialNumber);
 
+// ******************************************************
+// Function: parseDFUSerial()
+//
+// Purpose: Split a DFU serial number into its fields
+//
+// Parameters:
+//      const char *serialNumber: the serial number to parse
+//      dfu_serial_t *serial: receives the fields
+//
+// Returns:
+//      bool: true if the serial number has all the fields a DFU device reports, false otherwise
+// ******************************************************
+bool parseDFUSerial(const char *serialNumber, dfu_serial_t *serial);
+
 // ******************************************************
 // Function: isSupported()
 //
@@ -98,8 +123,14 @@ bool DFUSetStateWaitReset(const usb_handle_t *handle);
 // Function: DFUHelper()
 //
 // Purpose: Guide the user through entering DFU mode
+//
+// Parameters:
+//      volatile bool *stop: optional flag that ends the guide early when set
+//
+// Returns:
+//      bool: true if the guide finished, false if it was stopped early
 // ******************************************************
-void DFUHelper(void);
+bool DFUHelper(volatile bool *stop);
 
 // ******************************************************
 // Function: DFUSendData()
@@ -4,7 +4,137 @@
 #include <Achilles.h>
 #include <usb/usb.h>
 #include <exploit/dfu.h>
+#include <exploit/exploit.h>
+#include <utils/timer.h>
+
+#define CHECKM8_COMMAND_REPLY_SIZE 0x10 // DONE_MAGIC and the return value, the payload replies with them before anything else
+#define CHECKM8_COMMAND_MAX_ARGUMENTS 8 // x0 to x7
+
+typedef struct {
+	usb_handle_t *handle;
+	uint64_t commands, failures;
+	uint64_t lastLatency, totalLatency, minLatency, maxLatency; // Nanoseconds from the first transfer of a command to the last
+} checkm8_command_session_t;
 
 bool checkm8ExecuteCommand(usb_handle_t *handle, void *request_data, size_t request_len, uint8_t **response, size_t response_len);
 
-#endif // EXPLOIT_UTILS_H
\ No newline at end of file
+// ******************************************************
+// Function: checkm8OpenCommandSession()
+//
+// Purpose: Open a device in pwned DFU mode once for any number of commands,
+//          rather than opening it and running a DFU manifest for each one like checkm8ExecuteCommand()
+//
+// Parameters:
+//      checkm8_command_session_t *session: the session to start
+//      usb_handle_t *handle: an initialised handle, which stays open until checkm8CloseCommandSession()
+//
+// Returns:
+//      bool: true if the device was opened and is ready for commands, false otherwise
+// ******************************************************
+bool checkm8OpenCommandSession(checkm8_command_session_t *session, usb_handle_t *handle);
+
+// ******************************************************
+// Function: checkm8SessionCommand()
+//
+// Purpose: Send a command to the payload and read its reply, with the fewest transfers it takes:
+//          the request, the upload that runs it, and the zero-length download and two GETSTATUS
+//          requests that make the next command load from the start of the buffer again
+//
+// Parameters:
+//      checkm8_command_session_t *session: an open session
+//      const void *request: the command, starting with EXEC_MAGIC or MEMC_MAGIC
+//      size_t requestLength: the size of the command
+//      void *response: receives the reply
+//      size_t responseLength: the size of the reply, from CHECKM8_COMMAND_REPLY_SIZE up to DFU_MAX_TRANSFER_SIZE
+//
+// Returns:
+//      bool: true if every transfer succeeded, false otherwise
+// ******************************************************
+bool checkm8SessionCommand(checkm8_command_session_t *session, const void *request, size_t requestLength, void *response, size_t responseLength);
+
+// ******************************************************
+// Function: checkm8SessionExec()
+//
+// Purpose: Call a function on the device with EXEC_MAGIC
+//
+// Parameters:
+//      checkm8_command_session_t *session: an open session
+//      uint64_t function: the address of the function
+//      const uint64_t *arguments: passed in x0 onwards, NULL if there are none
+//      size_t count: the number of arguments, at most CHECKM8_COMMAND_MAX_ARGUMENTS
+//      uint64_t *retval: receives the function's return value, may be NULL
+//
+// Returns:
+//      bool: true if the function ran, false otherwise
+// ******************************************************
+bool checkm8SessionExec(checkm8_command_session_t *session, uint64_t function, const uint64_t *arguments, size_t count, uint64_t *retval);
+
+// ******************************************************
+// Function: checkm8SessionMemcpy()
+//
+// Purpose: Copy memory on the device with MEMC_MAGIC
+//
+// Parameters:
+//      checkm8_command_session_t *session: an open session
+//      uint64_t destination: the address to copy to
+//      uint64_t source: the address to copy from
+//      size_t length: the number of bytes
+//
+// Returns:
+//      bool: true if the copy ran, false otherwise
+// ******************************************************
+bool checkm8SessionMemcpy(checkm8_command_session_t *session, uint64_t destination, uint64_t source, size_t length);
+
+// ******************************************************
+// Function: checkm8SessionReadMemory()
+//
+// Purpose: Read memory from the device, copying it into the load buffer so it comes back in the reply
+//
+// Parameters:
+//      checkm8_command_session_t *session: an open session
+//      uint64_t address: the address to read from
+//      void *buffer: receives the memory
+//      size_t length: the number of bytes, larger reads take one command per DFU_MAX_TRANSFER_SIZE
+//
+// Returns:
+//      bool: true if all of it was read, false otherwise
+// ******************************************************
+bool checkm8SessionReadMemory(checkm8_command_session_t *session, uint64_t address, void *buffer, size_t length);
+
+// ******************************************************
+// Function: checkm8SessionWriteMemory()
+//
+// Purpose: Write memory on the device, sending the data along with the command that copies it
+//
+// Parameters:
+//      checkm8_command_session_t *session: an open session
+//      uint64_t address: the address to write to
+//      const void *data: the data to write
+//      size_t length: the number of bytes, larger writes take one command per DFU_MAX_TRANSFER_SIZE
+//
+// Returns:
+//      bool: true if all of it was written, false otherwise
+// ******************************************************
+bool checkm8SessionWriteMemory(checkm8_command_session_t *session, uint64_t address, const void *data, size_t length);
+
+// ******************************************************
+// Function: checkm8PrintCommandSession()
+//
+// Purpose: Log how many commands a session ran and their latency
+//
+// Parameters:
+//      const checkm8_command_session_t *session: the session
+// ******************************************************
+void checkm8PrintCommandSession(const checkm8_command_session_t *session);
+
+// ******************************************************
+// Function: checkm8CloseCommandSession()
+//
+// Purpose: Close the device, leaving it in pwned DFU mode
+//
+// Parameters:
+//      checkm8_command_session_t *session: the session to end
+// ******************************************************
+void checkm8CloseCommandSession(checkm8_command_session_t *session);
+
+#endif // EXPLOIT_UTILS_H
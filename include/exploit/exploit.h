@@ -1,14 +1,20 @@
 #ifndef EXPLOIT_H
 #define EXPLOIT_H
 
+#ifndef ACHILLES_USBFS
 #include <IOKit/IOKitLib.h>
 #include <CoreFoundation/CoreFoundation.h>
+#endif
 #include <time.h>
 #include <utils/log.h>
 #include <exploit/dfu.h>
 #include <exploit/recovery.h>
+#include <exploit/abort-model.h>
+#include <utils/realtime.h>
+#include <utils/timeline.h>
 #include <usb/usb.h>
 #include <usb/device.h>
+#include <usb/hotplug.h>
 #include <boot/pongo/pongo.h>
 #include <boot/pongo/pongo_helper.h>
 #include <exploit/payloads/helpers.h>
@@ -35,11 +41,49 @@ typedef struct {
     uint64_t heap_pad_0, heap_pad_1;
 } checkm8_overwrite_t;
 
+typedef struct {
+    uint16_t cpid;
+    bool pongo; // YoloDFU payload and overwrite, rather than gaster's
+    const uint8_t *payload;
+    size_t payloadSize;
+    checkm8_overwrite_t overwrite;
+    size_t overwriteSize; // Only the callback is sent for YoloDFU
+} checkm8_payload_t;
+
+#define CHECKM8_PAYLOAD_CACHE_SIZE 20 // Both payloads for every supported SoC
+
+typedef struct {
+    unsigned requested; // Microseconds
+    uint64_t achieved; // Nanoseconds, 0 if the request completed before the abort
+    bool won;
+} abort_attempt_t;
+
+#define ABORT_ATTEMPT_LOG_SIZE 64
+
+typedef struct {
+    device_t *device;
+    int stage;
+    bool connected; // Whether device->handle is open, it is only reopened after the device re-enumerates
+    bool pwned;
+    char *serial; // Read once when the current connection was opened
+    unsigned connections;
+} checkm8_session_t;
+
+typedef struct {
+    unsigned stages; // Stages run, each followed by a reset
+    unsigned connections; // Times the device was opened
+    int failedStage; // The first stage that failed, STAGE_DONE if none did
+} checkm8_result_t;
+
+extern checkm8_result_t checkm8LastResult; // How the last checkm8() went, for the tests
+
 #define DONE_MAGIC (0x646F6E65646F6E65ULL) // donedone
 #define EXEC_MAGIC (0x6578656365786563ULL) // execexec
 #define MEMC_MAGIC (0x6D656D636D656D63ULL) // memcmemc
 #define MEMS_MAGIC (0x6D656D736D656D73ULL) // memsmems
 
+#define YOLO_REENUMERATION_TIMEOUT 10000 // Milliseconds to wait for YoloDFU after sending the payload
+
 // ******************************************************
 // Function: checkm8()
 //
@@ -50,4 +94,31 @@ typedef struct {
 // ******************************************************
 int checkm8();
 
+// ******************************************************
+// Function: prepareGasterPayload()
+//
+// Purpose: Build the gaster payload for the CPID set by checkm8CheckSerialNumber()
+//
+// Parameters:
+//      uint8_t **buffer: receives the payload, to be freed by the caller
+//
+// Returns:
+//      size_t: the size of the payload, 0 if there is none for the device
+// ******************************************************
+size_t prepareGasterPayload(uint8_t **buffer);
+
+// ******************************************************
+// Function: getCheckm8Payload()
+//
+// Purpose: Get the payload and overwrite for the CPID set by checkm8CheckSerialNumber(),
+//          building them the first time they are needed and reusing them after that
+//
+// Parameters:
+//      bool pongo: whether to get the YoloDFU payload, which boots PongoOS, rather than gaster's
+//
+// Returns:
+//      const checkm8_payload_t *: the payload and overwrite, or NULL if the device isn't supported
+// ******************************************************
+const checkm8_payload_t *getCheckm8Payload(bool pongo);
+
 #endif // EXPLOIT_H
\ No newline at end of file
@@ -5,7 +5,9 @@
 #include <utils/log.h>
 #include <stdio.h>
 #include <stdint.h>
+#ifndef ACHILLES_USBFS
 #include <CoreFoundation/CoreFoundation.h>
+#endif
 
 // All of these are gaster functions, definitions and structures
 
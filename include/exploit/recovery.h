@@ -8,17 +8,22 @@
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/diagnostics_relay.h>
 
+#define RECOVERY_ENTRY_TIMEOUT 30000 // Milliseconds to wait for the device to reboot into recovery mode
+
 // ******************************************************
 // Function: enterRecoveryMode()
 //
-// Purpose: Puts the device into recovery mode
+// Purpose: Asks a device in normal mode to reboot into recovery mode
+//
+// Parameters:
+//      char *udid: the UDID of the device, or NULL to use the only connected device
 //
 // Returns:
-//      int: 0 if the device entered recovery mode successfully, 1 otherwise
+//      int: 0 if the recovery mode request was sent successfully, -1 otherwise
 //
 // This function was taken from palera1n and adapted for Achilles
 // ******************************************************
-int enterRecoveryMode();
+int enterRecoveryMode(char *udid);
 
 // ******************************************************
 // Function: sendRecoveryModeCommand()
@@ -0,0 +1,64 @@
+#ifndef TRACE_ANALYSIS_H
+#define TRACE_ANALYSIS_H
+
+#include <Achilles.h>
+#include <usb/trace.h>
+#include <usb/stats.h>
+#include <exploit/dfu.h>
+#include <utils/log.h>
+
+#define TRACE_ANALYSIS_SLEEP_THRESHOLD 1000000 // Nanoseconds, shorter gaps between transfers are host overhead
+#define TRACE_ANALYSIS_TOP_WAITS 10 // Kinds of wait listed in the report
+#define TRACE_ANALYSIS_MAX_WAITS 256 // Kinds of wait tracked, the rest are only counted in the totals
+
+typedef enum {
+	TRACE_STAGE_CONNECT, // Anything before the first recognised request
+	TRACE_STAGE_RESET,
+	TRACE_STAGE_HEAP_SPRAY,
+	TRACE_STAGE_TRIGGER,
+	TRACE_STAGE_PAYLOAD,
+	TRACE_STAGE_PONGO, // Sending PongoOS to the device in download mode
+	TRACE_STAGE_PONGO_COMMANDS, // Commands and uploads once PongoOS is running
+	TRACE_STAGE_COUNT
+} trace_stage_t;
+
+typedef enum {
+	TRACE_TIME_TRANSFER, // A transfer was in flight
+	TRACE_TIME_SLEEP, // A long gap while the device stayed connected, i.e. a fixed wait on the host
+	TRACE_TIME_DEVICE, // A gap that ended with the device being opened again, e.g. a re-enumeration
+	TRACE_TIME_HOST, // A short gap between transfers
+	TRACE_TIME_COUNT
+} trace_time_t;
+
+typedef struct {
+	size_t transfers, attempts; // Attempts counts how often the stage was entered
+	uint64_t time[TRACE_TIME_COUNT]; // Nanoseconds, the columns add up to the length of the recording
+} trace_stage_report_t;
+
+// ******************************************************
+// Function: classifyUSBTrace()
+//
+// Purpose: Work out which checkm8 stage each recorded transfer belongs to, from the requests each stage sends
+//
+// Parameters:
+//      const usb_trace_transfer_t *transfers: the transfers, as returned by readUSBTrace()
+//      size_t count: the number of transfers
+//      trace_stage_t *stages: filled in with the stage of each transfer
+// ******************************************************
+void classifyUSBTrace(const usb_trace_transfer_t *transfers, size_t count, trace_stage_t *stages);
+
+// ******************************************************
+// Function: analyseUSBTrace()
+//
+// Purpose: Print how the time in a recording was split between stages, transfers and waits,
+//          and which waits cost the most
+//
+// Parameters:
+//      const char *path: the usbmon pcap file to analyse, as written with --record
+//
+// Returns:
+//      bool: true if the recording was read, false otherwise
+// ******************************************************
+bool analyseUSBTrace(const char *path);
+
+#endif // TRACE_ANALYSIS_H
@@ -3,9 +3,13 @@
 
 #include <Achilles.h>
 #include <usb/usb.h>
+#include <usb/hotplug.h>
+#include <usb/simulator.h>
 #include <exploit/dfu.h>
 #include <utils/log.h>
+#ifndef ACHILLES_USBFS
 #include <IOKit/IOKitLib.h>
+#endif
 #include <libimobiledevice/libimobiledevice.h>
 #include <libimobiledevice/lockdown.h>
 #include <libimobiledevice/diagnostics_relay.h>
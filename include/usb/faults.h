@@ -0,0 +1,94 @@
+#ifndef USB_FAULTS_H
+#define USB_FAULTS_H
+
+#include <Achilles.h>
+#include <usb/usb.h>
+#include <utils/log.h>
+#include <utils/timer.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define USB_FAULTS_MAX_RULES 32 // Request types with their own rule, plus the default and bulk uploads
+#define USB_FAULTS_TIMEOUT 1000 // Milliseconds an injected timeout holds a transfer the caller never cancels
+
+typedef enum {
+	USB_FAULT_NONE,
+	USB_FAULT_STALL, // The device stalls the request
+	USB_FAULT_SHORT, // The transfer completes with fewer bytes than it had
+	USB_FAULT_TIMEOUT, // The transfer never completes on its own and fails once cancelled
+	USB_FAULT_DISCONNECT, // The transfer fails and so does every other one until the handle is reset or closed
+	USB_FAULT_COUNT
+} usb_fault_t;
+
+typedef enum {
+	USB_LATENCY_NONE,
+	USB_LATENCY_FIXED, // a milliseconds
+	USB_LATENCY_UNIFORM, // Between a and b milliseconds
+	USB_LATENCY_NORMAL, // Mean a and standard deviation b milliseconds, never below 0
+	USB_LATENCY_EXPONENTIAL, // Mean a milliseconds
+	USB_LATENCY_LOGNORMAL // Median a milliseconds, b is the standard deviation of its logarithm
+} usb_latency_model_t;
+
+typedef struct {
+	bool any, bulk; // Any is the default for requests without a rule of their own
+	uint8_t bmRequestType, bRequest;
+	double probability[USB_FAULT_COUNT]; // Indexed by usb_fault_t, USB_FAULT_NONE is unused
+	usb_latency_model_t latency;
+	double a, b;
+} usb_fault_rule_t;
+
+extern atomic_bool usbFaulting;
+extern atomic_bool usbFaultDisconnected;
+
+// ******************************************************
+// Function: startUSBFaults()
+//
+// Purpose: Load fault and latency rules and start applying them to every transfer on every backend
+//
+// Parameters:
+//      const char *path: the rules file, one rule per line of the form
+//                        "<TYPE:REQUEST|bulk|*> [stall=P] [short=P] [timeout=P] [disconnect=P] [latency=MODEL:A[:B]]",
+//                        plus an optional "seed N" line to make the run repeatable
+//
+// Returns:
+//      bool: true if the rules were read, false otherwise
+// ******************************************************
+bool startUSBFaults(const char *path);
+
+// ******************************************************
+// Function: releaseUSBFault()
+//
+// Purpose: Decide the fault and extra latency of a transfer the first time it is seen done,
+//          and apply them once the caller may see it
+//
+// Parameters:
+//      usb_future_t *future: a done future
+//
+// Returns:
+//      bool: true if the caller may see the completion now, false if it is still being held back
+// ******************************************************
+bool releaseUSBFault(usb_future_t *future);
+
+// ******************************************************
+// Function: getUSBFaultDeadline()
+//
+// Purpose: Find when the first of the futures held back by releaseUSBFault() is let through
+//
+// Parameters:
+//      usb_future_t **futures: the futures being waited on, NULL entries are skipped
+//      size_t count: the number of futures
+//      uint64_t deadline: the caller's own deadline, in monotonic nanoseconds
+//
+// Returns:
+//      uint64_t: the earlier of the deadline and the first release
+// ******************************************************
+uint64_t getUSBFaultDeadline(usb_future_t **futures, size_t count, uint64_t deadline);
+
+// ******************************************************
+// Function: printUSBFaults()
+//
+// Purpose: Print how many faults were injected, and the seed to repeat the run with
+// ******************************************************
+void printUSBFaults(void);
+
+#endif // USB_FAULTS_H
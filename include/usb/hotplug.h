@@ -0,0 +1,50 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <Achilles.h>
+#include <usb/usb.h>
+#include <time.h>
+
+enum usb_hotplug_event {
+	USB_DEVICE_ARRIVED,
+	USB_DEVICE_LEFT
+};
+
+typedef enum usb_hotplug_event usb_hotplug_event;
+
+// ******************************************************
+// Function: isUSBDevicePresent()
+//
+// Purpose: Check if a device with a given vendor and product ID is currently connected,
+//          without opening it
+//
+// Parameters:
+//      uint16_t vid: the vendor ID
+//      uint16_t pid: the product ID
+//
+// Returns:
+//      bool: true if a matching device is connected, false otherwise
+// ******************************************************
+bool isUSBDevicePresent(uint16_t vid, uint16_t pid);
+
+// ******************************************************
+// Function: waitUSBHotplugEvent()
+//
+// Purpose: Wait for a device with a given vendor and product ID to arrive or leave
+//
+// Parameters:
+//      uint16_t vid: the vendor ID
+//      uint16_t pid: the product ID
+//      usb_hotplug_event event: the event to wait for
+//      unsigned timeout: the deadline in milliseconds
+//      volatile bool *cancel: optional flag that stops the wait early when set
+//
+// Returns:
+//      bool: true if the event happened before the deadline, false otherwise
+//
+// A device that is already connected counts as arrived, and a device that is
+// not connected counts as left, so the caller can never miss the event
+// ******************************************************
+bool waitUSBHotplugEvent(uint16_t vid, uint16_t pid, usb_hotplug_event event, unsigned timeout, volatile bool *cancel);
+
+#endif // HOTPLUG_H
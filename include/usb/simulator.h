@@ -0,0 +1,170 @@
+#ifndef USB_SIMULATOR_H
+#define USB_SIMULATOR_H
+
+#include <Achilles.h>
+#include <usb/usb.h>
+#include <usb/trace.h>
+#include <utils/log.h>
+#include <utils/timer.h>
+
+#define USB_SIMULATOR_RESYNC_WINDOW 16 // Recorded transfers to look ahead for one that matches a request
+#define USB_SIMULATOR_SERIAL_SIZE 128 // Longest serial number a simulated device reports
+
+typedef enum {
+	USB_SIMULATOR_MODE_DFU,
+	USB_SIMULATOR_MODE_PWND, // Pwned DFU, running the gaster payload
+	USB_SIMULATOR_MODE_YOLO, // YoloDFU, waiting for PongoOS to be sent
+	USB_SIMULATOR_MODE_PONGO,
+	USB_SIMULATOR_MODE_BOOTED // PongoOS booted the kernel, so the device is gone
+} usb_simulator_mode_t;
+
+typedef enum {
+	USB_SIMULATOR_FAIL_NONE,
+	USB_SIMULATOR_FAIL_RESET, // The manifest after a download errors, so checkm8Reset() fails
+	USB_SIMULATOR_FAIL_STALL, // The stall race is always answered in full, so checkm8Stall() never wins, and the endpoint is never halted for the A7-A9 spray
+	USB_SIMULATOR_FAIL_TRIGGER, // The use-after-free download is always answered in full, so checkm8TriggerUaF() never wins
+	USB_SIMULATOR_FAIL_PAYLOAD // The payload never runs, the device stays in DFU mode
+} usb_simulator_failure_t;
+
+// A device that answers requests the way the SecureROM, the payloads and PongoOS do, instead of a recording
+typedef struct {
+	uint16_t cpid;
+	uint8_t bdid;
+	const char *srtg; // The SecureROM version in the serial number, e.g. "iBoot-2696.0.0.1.33"
+	usb_simulator_mode_t mode; // The mode it starts in
+	bool yolo; // The payload re-enumerates in YoloDFU mode rather than pwned DFU mode
+	usb_simulator_failure_t failure;
+	size_t lifetime; // Transfers it answers before going away for good, 0 for no limit
+	unsigned latency; // Microseconds every transfer takes
+} usb_simulator_device_t;
+
+extern atomic_bool usbSimulating;
+
+// ******************************************************
+// Function: startUSBSimulator()
+//
+// Purpose: Stand in for the device by replaying a recording made with startUSBTrace(),
+//          libusb handles opened afterwards talk to the recording instead of a real device
+//
+// Parameters:
+//      const char *path: the usbmon pcap file to replay, it should only contain the one device
+//
+// Returns:
+//      bool: true if the recording was loaded, false otherwise
+// ******************************************************
+bool startUSBSimulator(const char *path);
+
+// ******************************************************
+// Function: startUSBSimulatorDevice()
+//
+// Purpose: Stand in for the device with a model of it rather than a recording,
+//          libusb handles opened afterwards talk to the model until stopUSBSimulator() is called
+//
+// Parameters:
+//      const usb_simulator_device_t *device: the device to simulate, copied
+// ******************************************************
+void startUSBSimulatorDevice(const usb_simulator_device_t *device);
+
+// ******************************************************
+// Function: getUSBSimulatorMode()
+//
+// Purpose: Get the mode the simulated device is in, e.g. to see whether PongoOS booted
+//
+// Returns:
+//      usb_simulator_mode_t: the current mode of the device started with startUSBSimulatorDevice()
+// ******************************************************
+usb_simulator_mode_t getUSBSimulatorMode(void);
+
+// ******************************************************
+// Function: stopUSBSimulator()
+//
+// Purpose: Log how closely the run followed the recording and free it
+// ******************************************************
+void stopUSBSimulator(void);
+
+// ******************************************************
+// Function: replayUSBSimulatorTransfer()
+//
+// Purpose: Answer a submitted request with the next matching recorded transfer, or from the device model,
+//          its result becomes visible once the latency has passed
+//
+// Parameters:
+//      usb_future_t *future: the prepared future, with its submission time set
+//
+// Returns:
+//      bool: true if the request was submitted, false if the simulated device has gone away
+// ******************************************************
+bool replayUSBSimulatorTransfer(usb_future_t *future);
+
+// ******************************************************
+// Function: cancelUSBSimulatorFuture()
+//
+// Purpose: Abort a replayed request that has not completed yet
+//
+// Parameters:
+//      usb_future_t *future: the future to abort
+// ******************************************************
+void cancelUSBSimulatorFuture(usb_future_t *future);
+
+// ******************************************************
+// Function: pollUSBSimulator()
+//
+// Purpose: Complete the replayed futures that are due, sleeping until the next one is or the deadline passes
+//
+// Parameters:
+//      usb_future_t **futures: the futures to check, NULL entries are skipped
+//      size_t count: the number of futures
+//      uint64_t deadline: the monotonic time to give up at, in nanoseconds
+// ******************************************************
+void pollUSBSimulator(usb_future_t **futures, size_t count, uint64_t deadline);
+
+// ******************************************************
+// Function: waitUSBSimulatorDevice()
+//
+// Purpose: Wait for the simulated device to come back after being closed, as long as it was gone in the recording
+//
+// Returns:
+//      bool: true if the device is there, false if the recording has been replayed to the end or the model has gone away
+// ******************************************************
+bool waitUSBSimulatorDevice(void);
+
+// ******************************************************
+// Function: resetUSBSimulatorDevice()
+//
+// Purpose: Reset the simulated device, restarting DFU on a modelled device that was waiting for a reset
+//
+// Returns:
+//      bool: true if the device kept its connection, false if it re-enumerated in another mode,
+//            went away or is replayed from a recording, which replays the re-enumeration on the next open
+// ******************************************************
+bool resetUSBSimulatorDevice(void);
+
+// ******************************************************
+// Function: closeUSBSimulatorDevice()
+//
+// Purpose: Note that the simulated device was closed, so that it re-enumerates before it is opened again,
+//          which also restarts DFU on a modelled device that was waiting for a reset
+// ******************************************************
+void closeUSBSimulatorDevice(void);
+
+// ******************************************************
+// Function: getUSBSimulatorSerialNumber()
+//
+// Purpose: Find the serial number the recorded device reported, or the one the model reports in its current mode
+//
+// Returns:
+//      char *: the serial number, to be freed by the caller, or NULL if the recording has none
+// ******************************************************
+char *getUSBSimulatorSerialNumber(void);
+
+// ******************************************************
+// Function: getUSBSimulatorBus()
+//
+// Purpose: Get the bus the recorded device was on
+//
+// Returns:
+//      uint16_t: the bus number from the recording
+// ******************************************************
+uint16_t getUSBSimulatorBus(void);
+
+#endif // USB_SIMULATOR_H
@@ -0,0 +1,88 @@
+#ifndef USB_STATS_H
+#define USB_STATS_H
+
+#include <Achilles.h>
+#include <usb/usb.h>
+#include <utils/log.h>
+#include <stdatomic.h>
+
+#define USB_STATS_MAX_KEYS 64 // Distinct (bmRequestType, bRequest) pairs tracked, plus bulk uploads
+#define USB_STATS_SUB_BUCKET_BITS 3 // 8 buckets per power of two, so latencies are kept to within 12.5%
+#define USB_STATS_BUCKETS ((64 - USB_STATS_SUB_BUCKET_BITS + 1) << USB_STATS_SUB_BUCKET_BITS)
+
+typedef struct {
+	bool bulk; // Bulk uploads are tracked together, bmRequestType and bRequest are 0
+	uint8_t bmRequestType, bRequest;
+	uint64_t count, stalls, errors, cancelled; // Cancelled counts both timeouts and deliberate aborts
+	uint64_t bytes;
+	uint64_t minLatency, maxLatency, totalLatency; // Nanoseconds from submission to completion
+	uint32_t histogram[USB_STATS_BUCKETS];
+} usb_stats_t;
+
+// ******************************************************
+// Function: recordUSBTransfer()
+//
+// Purpose: Count a finished transfer and its latency, safe to call from any thread
+//
+// Parameters:
+//      const usb_future_t *future: the done future of the transfer
+// ******************************************************
+void recordUSBTransfer(const usb_future_t *future);
+
+// ******************************************************
+// Function: getUSBStats()
+//
+// Purpose: Take a snapshot of the statistics of every request type seen so far
+//
+// Parameters:
+//      usb_stats_t *stats: filled in with up to count entries, may be NULL to only count them
+//      size_t count: the number of entries stats can hold
+//
+// Returns:
+//      size_t: the number of request types seen, which may be more than count
+// ******************************************************
+size_t getUSBStats(usb_stats_t *stats, size_t count);
+
+// ******************************************************
+// Function: getUSBStatsPercentile()
+//
+// Purpose: Estimate a latency percentile from a snapshot's histogram
+//
+// Parameters:
+//      const usb_stats_t *stats: the snapshot to read
+//      double percentile: between 0 and 100
+//
+// Returns:
+//      uint64_t: the latency in nanoseconds, rounded up to the end of its bucket
+// ******************************************************
+uint64_t getUSBStatsPercentile(const usb_stats_t *stats, double percentile);
+
+// ******************************************************
+// Function: resetUSBStats()
+//
+// Purpose: Forget every recorded transfer, e.g. between benchmark runs
+// ******************************************************
+void resetUSBStats(void);
+
+// ******************************************************
+// Function: getUSBRequestName()
+//
+// Purpose: Name the DFU and standard requests the exploit sends
+//
+// Parameters:
+//      uint8_t bmRequestType: the request type of the setup packet
+//      uint8_t bRequest: the request of the setup packet
+//
+// Returns:
+//      const char *: the name of the request, or NULL for anything else
+// ******************************************************
+const char *getUSBRequestName(uint8_t bmRequestType, uint8_t bRequest);
+
+// ******************************************************
+// Function: printUSBStats()
+//
+// Purpose: Log a table of counts and latency percentiles per request type
+// ******************************************************
+void printUSBStats(void);
+
+#endif // USB_STATS_H
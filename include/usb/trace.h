@@ -0,0 +1,122 @@
+#ifndef USB_TRACE_H
+#define USB_TRACE_H
+
+#include <Achilles.h>
+#include <usb/usb.h>
+#include <utils/log.h>
+#include <utils/timer.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#define USB_TRACE_RING_SIZE 256 // Transfers that can wait for the flush thread, must be a power of two
+#define USB_TRACE_MAX_PAYLOAD 0x800 // Data kept per transfer, larger bulk uploads are truncated
+#define USB_TRACE_FLUSH_INTERVAL 10 // Milliseconds between flushes of the ring to the file
+#define USB_TRACE_LINKTYPE 189 // LINKTYPE_USB_LINUX, the 48-byte usbmon header
+#define USB_TRACE_MAGIC 0xA1B23C4D // pcap with nanosecond timestamps
+
+// Linux errno values, since usbmon status codes are the same on every host
+#define USBMON_EPIPE 32
+#define USBMON_EPROTO 71
+#define USBMON_ECONNRESET 104
+
+// The usbmon packet header, as read by Wireshark and tcpdump
+typedef struct __attribute__((packed)) {
+	uint64_t id;
+	uint8_t type; // 'S' for submission, 'C' for completion
+	uint8_t transferType; // 2 for control, 3 for bulk
+	uint8_t endpoint; // Bit 7 set for IN
+	uint8_t device;
+	uint16_t bus;
+	uint8_t setupFlag; // 0 if setup holds a setup packet, '-' otherwise
+	uint8_t dataFlag; // 0 if data follows, '<' or '>' if it does not
+	int64_t seconds;
+	int32_t microseconds;
+	int32_t status; // Negative Linux errno, 0 on success
+	uint32_t length; // Bytes requested on submission, transferred on completion
+	uint32_t capturedLength;
+	uint8_t setup[8];
+} usbmon_header_t;
+
+typedef struct {
+	uint64_t id, submitted, completed;
+	bool control, in;
+	uint16_t bus;
+	int32_t status;
+	uint8_t setup[8];
+	uint32_t requested, transferred, captured;
+	uint8_t data[USB_TRACE_MAX_PAYLOAD];
+} usb_trace_record_t;
+
+// A transfer read back from a trace, with both of its usbmon packets merged
+typedef struct {
+	uint64_t submitted, completed; // Nanoseconds since the epoch
+	bool control, in;
+	uint8_t endpoint, device;
+	uint16_t bus;
+	uint8_t setup[8]; // Only for control transfers
+	int32_t status; // Negative Linux errno, 0 on success
+	uint32_t requested, transferred, captured;
+	uint8_t *data; // captured bytes, OUT data as sent or IN data as received
+} usb_trace_transfer_t;
+
+extern atomic_bool usbTracing;
+
+// ******************************************************
+// Function: startUSBTrace()
+//
+// Purpose: Start recording every finished USB transfer to a pcap file in the usbmon format
+//
+// Parameters:
+//      const char *path: the pcap file to write
+//      size_t maxPayload: bytes of data to keep per transfer, at most USB_TRACE_MAX_PAYLOAD
+//
+// Returns:
+//      bool: true if the file was opened and the flush thread started, false otherwise
+// ******************************************************
+bool startUSBTrace(const char *path, size_t maxPayload);
+
+// ******************************************************
+// Function: traceUSBTransfer()
+//
+// Purpose: Queue a finished transfer for the flush thread without blocking, dropping it if the ring is full
+//
+// Parameters:
+//      const usb_future_t *future: the done future of the transfer
+//      const void *data: the data of the transfer, OUT data as sent or IN data as received
+// ******************************************************
+void traceUSBTransfer(const usb_future_t *future, const void *data);
+
+// ******************************************************
+// Function: stopUSBTrace()
+//
+// Purpose: Stop recording, write out everything still queued and close the file
+// ******************************************************
+void stopUSBTrace(void);
+
+// ******************************************************
+// Function: readUSBTrace()
+//
+// Purpose: Read the control and bulk transfers of a usbmon pcap file, as written by startUSBTrace() or captured on Linux
+//
+// Parameters:
+//      const char *path: the pcap file to read
+//      usb_trace_transfer_t **transfers: set to the transfers in order of submission, free with freeUSBTrace()
+//      size_t *count: set to the number of transfers
+//
+// Returns:
+//      bool: true if the file was read, false if it could not be opened or is not a usbmon capture
+// ******************************************************
+bool readUSBTrace(const char *path, usb_trace_transfer_t **transfers, size_t *count);
+
+// ******************************************************
+// Function: freeUSBTrace()
+//
+// Purpose: Free transfers returned by readUSBTrace()
+//
+// Parameters:
+//      usb_trace_transfer_t *transfers: the transfers to free
+//      size_t count: the number of transfers
+// ******************************************************
+void freeUSBTrace(usb_trace_transfer_t *transfers, size_t count);
+
+#endif // USB_TRACE_H
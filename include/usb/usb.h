@@ -3,31 +3,50 @@
 
 #include <Achilles.h>
 #include <utils/log.h>
+#include <utils/timer.h>
+#include <limits.h>
+#include <stdatomic.h>
 #ifdef ACHILLES_LIBUSB
 #include <libusb-1.0/libusb.h>
+#include <pthread.h>
+#ifdef ACHILLES_USBFS
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <linux/usbdevice_fs.h>
+#endif
 #else
 #include <IOKit/IOKitLib.h>
 #include <IOKit/usb/IOUSBLib.h>
 #include <IOKit/IOCFPlugIn.h>
 #endif
+#ifndef ACHILLES_USBFS
 #include <CoreFoundation/CoreFoundation.h>
 #include <CommonCrypto/CommonCrypto.h>
+#endif
 
 #define USB_TIMEOUT 5
-
-typedef struct {
-	uint16_t vid, pid;
+#define USB_BULK_TIMEOUT 100
+#define USB_BULK_ENDPOINT 0x2
+#define USB_ABORT_SLACK 1000 // Microseconds before an abort to stop waiting for completions and start the precise sleep
+#define USB_ABORT_SPIN 200 // Microseconds to busy-wait before an abort in precise abort mode
+#define USB_TRANSFER_POOL_SIZE 4
+#define USB_TRANSFER_POOL_BUFFER_SIZE 0x800 // Largest request the exploit sends, DFU_MAX_TRANSFER_SIZE
+#define USB_FUTURE_WAIT_FOREVER UINT_MAX
+#define USB_EVENT_POLL_INTERVAL 100 // Longest a waiter sleeps before checking its futures again, in milliseconds
+#define USB_RECIPIENT_MASK 0x1F // Recipient bits of bmRequestType
 #ifdef ACHILLES_LIBUSB
-	struct libusb_device_handle *device;
-	int usb_interface;
-	struct libusb_context *context;
+#define USB_TRANSFER_POOL_DATA_OFFSET LIBUSB_CONTROL_SETUP_SIZE
 #else
-	io_service_t service;
-	IOUSBDeviceInterface320 **device;
-	CFRunLoopSourceRef async_event_source;
-	IOUSBInterfaceInterface300 **interface;
+#define USB_TRANSFER_POOL_DATA_OFFSET 0
 #endif
-} usb_handle_t;
+
+extern unsigned usbAbortSpin;
+extern atomic_size_t usbRequestAllocations; // Buffers allocated while sending requests, not counting the per-handle pools
+extern _Atomic uint64_t usbControlTransfers, usbControlBytes, usbBulkBytes; // Completed transfers, for the timeline
+// Gaps between transfers plus their latencies, in the recording the simulator replays and in this run, in nanoseconds
+extern _Atomic uint64_t usbRecordedTime, usbReplayedTime;
 
 enum usb_transfer {
 	USB_TRANSFER_OK,
@@ -38,8 +57,94 @@ enum usb_transfer {
 typedef struct {
 	enum usb_transfer ret;
 	uint32_t sz;
+	uint64_t abortDelay; // Nanoseconds between submission and abort, only set by async requests
 } transfer_ret_t;
 
+typedef struct usb_transfer_slot usb_transfer_slot_t;
+typedef struct usb_handle usb_handle_t;
+
+typedef struct usb_future {
+	const usb_handle_t *handle;
+	usb_transfer_slot_t *slot;
+	void *pData; // Where to copy IN data once the transfer completes
+	bool out, control, cancelled;
+	uint8_t bmRequestType, bRequest; // For the statistics and traces, 0 for bulk uploads
+	uint16_t wValue, wIndex;
+	uint32_t length; // wLength of control requests, the size of bulk uploads
+	uint64_t submitted, completed; // Monotonic times of submission and completion, in nanoseconds
+	atomic_bool done;
+	transfer_ret_t ret;
+	uint8_t fault; // The usb_fault_t injected into the transfer, see faults.h
+	uint64_t faultDue; // When an injected fault lets the caller see the completion, 0 until one is drawn
+#ifdef ACHILLES_LIBUSB
+	struct usb_future *next; // Link in the completion queue
+	uint64_t due; // When a simulated transfer completes, in monotonic nanoseconds
+#endif
+#ifdef ACHILLES_USBFS
+	bool urb; // Submitted on the handle's usbfs node rather than through libusb
+#endif
+} usb_future_t;
+
+typedef struct {
+	uint8_t bmRequestType, bRequest;
+	uint16_t wValue, wIndex;
+	void *pData;
+	size_t wLength;
+} usb_control_request_t;
+
+#ifdef ACHILLES_LIBUSB
+typedef struct usb_event_thread {
+	struct libusb_context *context;
+	pthread_t thread;
+	atomic_bool running;
+	_Atomic(usb_future_t *) completions; // Lock-free stack of transfers the event thread has finished with
+	atomic_uint sleepers;
+	pthread_mutex_t lock; // Only taken by waiters that have run out of work, never on the completion path
+	pthread_cond_t cond;
+} usb_event_thread_t;
+#endif
+
+struct usb_transfer_slot {
+#ifdef ACHILLES_LIBUSB
+	struct libusb_transfer *transfer;
+#else
+	IOUSBDevRequestTO req;
+#endif
+#ifdef ACHILLES_USBFS
+	struct usbdevfs_urb urb;
+#endif
+	usb_future_t future;
+	uint8_t *buffer; // Page aligned, the data starts at USB_TRANSFER_POOL_DATA_OFFSET
+	bool pooled, dirty;
+	atomic_bool inUse;
+};
+
+typedef struct {
+	usb_transfer_slot_t slots[USB_TRANSFER_POOL_SIZE];
+} usb_transfer_pool_t;
+
+struct usb_handle {
+	uint16_t vid, pid;
+	usb_transfer_pool_t *pool; // Created when the handle is opened, so async requests do not allocate
+#ifdef ACHILLES_LIBUSB
+	struct libusb_device_handle *device;
+	int usb_interface;
+	struct libusb_context *context; // Owned by the handle, with its own event thread
+	usb_event_thread_t *events;
+	bool simulated; // Talking to the recording replayed by the simulator rather than a device
+#ifdef ACHILLES_USBFS
+	int fd, epollFd; // Our own usbfs node for control requests, -1 to fall back to libusb
+	bool fdInterface; // Interface 0 is claimed on the usbfs node, until libusb needs it for bulk uploads
+#endif
+#else
+	io_service_t service;
+	IOUSBDeviceInterface320 **device;
+	CFRunLoopSourceRef async_event_source;
+	IOUSBInterfaceInterface300 **interface;
+	CFRunLoopSourceRef interface_event_source;
+#endif
+};
+
 static struct {
 	uint8_t b_len, b_descriptor_type;
 	uint16_t bcd_usb;
@@ -101,6 +206,21 @@ char *getDeviceSerialNumber(usb_handle_t *handle);
 // ******************************************************
 bool checkm8CheckUSBDevice(usb_handle_t *handle, bool *pwned);
 
+// ******************************************************
+// Function: checkm8CheckSerialNumber()
+//
+// Purpose: Identify the SoC from a serial number that has already been read and update global variables accordingly
+//
+// Parameters:
+//      const usb_handle_t *handle: the handle the serial number was read from
+//      const char *usbSerialNumber: the serial number, NULL if it could not be read
+//      bool *pwned: whether the device is already exploited
+//
+// Returns:
+//      bool: true if the device is supported, false otherwise
+// ******************************************************
+bool checkm8CheckSerialNumber(const usb_handle_t *handle, const char *usbSerialNumber, bool *pwned);
+
 // ******************************************************
 // Function: sendUSBControlRequest()
 //
@@ -140,6 +260,106 @@ bool sendUSBControlRequest(const usb_handle_t *handle, uint8_t bmRequestType, ui
 // ******************************************************
 bool sendUSBControlRequestNoData(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, size_t wLength, transfer_ret_t *transferRet);
 
+// ******************************************************
+// Function: submitUSBControlRequest()
+//
+// Purpose: Submit a USB control request without waiting for it to complete
+//
+// Parameters:
+//      const usb_handle_t *handle: the handle to use, which must have been opened with waitUSBHandle()
+//      uint8_t bmRequestType: the request type
+//      uint8_t bRequest: the request
+//      uint16_t wValue: the value
+//      uint16_t wIndex: the index
+//      void *pData: the data to send, or where to copy received data on completion, NULL to send zeroes
+//      size_t wLength: the length
+//
+// Returns:
+//      usb_future_t *: the future of the request, or NULL if it could not be submitted
+//
+// Every future must be waited on with waitUSBFuture() or waitAnyUSBFuture(). On IOKit,
+// completions are delivered through the run loop of the thread that opened the handle,
+// so futures must also be waited on from that thread
+// ******************************************************
+usb_future_t *submitUSBControlRequest(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength);
+
+// ******************************************************
+// Function: submitUSBControlRequests()
+//
+// Purpose: Submit several USB control requests back to back without waiting for any of them
+//
+// Parameters:
+//      const usb_handle_t *handle: the handle to use
+//      const usb_control_request_t *requests: the requests to submit, in order
+//      size_t count: the number of requests
+//      usb_future_t **futures: filled in with the future of each submitted request
+//
+// Returns:
+//      size_t: the number of requests submitted, submission stops at the first failure
+// ******************************************************
+size_t submitUSBControlRequests(const usb_handle_t *handle, const usb_control_request_t *requests, size_t count, usb_future_t **futures);
+
+// ******************************************************
+// Function: submitUSBBulkUpload()
+//
+// Purpose: Submit a USB bulk upload without waiting for it to complete
+//
+// Parameters:
+//      usb_handle_t *handle: the handle to use
+//      void *buffer: the buffer to send, which is not copied and must stay valid until the future completes
+//      size_t length: the length of the buffer
+//
+// Returns:
+//      usb_future_t *: the future of the upload, or NULL if it could not be submitted
+// ******************************************************
+usb_future_t *submitUSBBulkUpload(usb_handle_t *handle, void *buffer, size_t length);
+
+// ******************************************************
+// Function: waitUSBFuture()
+//
+// Purpose: Wait for a submitted USB request to complete
+//
+// Parameters:
+//      usb_future_t *future: the future to wait on
+//      unsigned timeout: how long to wait in milliseconds, or USB_FUTURE_WAIT_FOREVER
+//      transfer_ret_t *transferRet: the transfer return
+//
+// Returns:
+//      bool: true if the request completed, in which case the future is released, false on timeout
+// ******************************************************
+bool waitUSBFuture(usb_future_t *future, unsigned timeout, transfer_ret_t *transferRet);
+
+// ******************************************************
+// Function: waitAnyUSBFuture()
+//
+// Purpose: Wait for the first of several submitted USB requests to complete
+//
+// Parameters:
+//      usb_future_t **futures: the futures to wait on, all from the same handle, NULL entries are skipped
+//      size_t count: the number of entries in futures
+//      unsigned timeout: how long to wait in milliseconds, or USB_FUTURE_WAIT_FOREVER
+//      size_t *index: set to the index of the future that completed
+//      transfer_ret_t *transferRet: the transfer return of that future
+//
+// Returns:
+//      bool: true if a request completed, in which case its future is released and its entry set to NULL,
+//            false on timeout or if every entry is NULL
+// ******************************************************
+bool waitAnyUSBFuture(usb_future_t **futures, size_t count, unsigned timeout, size_t *index, transfer_ret_t *transferRet);
+
+// ******************************************************
+// Function: cancelUSBFuture()
+//
+// Purpose: Ask for a submitted USB request to be aborted, it must still be waited on afterwards
+//
+// Parameters:
+//      usb_future_t *future: the future to cancel
+//
+// Cancelling a request that has already completed has no effect. On IOKit, cancelling a control
+// request aborts every request in flight on the default pipe
+// ******************************************************
+void cancelUSBFuture(usb_future_t *future);
+
 // ******************************************************
 // Function: sendUSBControlRequestAsyncNoData()
 //
@@ -152,13 +372,13 @@ bool sendUSBControlRequestNoData(const usb_handle_t *handle, uint8_t bmRequestTy
 //      uint16_t wValue: the value
 //      uint16_t wIndex: the index
 //      size_t wLength: the length
-//      unsigned USBAbortTimeout: the timeout
-//      transfer_ret_t *transferRet: the transfer return
+//      unsigned usbAbortDelay: how long to wait before aborting the request, in microseconds
+//      transfer_ret_t *transferRet: the transfer return, which also records the achieved abort delay
 //
 // Returns:
 //      bool: true if the request was sent successfully, false otherwise
 // ******************************************************
-bool sendUSBControlRequestAsyncNoData(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, size_t wLength, unsigned USBAbortTimeout, transfer_ret_t *transferRet);
+bool sendUSBControlRequestAsyncNoData(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, size_t wLength, unsigned usbAbortDelay, transfer_ret_t *transferRet);
 
 // ******************************************************
 // Function: sendUSBBulkUpload()
@@ -169,11 +389,12 @@ bool sendUSBControlRequestAsyncNoData(const usb_handle_t *handle, uint8_t bmRequ
 //      usb_handle_t *handle: the handle to use
 //      void *buffer: the buffer to send
 //      size_t length: the length of the buffer
+//      unsigned timeout: how long to wait for the upload in milliseconds before cancelling it
 //
 // Returns:
-//      int: the IOReturn code
+//      int: the number of bytes sent, or -1 if the upload could not be submitted
 // ******************************************************
-int sendUSBBulkUpload(usb_handle_t *handle, void *buffer, size_t length);
+int sendUSBBulkUpload(usb_handle_t *handle, void *buffer, size_t length, unsigned timeout);
 
 // ******************************************************
 // Function: closeUSBHandle()
@@ -212,6 +433,23 @@ void initUSBHandle(usb_handle_t *handle, uint16_t vid, uint16_t pid);
 // ******************************************************
 bool waitUSBHandle(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg);
 
+// ******************************************************
+// Function: waitUSBHandleUntil()
+//
+// Purpose: Wait for a USB handle to become available, giving up after a timeout
+//
+// Parameters:
+//      usb_handle_t *handle: the handle to wait for
+//      usb_check_cb_t usb_check_cb: the callback to call when the handle is available
+//      void *arg: the argument to pass to the callback
+//      unsigned timeout: how long to keep trying in milliseconds, or USB_FUTURE_WAIT_FOREVER
+//      volatile bool *cancel: optional flag that stops the wait early when set
+//
+// Returns:
+//      bool: true if the handle is available, false otherwise, in which case nothing is left open
+// ******************************************************
+bool waitUSBHandleUntil(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg, unsigned timeout, volatile bool *cancel);
+
 // ******************************************************
 // Function: resetUSBHandle()
 //
@@ -219,8 +457,25 @@ bool waitUSBHandle(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg)
 //
 // Parameters:
 //      usb_handle_t *handle: the handle to reset
+//
+// Returns:
+//      bool: true if the handle is still usable after the reset, false if the device
+//            re-enumerated and has to be closed and opened again
 // ******************************************************
-void resetUSBHandle(usb_handle_t *handle);
+bool resetUSBHandle(usb_handle_t *handle);
+
+// ******************************************************
+// Function: getUSBHostControllerID()
+//
+// Purpose: Identify the host controller a USB handle is connected through
+//
+// Parameters:
+//      const usb_handle_t *handle: the handle to check
+//
+// Returns:
+//      uint32_t: the bus number of the handle
+// ******************************************************
+uint32_t getUSBHostControllerID(const usb_handle_t *handle);
 
 // ******************************************************
 // Function: sleep_ms()
@@ -232,4 +487,18 @@ void resetUSBHandle(usb_handle_t *handle);
 // ******************************************************
 void sleep_ms(unsigned ms);
 
+#ifndef ACHILLES_LIBUSB
+// ******************************************************
+// Function: cfDictionarySetInt16()
+//
+// Purpose: Set a 16-bit integer value in an IOKit matching dictionary
+//
+// Parameters:
+//      CFMutableDictionaryRef dict: the dictionary to update
+//      const void *key: the key to set
+//      uint16_t val: the value to set
+// ******************************************************
+void cfDictionarySetInt16(CFMutableDictionaryRef dict, const void *key, uint16_t val);
+#endif
+
 #endif // USB_UTILS_H
\ No newline at end of file
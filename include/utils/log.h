@@ -28,9 +28,14 @@ extern arg_t args[];
 //
 // Parameters:
 //      int time: the number of seconds to count down from
+//      bool endWithNewline: whether or not to print a newline at the end
 //      char *text: the message to print
+//      volatile bool *stop: optional flag that ends the countdown early when set
+//
+// Returns:
+//      bool: true if the countdown finished, false if it was stopped early
 // ******************************************************
-void step(int time, bool endWithNewline, char *text);
+bool step(int time, bool endWithNewline, char *text, volatile bool *stop);
 
 // ******************************************************
 // Function: AchillesLog()
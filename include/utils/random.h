@@ -0,0 +1,22 @@
+#ifndef RANDOM_H
+#define RANDOM_H
+
+#include <Achilles.h>
+#include <stdint.h>
+
+// ******************************************************
+// Function: getRandom()
+//
+// Purpose: Advance a xorshift64* generator and return its next number
+//
+// Parameters:
+//      uint64_t *state: the state of the generator, which must not be zero
+//
+// Returns:
+//      uint64_t: the next number, the high bits are the most random
+//
+// This is fast and reproducible from a seed, but not suitable for anything that needs to be unpredictable
+// ******************************************************
+uint64_t getRandom(uint64_t *state);
+
+#endif // RANDOM_H
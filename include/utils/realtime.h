@@ -0,0 +1,58 @@
+#ifndef REALTIME_H
+#define REALTIME_H
+
+#include <Achilles.h>
+#include <utils/log.h>
+#include <stdint.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#else
+#include <sched.h>
+#endif
+
+#define REALTIME_STACK_PREFAULT 0x40000 // Bytes of stack to touch before locking memory
+
+typedef struct {
+	bool active;
+	bool pinned, scheduled, locked;
+	int oldNice;
+#ifndef __APPLE__
+	cpu_set_t oldAffinity;
+	int oldPolicy;
+	struct sched_param oldParam;
+#endif
+} realtime_state_t;
+
+// ******************************************************
+// Function: enterRealtimeMode()
+//
+// Purpose: Prepare the calling thread for timing-sensitive work by pinning it to a single core,
+//          raising it to a real-time scheduling class and locking the process memory
+//
+// Parameters:
+//      realtime_state_t *state: filled in with what was changed, so it can be undone
+//
+// Returns:
+//      bool: true if real-time scheduling was granted, false if only some of the steps succeeded
+//
+// Each step falls back gracefully if the required permission is missing
+// ******************************************************
+bool enterRealtimeMode(realtime_state_t *state);
+
+// ******************************************************
+// Function: exitRealtimeMode()
+//
+// Purpose: Restore the scheduling, affinity and memory locking of the calling thread
+//
+// Parameters:
+//      realtime_state_t *state: the state returned by enterRealtimeMode(), safe to pass more than once
+// ******************************************************
+void exitRealtimeMode(realtime_state_t *state);
+
+#endif // REALTIME_H
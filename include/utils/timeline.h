@@ -0,0 +1,85 @@
+#ifndef TIMELINE_H
+#define TIMELINE_H
+
+#include <Achilles.h>
+#include <utils/log.h>
+#include <utils/timer.h>
+#include <stdint.h>
+#include <stdarg.h>
+
+#define TIMELINE_MAX_SPANS 512
+#define TIMELINE_NAME_SIZE 96
+
+typedef struct {
+	char name[TIMELINE_NAME_SIZE];
+	const char *category;
+	uint64_t start, end; // Monotonic nanoseconds, end is 0 while the span is open
+	uint64_t controlTransfers, controlBytes, bulkBytes; // Counted from the start, then replaced by the totals for the span
+	uint64_t recorded, replayed; // Time around the transfers replayed by the simulator, in the recording and in this run
+} timeline_span_t;
+
+// ******************************************************
+// Function: beginTimelineSpan()
+//
+// Purpose: Start timing a span of work and snapshot the USB transfer counters
+//
+// Parameters:
+//      const char *category: the category of the span, e.g. "exploit" or "pongo"
+//      const char *format: printf-style format of the span name
+//
+// Returns:
+//      int: the span to pass to endTimelineSpan(), or -1 if the timeline is full
+// ******************************************************
+int beginTimelineSpan(const char *category, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+// ******************************************************
+// Function: endTimelineSpan()
+//
+// Purpose: Stop timing a span and record how many USB transfers and bytes it made
+//
+// Parameters:
+//      int span: the span returned by beginTimelineSpan(), -1 is ignored
+// ******************************************************
+void endTimelineSpan(int span);
+
+// ******************************************************
+// Function: getTimelineSpans()
+//
+// Purpose: Look at the spans recorded so far, e.g. to aggregate them over several runs
+//
+// Parameters:
+//      const timeline_span_t **spans: set to the first span, spans with an end of 0 are still open
+//
+// Returns:
+//      size_t: the number of spans
+// ******************************************************
+size_t getTimelineSpans(const timeline_span_t **spans);
+
+// ******************************************************
+// Function: resetTimeline()
+//
+// Purpose: Forget every recorded span, so the next run starts with an empty timeline
+// ******************************************************
+void resetTimeline(void);
+
+// ******************************************************
+// Function: writeTimeline()
+//
+// Purpose: Export every recorded span as a Chrome trace-event JSON file
+//
+// Parameters:
+//      const char *path: the file to write, which can be opened in chrome://tracing or Perfetto
+//
+// Returns:
+//      bool: true if the file was written, false otherwise
+// ******************************************************
+bool writeTimeline(const char *path);
+
+// ******************************************************
+// Function: printTimeline()
+//
+// Purpose: Log how long each span took and, when replaying, how much longer than in the recording
+// ******************************************************
+void printTimeline(void);
+
+#endif // TIMELINE_H
@@ -0,0 +1,33 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <Achilles.h>
+#include <stdint.h>
+#include <time.h>
+
+// ******************************************************
+// Function: getMonotonicTime()
+//
+// Purpose: Read a high-resolution monotonic clock
+//
+// Returns:
+//      uint64_t: the current time in nanoseconds, only meaningful relative to other readings
+// ******************************************************
+uint64_t getMonotonicTime(void);
+
+// ******************************************************
+// Function: sleepUntil()
+//
+// Purpose: Sleep until a deadline on the monotonic clock, optionally busy-waiting
+//          for the final stretch to avoid scheduler wake-up latency
+//
+// Parameters:
+//      uint64_t deadline: the deadline in nanoseconds, from getMonotonicTime()
+//      uint64_t spin: how many nanoseconds before the deadline to stop sleeping and busy-wait
+//
+// Returns:
+//      uint64_t: the time at which the function returned, in nanoseconds
+// ******************************************************
+uint64_t sleepUntil(uint64_t deadline, uint64_t spin);
+
+#endif // TIMER_H
@@ -122,13 +122,17 @@ bool bootPongoOS(device_t *device)
     void *PongoOS;
     size_t pongoSize;
     transfer_ret_t ret;
-    if (!preparePongoOS(&PongoOS, &pongoSize)) { return false; }
+    int span = beginTimelineSpan("pongo", "Pongo prep");
+    bool prepared = preparePongoOS(&PongoOS, &pongoSize);
+    endTimelineSpan(span);
+    if (!prepared) { return false; }
     if (PongoOS == NULL) {
         LOG(LOG_ERROR, "Failed to get PongoOS");
         return false;
     }
 
     LOG(LOG_DEBUG, "Sending PongoOS of size 0x%X", pongoSize);
+    span = beginTimelineSpan("pongo", "Pongo send");
     {
         size_t lengthSent = 0, size;
         while (lengthSent < pongoSize) 
@@ -145,11 +149,14 @@ bool bootPongoOS(device_t *device)
         }
     }
     sendUSBControlRequestNoData(&device->handle, 0x21, DFU_CLRSTATUS, 0, 0, 0, NULL);
+    endTimelineSpan(span);
+    span = beginTimelineSpan("pongo", "Pongo wait");
     resetUSBHandle(&device->handle);
     closeUSBHandle(&device->handle);
     initUSBHandle(&device->handle, 0x05ac, 0x4141);
     LOG(LOG_INFO, "Waiting for PongoOS to boot");
     waitUSBHandle(&device->handle, NULL, NULL);
     awaitPongoOS(&device->handle);
+    endTimelineSpan(span);
     return true;
 }
\ No newline at end of file
@@ -22,6 +22,7 @@ bool issuePongoCommand(usb_handle_t *handle, char *command)
 		return EINVAL;
 	}
     LOG(LOG_DEBUG, "Executing PongoOS command: '%s'", command);
+	int span = beginTimelineSpan("pongo", "Pongo command: %s", command);
 	snprintf(commandBuffer, 512, "%s\n", command);
 	len = strlen(commandBuffer);
 	ret = sendUSBControlRequestNoData(handle, 0x21, 4, 1, 0, 0, NULL);
@@ -30,6 +31,7 @@ bool issuePongoCommand(usb_handle_t *handle, char *command)
 	ret = sendUSBControlRequest(handle, 0x21, 3, 0, 0, commandBuffer, (uint32_t)len, NULL);
 	sleep(1);
 bad:
+	endTimelineSpan(span);
 	if (!ret)
 	{
         if (command != NULL && (!strncmp("boot", command, 4))) {
@@ -47,11 +49,11 @@ bad:
 int uploadFileToPongo(usb_handle_t *handle, unsigned char *data, unsigned int dataLength)
 {
 	bool ret;
+	int span = beginTimelineSpan("pongo", "Pongo upload: 0x%X bytes", dataLength);
 	ret = sendUSBControlRequest(handle, 0x21, 1, 0, 0, (unsigned char *)&dataLength, 4, NULL);
 	if (ret)
 	{
-        int bulkRet = sendUSBBulkUpload(handle, data, dataLength);
-#ifdef ACHILLES_LIBUSB
+        int bulkRet = sendUSBBulkUpload(handle, data, dataLength, USB_BULK_TIMEOUT);
 		if (bulkRet == dataLength)
 		{
 			LOG(LOG_DEBUG, "Uploaded 0x%X bytes to PongoOS", dataLength);
@@ -59,14 +61,6 @@ int uploadFileToPongo(usb_handle_t *handle, unsigned char *data, unsigned int da
 			LOG(LOG_ERROR, "Failed to upload 0x%X bytes to PongoOS, sent 0x%X bytes", dataLength, bulkRet);
 			ret = false;
 		}
-#else
-		if (bulkRet == kIOReturnSuccess)
-		{
-		    LOG(LOG_DEBUG, "Uploaded 0x%X bytes to PongoOS", dataLength);
-		} else {
-            LOG(LOG_ERROR, "Failed to upload 0x%X bytes to PongoOS", dataLength);
-        }
-#endif
 	}
 	resetUSBHandle(handle);
 	closeUSBHandle(handle);
@@ -74,6 +68,7 @@ int uploadFileToPongo(usb_handle_t *handle, unsigned char *data, unsigned int da
 	initUSBHandle(handle, 0x5ac, 0x4141);
 	waitUSBHandle(handle, NULL, NULL);
 	sleep(3);
+	endTimelineSpan(span);
 	return ret;
 }
 
@@ -0,0 +1,171 @@
+#include <exploit/abort-model.h>
+#include <utils/timer.h>
+#include <utils/random.h>
+
+static uint64_t randomState;
+
+// Purpose: Return a pseudo-random number, seeded from the monotonic clock on first use
+static uint32_t abortModelRandom(void) {
+	if (randomState == 0) {
+		randomState = getMonotonicTime() | 1;
+	}
+	return (uint32_t)(getRandom(&randomState) >> 32);
+}
+
+// Purpose: Build the path of the state file, creating its directory if needed
+static bool getAbortModelPath(char *path, size_t size) {
+	char *home = getenv("HOME");
+	char *slash;
+	if (home == NULL || home[0] == '\0') {
+		return false;
+	}
+	if (snprintf(path, size, "%s/%s", home, ABORT_MODEL_FILE) >= size) {
+		return false;
+	}
+	slash = strrchr(path, '/');
+	*slash = '\0';
+	mkdir(path, 0755);
+	*slash = '/';
+	return true;
+}
+
+static unsigned getAbortModelBucket(unsigned delay) {
+	return MIN(delay / ABORT_MODEL_BUCKET_WIDTH, ABORT_MODEL_BUCKETS - 1);
+}
+
+bool loadAbortModel(abort_model_t *model, uint16_t cpid, uint32_t host) {
+	char path[PATH_MAX], line[2048], *p;
+	unsigned lineCPID, lineHost, stage, i;
+	bool found = false;
+	int consumed;
+	FILE *file;
+
+	memset(model, 0, sizeof(abort_model_t));
+	model->cpid = cpid;
+	model->host = host;
+	if (!getAbortModelPath(path, sizeof(path)) || (file = fopen(path, "r")) == NULL) {
+		return false;
+	}
+	while (fgets(line, sizeof(line), file) != NULL) {
+		if (sscanf(line, "%x %x %u%n", &lineCPID, &lineHost, &stage, &consumed) != 3
+		|| lineCPID != cpid || lineHost != host || stage >= ABORT_STAGE_COUNT) {
+			continue;
+		}
+		p = line + consumed;
+		for (i = 0; i < ABORT_MODEL_BUCKETS; i++) {
+			if (sscanf(p, " %u/%u%n", &model->successes[stage][i], &model->attempts[stage][i], &consumed) != 2) {
+				break;
+			}
+			p += consumed;
+		}
+		if (i != ABORT_MODEL_BUCKETS) {
+			LOG(LOG_DEBUG, "Ignoring malformed abort model entry for CPID 0x%X", cpid);
+			memset(model->successes[stage], 0, sizeof(model->successes[stage]));
+			memset(model->attempts[stage], 0, sizeof(model->attempts[stage]));
+			continue;
+		}
+		found = true;
+	}
+	fclose(file);
+	return found;
+}
+
+bool saveAbortModel(abort_model_t *model) {
+	char path[PATH_MAX], tempPath[PATH_MAX], line[2048];
+	unsigned lineCPID, lineHost, stage, i;
+	FILE *file, *temp;
+
+	if (!getAbortModelPath(path, sizeof(path)) || snprintf(tempPath, sizeof(tempPath), "%s.tmp", path) >= sizeof(tempPath)) {
+		return false;
+	}
+	if ((temp = fopen(tempPath, "w")) == NULL) {
+		LOG(LOG_DEBUG, "Failed to open %s for writing", tempPath);
+		return false;
+	}
+
+	// Keep the entries for other devices and hosts
+	if ((file = fopen(path, "r")) != NULL) {
+		while (fgets(line, sizeof(line), file) != NULL) {
+			if (sscanf(line, "%x %x %u", &lineCPID, &lineHost, &stage) == 3
+			&& lineCPID == model->cpid && lineHost == model->host) {
+				continue;
+			}
+			fputs(line, temp);
+		}
+		fclose(file);
+	}
+
+	for (stage = 0; stage < ABORT_STAGE_COUNT; stage++) {
+		fprintf(temp, "%04x %08x %u", model->cpid, model->host, stage);
+		for (i = 0; i < ABORT_MODEL_BUCKETS; i++) {
+			fprintf(temp, " %u/%u", model->successes[stage][i], model->attempts[stage][i]);
+		}
+		fputc('\n', temp);
+	}
+
+	if (fclose(temp) != 0 || rename(tempPath, path) != 0) {
+		LOG(LOG_DEBUG, "Failed to save abort model to %s", path);
+		unlink(tempPath);
+		return false;
+	}
+	return true;
+}
+
+unsigned sampleAbortDelay(abort_model_t *model, abort_stage_t stage, unsigned fallback) {
+	double weights[ABORT_MODEL_BUCKETS], total = 0, rate, target;
+	unsigned bucket;
+
+	if (model->misses[stage] >= ABORT_MODEL_MAX_MISSES) {
+		// What the model learned no longer wins, sweep the whole range again
+		return fallback;
+	}
+	for (bucket = 0; bucket < ABORT_MODEL_BUCKETS; bucket++) {
+		weights[bucket] = 0;
+		if (model->successes[stage][bucket] != 0) {
+			// Laplace-smoothed success rate, squared to favour the best buckets
+			rate = (model->successes[stage][bucket] + 1.0) / (model->attempts[stage][bucket] + 2.0);
+			weights[bucket] = rate * rate;
+			total += weights[bucket];
+		}
+	}
+	if (total == 0) {
+		// Nothing learned yet, keep sweeping
+		return fallback;
+	}
+
+	target = abortModelRandom() / 4294967296.0 * total;
+	for (bucket = 0; bucket < ABORT_MODEL_BUCKETS - 1 && target >= weights[bucket]; bucket++) {
+		target -= weights[bucket];
+	}
+	while (weights[bucket] == 0 && bucket > 0) {
+		bucket--; // Rounding pushed us past the last weighted bucket
+	}
+
+	// Occasionally try a neighbour so the model can follow a change in timing
+	if (abortModelRandom() % 10 == 0) {
+		if (abortModelRandom() % 2 == 0) {
+			bucket = bucket > 0 ? bucket - 1 : bucket + 1;
+		} else {
+			bucket = bucket < ABORT_MODEL_BUCKETS - 1 ? bucket + 1 : bucket - 1;
+		}
+	}
+	return bucket * ABORT_MODEL_BUCKET_WIDTH + abortModelRandom() % ABORT_MODEL_BUCKET_WIDTH;
+}
+
+void recordAbortResult(abort_model_t *model, abort_stage_t stage, unsigned delay, bool won) {
+	unsigned bucket = getAbortModelBucket(delay), i;
+	model->attempts[stage][bucket]++;
+	if (won) {
+		model->successes[stage][bucket]++;
+		model->misses[stage] = 0;
+	} else {
+		model->misses[stage]++;
+	}
+	if (model->attempts[stage][bucket] > ABORT_MODEL_MAX_ATTEMPTS) {
+		// Decay the whole stage so the model keeps adapting
+		for (i = 0; i < ABORT_MODEL_BUCKETS; i++) {
+			model->attempts[stage][i] /= 2;
+			model->successes[stage][i] /= 2;
+		}
+	}
+}
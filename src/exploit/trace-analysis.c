@@ -0,0 +1,229 @@
+#include <exploit/trace-analysis.h>
+
+#define TRACE_BULK_KEY 0x10000
+
+typedef struct {
+	trace_time_t kind;
+	trace_stage_t stage; // The stage of the transfer before the wait, which is what the host was waiting on
+	unsigned before, after; // Request keys of the transfers on either side
+	size_t count;
+	uint64_t total, longest;
+} trace_wait_t;
+
+static const char *traceStageNames[TRACE_STAGE_COUNT] = {"Connecting", "Reset", "Heap spray", "UaF trigger", "Payload", "PongoOS upload", "PongoOS commands"};
+static const char *pongoRequestNames[] = {NULL, "Pongo upload size", NULL, "Pongo command", "Pongo command start"};
+
+// Purpose: Whether a transfer is the device or serial number descriptor read when a handle is opened
+static bool isTraceDeviceOpen(const usb_trace_transfer_t *transfer, bool serial) {
+	uint16_t wValue = transfer->setup[2] | transfer->setup[3] << 8, wIndex = transfer->setup[4] | transfer->setup[5] << 8;
+	if (!transfer->control || transfer->setup[0] != 0x80 || transfer->setup[1] != 6) {
+		return false;
+	}
+	return wValue >> 8 == 1 || (serial && wValue >> 8 == 3 && wIndex == 0x409);
+}
+
+static unsigned getTraceRequestKey(const usb_trace_transfer_t *transfer) {
+	return transfer->control ? (unsigned)transfer->setup[0] << 8 | transfer->setup[1] : TRACE_BULK_KEY;
+}
+
+void classifyUSBTrace(const usb_trace_transfer_t *transfers, size_t count, trace_stage_t *stages) {
+	const usb_trace_transfer_t *transfer;
+	trace_stage_t stage = TRACE_STAGE_CONNECT, next;
+	bool opened = false, won = false, dnload, spray;
+	uint16_t wIndex, wLength;
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		transfer = &transfers[i];
+		next = stage;
+		wIndex = transfer->setup[4] | transfer->setup[5] << 8;
+		wLength = transfer->setup[6] | transfer->setup[7] << 8;
+		dnload = transfer->control && transfer->setup[0] == 0x21 && transfer->setup[1] == DFU_DNLOAD;
+		// The stall and leak requests of checkm8Stall() and friends, also sent by checkm8SendPayload() on A10 and A11
+		spray = transfer->control && ((transfer->setup[0] == 0x80 && transfer->setup[1] == 6 && transfer->setup[2] == 4 && transfer->setup[3] == 3)
+			|| (transfer->setup[0] == 0x2 && transfer->setup[1] == 3 && wIndex == 0x80));
+
+		if (isTraceDeviceOpen(transfer, true)) {
+			opened = true;
+		} else if (!transfer->control) {
+			next = TRACE_STAGE_PONGO_COMMANDS;
+		} else if (stage >= TRACE_STAGE_PONGO) {
+			// PongoOS is opened again once it boots, and only takes commands from then on
+			if (stage == TRACE_STAGE_PONGO && opened && transfer->setup[0] == 0x21) {
+				next = TRACE_STAGE_PONGO_COMMANDS;
+			}
+		} else if (stage == TRACE_STAGE_PAYLOAD) {
+			// The device re-enumerates in download mode after the YoloDFU payload
+			if (opened && dnload) {
+				next = TRACE_STAGE_PONGO;
+			}
+		} else if (stage == TRACE_STAGE_TRIGGER && won) {
+			// checkm8TriggerUaF() clears the status after winning, anything else is the payload
+			if (transfer->setup[0] != 0x21 || transfer->setup[1] != DFU_CLRSTATUS) {
+				next = TRACE_STAGE_PAYLOAD;
+			}
+		} else if (dnload && wLength == DFU_FILE_SUFFIX_LENGTH) {
+			next = TRACE_STAGE_RESET;
+		} else if (spray && stage < TRACE_STAGE_HEAP_SPRAY) {
+			next = TRACE_STAGE_HEAP_SPRAY;
+		} else if (dnload && wLength == DFU_MAX_TRANSFER_SIZE && stage < TRACE_STAGE_TRIGGER) {
+			// Without a heap spray first, this is PongoOS being sent to a device already in download mode
+			next = stage == TRACE_STAGE_HEAP_SPRAY ? TRACE_STAGE_TRIGGER : TRACE_STAGE_PONGO;
+		} else if (stage == TRACE_STAGE_TRIGGER && transfer->setup[0] == 0 && transfer->setup[1] == 0 && transfer->status == -USBMON_EPIPE) {
+			won = true;
+		}
+
+		if (next != stage) {
+			stage = next;
+			opened = won = false;
+		}
+		stages[i] = stage;
+	}
+}
+
+// Purpose: Describe a request, using the PongoOS names for requests sent to PongoOS
+static void getTraceRequestLabel(char *label, size_t size, unsigned key, trace_stage_t stage) {
+	uint8_t bmRequestType = key >> 8, bRequest = key & 0xFF;
+	const char *name;
+
+	if (key == TRACE_BULK_KEY) {
+		snprintf(label, size, "bulk upload");
+		return;
+	}
+	if (stage == TRACE_STAGE_PONGO_COMMANDS && bmRequestType == 0x21 && bRequest < sizeof(pongoRequestNames) / sizeof(pongoRequestNames[0])
+	&& pongoRequestNames[bRequest] != NULL) {
+		name = pongoRequestNames[bRequest];
+	} else {
+		name = getUSBRequestName(bmRequestType, bRequest);
+	}
+	if (name != NULL) {
+		snprintf(label, size, "0x%02X 0x%02X %s", bmRequestType, bRequest, name);
+	} else {
+		snprintf(label, size, "0x%02X 0x%02X", bmRequestType, bRequest);
+	}
+}
+
+static int compareTraceWaits(const void *a, const void *b) {
+	const trace_wait_t *left = a, *right = b;
+	return (left->total < right->total) - (left->total > right->total);
+}
+
+// Purpose: Add a gap to the wait with the same cause, starting a new one if there is room
+static void recordTraceWait(trace_wait_t *waits, size_t *count, trace_time_t kind, trace_stage_t stage, unsigned before, unsigned after, uint64_t gap) {
+	trace_wait_t *wait;
+	size_t i;
+
+	for (i = 0; i < *count; i++) {
+		wait = &waits[i];
+		if (wait->kind == kind && wait->stage == stage && wait->before == before && wait->after == after) {
+			break;
+		}
+	}
+	if (i == *count) {
+		if (*count == TRACE_ANALYSIS_MAX_WAITS) {
+			return;
+		}
+		waits[(*count)++] = (trace_wait_t){ kind, stage, before, after, 0, 0, 0 };
+	}
+	wait = &waits[i];
+	wait->count++;
+	wait->total += gap;
+	wait->longest = MAX(wait->longest, gap);
+}
+
+bool analyseUSBTrace(const char *path) {
+	usb_trace_transfer_t *transfers, *transfer;
+	trace_stage_report_t report[TRACE_STAGE_COUNT], totals;
+	trace_stage_t *stages;
+	trace_wait_t *waits;
+	trace_time_t kind;
+	uint64_t end, gap, total;
+	size_t count, waitCount = 0, i, j;
+	char before[48], after[48];
+
+	if (!readUSBTrace(path, &transfers, &count)) {
+		return false;
+	}
+	if (count == 0) {
+		LOG(LOG_ERROR, "%s has no control or bulk transfers", path);
+		freeUSBTrace(transfers, count);
+		return false;
+	}
+	stages = malloc(count * sizeof(trace_stage_t));
+	waits = malloc(TRACE_ANALYSIS_MAX_WAITS * sizeof(trace_wait_t));
+	if (stages == NULL || waits == NULL) {
+		LOG(LOG_ERROR, "Failed to allocate memory for the analysis");
+		free(stages);
+		free(waits);
+		freeUSBTrace(transfers, count);
+		return false;
+	}
+	classifyUSBTrace(transfers, count, stages);
+
+	// Walk the recording once, splitting it into time with a transfer in flight and the gaps in between,
+	// so every nanosecond is counted exactly once
+	memset(report, 0, sizeof(report));
+	end = transfers[0].submitted;
+	for (i = 0; i < count; i++) {
+		transfer = &transfers[i];
+		if (i == 0 || stages[i] != stages[i - 1]) {
+			report[stages[i]].attempts++;
+		}
+		report[stages[i]].transfers++;
+		if (transfer->submitted > end) {
+			gap = transfer->submitted - end;
+			if (isTraceDeviceOpen(transfer, false) || transfer->device != transfers[i - 1].device || transfer->bus != transfers[i - 1].bus) {
+				kind = TRACE_TIME_DEVICE;
+			} else {
+				kind = gap >= TRACE_ANALYSIS_SLEEP_THRESHOLD ? TRACE_TIME_SLEEP : TRACE_TIME_HOST;
+			}
+			report[stages[i - 1]].time[kind] += gap;
+			if (kind != TRACE_TIME_HOST) {
+				recordTraceWait(waits, &waitCount, kind, stages[i - 1], getTraceRequestKey(&transfers[i - 1]), getTraceRequestKey(transfer), gap);
+			}
+			end = transfer->submitted;
+		}
+		if (transfer->completed > end) {
+			report[stages[i]].time[TRACE_TIME_TRANSFER] += transfer->completed - end;
+			end = transfer->completed;
+		}
+	}
+	total = end - transfers[0].submitted;
+
+	LOG(LOG_INFO, "%s: %zu transfers over %.3fs", path, count, total / 1e9);
+	LOG(LOG_INFO, "Time per stage in milliseconds, as transferring / sleeping / waiting for the device / host:");
+	memset(&totals, 0, sizeof(totals));
+	for (i = 0; i < TRACE_STAGE_COUNT; i++) {
+		if (report[i].transfers == 0) {
+			continue;
+		}
+		for (j = 0, gap = 0; j < TRACE_TIME_COUNT; j++) {
+			gap += report[i].time[j];
+			totals.time[j] += report[i].time[j];
+		}
+		LOG(LOG_INFO, "%s: %.3f (%.1f%%), %zu transfers in %zu attempts, %.3f / %.3f / %.3f / %.3f",
+			traceStageNames[i], gap / 1e6, total != 0 ? 100.0 * gap / total : 0, report[i].transfers, report[i].attempts,
+			report[i].time[TRACE_TIME_TRANSFER] / 1e6, report[i].time[TRACE_TIME_SLEEP] / 1e6,
+			report[i].time[TRACE_TIME_DEVICE] / 1e6, report[i].time[TRACE_TIME_HOST] / 1e6);
+	}
+	LOG(LOG_INFO, "Total: %.3f, %.3f / %.3f / %.3f / %.3f", total / 1e6, totals.time[TRACE_TIME_TRANSFER] / 1e6,
+		totals.time[TRACE_TIME_SLEEP] / 1e6, totals.time[TRACE_TIME_DEVICE] / 1e6, totals.time[TRACE_TIME_HOST] / 1e6);
+
+	qsort(waits, waitCount, sizeof(trace_wait_t), compareTraceWaits);
+	if (waitCount != 0) {
+		LOG(LOG_INFO, "Longest waits, grouped by the requests on either side:");
+	}
+	for (i = 0; i < MIN(waitCount, TRACE_ANALYSIS_TOP_WAITS); i++) {
+		getTraceRequestLabel(before, sizeof(before), waits[i].before, waits[i].stage);
+		getTraceRequestLabel(after, sizeof(after), waits[i].after, waits[i].stage);
+		LOG(LOG_INFO, "%s: %.3fms (%.1f%%) over %zu gaps of up to %.3fms, in %s between %s and %s",
+			waits[i].kind == TRACE_TIME_SLEEP ? "Sleeping" : "Waiting for the device", waits[i].total / 1e6,
+			total != 0 ? 100.0 * waits[i].total / total : 0, waits[i].count, waits[i].longest / 1e6,
+			traceStageNames[waits[i].stage], before, after);
+	}
+
+	free(stages);
+	free(waits);
+	freeUSBTrace(transfers, count);
+	return true;
+}
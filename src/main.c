@@ -1,5 +1,10 @@
 #include <Achilles.h>
 #include <exploit/exploit.h>
+#include <usb/stats.h>
+#include <usb/trace.h>
+#include <usb/simulator.h>
+#include <usb/faults.h>
+#include <exploit/trace-analysis.h>
 
 arg_t args[] = {
     // Name, short option, long option, description, examples, type, value
@@ -7,6 +12,21 @@ arg_t args[] = {
     {"Debug", "-d", "--debug", "Enable debug logging", NULL, false, FLAG_BOOL, false},
     {"Help", "-h", "--help", "Show this help message", NULL, false, FLAG_BOOL, false},
     {"Quick mode", "-q", "--quick", "Don't ask for confirmation during the program", NULL, false, FLAG_BOOL, false},
+    {"Automatic DFU", "-a", "--auto-dfu", "Don't prompt for DFU mode, for fixtures that press the buttons automatically", NULL, false, FLAG_BOOL, false},
+    {"Precise abort", "-A", "--precise-abort", "Busy-wait for the final microseconds before aborting USB requests during the exploit", NULL, false, FLAG_BOOL, false},
+    {"Real-time", "-r", "--realtime", "Pin the exploit to one CPU core with real-time scheduling and locked memory", NULL, false, FLAG_BOOL, false},
+    {"Timeline", "-T", "--timeline", "Write how long each stage took to a Chrome trace file", "-T timeline.json", false, FLAG_STRING, NULL},
+    {"Statistics", "-S", "--stats", "Print USB transfer counts and latencies per request type on exit", NULL, false, FLAG_BOOL, false},
+    {"Record", "-w", "--record", "Record every USB transfer to a pcap file", "-w achilles.pcap", false, FLAG_STRING, NULL},
+    {"Record payload", "-W", "--record-payload", "Bytes of data to keep per transfer when recording, 2048 by default", "-W 64", false, FLAG_STRING, NULL},
+    {"Analyse", "-Y", "--analyse", "Print where the time went in a recording, stage by stage, and exit", "-Y achilles.pcap", false, FLAG_STRING, NULL},
+    #ifdef ACHILLES_LIBUSB
+    {"Replay", "-y", "--replay", "Replay a recording instead of talking to a device, and compare the timings", "-y achilles.pcap", false, FLAG_STRING, NULL},
+    #endif
+    {"Faults", "-F", "--faults", "Inject USB stalls, short transfers, timeouts, disconnects and latency from a rules file", "-F faults.txt", false, FLAG_STRING, NULL},
+    #ifdef BENCH
+    {"Iterations", "-n", "--iterations", "Runs of the end-to-end benchmark with -p or -j, 20 by default", "-n 100", false, FLAG_INT, 0},
+    #endif
     {"Exploit", "-e", "--exploit", "Exploit with checkm8 and exit", NULL, false, FLAG_BOOL, false},
     {"PongoOS", "-p", "--pongo", "Boot to PongoOS and exit" , NULL, false, FLAG_BOOL, false},
     {"Jailbreak", "-j", "--jailbreak", "Jailbreak rootless using palera1n kpf, ramdisk and overlay", NULL, false, FLAG_BOOL, false},
@@ -94,6 +114,17 @@ bool checkForContradictions() {
     return false;
 }
 
+// Purpose: Check if an argument is the value of the integer option before it, as in -n 100, rather than an option of its own
+bool isIntegerValue(char *previousArg, char *value) {
+    arg_t *arg = findMatchingArgument(previousArg);
+    char *end;
+    if (arg == NULL || arg->type != FLAG_INT || value[0] == '\0') {
+        return false;
+    }
+    strtol(value, &end, 10);
+    return *end == '\0';
+}
+
 bool parseMultipleShortArgs(char *multipleArgs) {
     bool unrecognisedOption = false;
     for (int i = 1; i < strlen(multipleArgs); i++) {
@@ -129,6 +160,9 @@ bool checkForUnrecognisedArguments(int argc, char *argv[]) {
             && findMatchingArgument(argv[i - 1])->type == FLAG_STRING) {
                 continue;
             }
+            if (isIntegerValue(argv[i - 1], argv[i])) {
+                continue;
+            }
             if (strstr(argv[i], "--") == NULL
             && strstr(argv[i], "-") != NULL
             && argv[i][0] == '-'
@@ -155,6 +189,10 @@ void parseArguments(int argc, char *argv[]) {
                     previousArg->set = true;
                 }
             }
+            else if (isIntegerValue(argv[i - 1], argv[i])) {
+                // Replaces the count the option itself added
+                findMatchingArgument(argv[i - 1])->intVal = (int)strtol(argv[i], NULL, 10);
+            }
             else {
                 arg_t *arg = findMatchingArgument(argv[i]);
                 if (arg == NULL) {
@@ -199,6 +237,14 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+#if defined(TESTS)
+    extern int tests(void);
+    return tests();
+#elif defined(BENCH)
+    extern int bench(void);
+    return bench();
+#endif
+
     arg_t *verbosityArg = getArgumentByName("Verbosity");
     if (verbosityArg->intVal > 2)
     {
@@ -232,7 +278,37 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    if (getArgumentByName("Analyse")->set) {
+        return analyseUSBTrace(getArgumentByName("Analyse")->stringVal) ? 0 : -1;
+    }
+
+    if (getArgumentByName("Statistics")->boolVal) {
+        atexit(printUSBStats);
+    }
+
+    if (getArgumentByName("Record")->set) {
+        arg_t *payloadArg = getArgumentByName("Record payload");
+        if (startUSBTrace(getArgumentByName("Record")->stringVal, payloadArg->set ? strtoul(payloadArg->stringVal, NULL, 0) : USB_TRACE_MAX_PAYLOAD)) {
+            atexit(stopUSBTrace);
+        }
+    }
+
 #ifdef ACHILLES_LIBUSB
+    if (getArgumentByName("Replay")->set && !startUSBSimulator(getArgumentByName("Replay")->stringVal)) {
+        return -1;
+    }
+#endif
+
+    if (getArgumentByName("Faults")->set) {
+        if (!startUSBFaults(getArgumentByName("Faults")->stringVal)) {
+            return -1;
+        }
+        atexit(printUSBFaults);
+    }
+
+#if defined(ACHILLES_USBFS)
+    char *usbBackend = "usbfs";
+#elif defined(ACHILLES_LIBUSB)
     char *usbBackend = "libusb";
 #else
     char *usbBackend = "IOKit";
@@ -240,11 +316,13 @@ int main(int argc, char *argv[])
 
     struct utsname buffer;
     uname(&buffer);
+#ifndef ACHILLES_USBFS
     if (strcmp(buffer.sysname, "Darwin") != 0)
     {
         LOG(LOG_ERROR, "This tool is only supported on macOS");
         return -1;
     }
+#endif
     LOG(LOG_DEBUG, "%s v%s, running on %s %s, %s", NAME, VERSION, buffer.sysname, buffer.machine, usbBackend);
 
     if (!getArgumentByName("Exploit")->set
@@ -277,5 +355,12 @@ int main(int argc, char *argv[])
 
     checkm8();
 
+#ifdef ACHILLES_LIBUSB
+    if (getArgumentByName("Replay")->set) {
+        printTimeline();
+        stopUSBSimulator();
+    }
+#endif
+
     return 0;
 }
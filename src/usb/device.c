@@ -8,6 +8,14 @@ device_t initDevice(char *serialNumber, DeviceMode mode, int vid, int pid)
     handle.vid = vid;
     handle.pid = pid;
     handle.device = NULL;
+    handle.context = NULL;
+    handle.events = NULL;
+    handle.pool = NULL;
+    handle.simulated = false;
+#ifdef ACHILLES_USBFS
+    handle.fd = handle.epollFd = -1;
+    handle.fdInterface = false;
+#endif
     dev.handle = handle;
     dev.serialNumber = serialNumber;
     dev.mode = mode;
@@ -23,6 +31,9 @@ device_t initDevice(io_service_t device, char *serialNumber, DeviceMode mode, in
     handle.vid = vid;
     handle.pid = pid;
     handle.device = NULL;
+    handle.interface = NULL;
+    handle.interface_event_source = NULL;
+    handle.pool = NULL;
     dev.handle = handle;
     dev.serialNumber = serialNumber;
     dev.mode = mode;
@@ -35,38 +46,56 @@ device_t initDevice(io_service_t device, char *serialNumber, DeviceMode mode, in
 
 
 int findUSBDevice(device_t *device, bool waiting) {
+    if (atomic_load(&usbSimulating)) {
+        // Recordings start with the device in DFU mode, and the model is found in whatever mode it is in as if it were DFU
+        char *serialNumber = getUSBSimulatorSerialNumber();
+        if (serialNumber == NULL) {
+            LOG(LOG_ERROR, "The recording has no serial number for the device");
+            return -1;
+        }
+        *device = initDevice(serialNumber, MODE_DFU, 0x5ac, 0x1227);
+        if (!waiting) { LOG(LOG_DEBUG, "Initialised simulated device in DFU mode"); }
+        return 0;
+    }
     // get all USB devices
     libusb_device **list;
     libusb_context *context = NULL;
-    libusb_init(&context);
+    int found = -1;
+    if (libusb_init(&context) != LIBUSB_SUCCESS) {
+        LOG(LOG_ERROR, "Failed to initialise libusb!");
+        return -1;
+    }
     ssize_t count = libusb_get_device_list(context, &list);
     if (count < 0) {
         LOG(LOG_ERROR, "Failed to get USB device list!");
+        libusb_exit(context);
         return -1;
     }
 
+    // Every exit goes through done, so the list and context are released once a device is found too
     for (int i = 0; i < count; i++) {
         libusb_device_handle *libusbHandle;
         struct libusb_device_descriptor desc;
         int ret = libusb_get_device_descriptor(list[i], &desc);
         if (ret < 0) {
             LOG(LOG_ERROR, "Failed to get USB device descriptor!");
-            return -1;
+            goto done;
         }
         libusb_open(list[i], &libusbHandle);
         if (libusbHandle != NULL) {
             unsigned char serialNumber[256];
-            libusb_get_string_descriptor_ascii(libusbHandle, desc.iSerialNumber, serialNumber, 256);
+            // Read the serial directly, the handle has no event thread to complete requests sent through usb.c
+            if (libusb_get_string_descriptor_ascii(libusbHandle, desc.iSerialNumber, serialNumber, 256) < 0) {
+                serialNumber[0] = '\0';
+            }
+            libusb_close(libusbHandle);
 
             int productID = desc.idProduct;
             int vendorID = desc.idVendor;
-            usb_handle_t handle;
-            initUSBHandle(&handle, vendorID, productID);
-            handle.device = libusbHandle;
             
             if (vendorID == 0x5ac && productID == 0x1227)
             {
-                *device = initDevice(getDeviceSerialNumber(&handle), MODE_DFU, vendorID, productID);
+                *device = initDevice(strdup((char *)serialNumber), MODE_DFU, vendorID, productID);
                 if (!waiting) {
                     if (isInDownloadMode(device->serialNumber)) {
                         LOG(LOG_DEBUG, "Initialised device in YoloDFU/download mode"); 
@@ -74,35 +103,40 @@ int findUSBDevice(device_t *device, bool waiting) {
                         LOG(LOG_DEBUG, "Initialised device in DFU mode"); 
                     }
                 }
-                return 0;
+                found = 0;
+                goto done;
             }
             if (vendorID == 0x5ac && productID == 0x1281)
             {
-                *device = initDevice(getDeviceSerialNumber(&handle), MODE_RECOVERY, vendorID, productID);
+                *device = initDevice(strdup((char *)serialNumber), MODE_RECOVERY, vendorID, productID);
                 if (!waiting) { LOG(LOG_DEBUG, "Initialised device in recovery mode"); }
-                return 0;
+                found = 0;
+                goto done;
             }
             if (vendorID == 0x5ac && (productID == 0x12ab || productID == 0x12a8))
             {
-                *device = initDevice(getDeviceSerialNumber(&handle), MODE_NORMAL, vendorID, productID);
+                *device = initDevice(strdup((char *)serialNumber), MODE_NORMAL, vendorID, productID);
                 if (!waiting) { LOG(LOG_DEBUG, "Initialised device in normal mode"); }
-                return 0;
+                found = 0;
+                goto done;
             }
             if (vendorID == 0x5ac && productID == 0x4141)
             {
-                *device = initDevice(getDeviceSerialNumber(&handle), MODE_PONGO, vendorID, productID);
+                *device = initDevice(strdup((char *)serialNumber), MODE_PONGO, vendorID, productID);
                 if (!waiting) { LOG(LOG_DEBUG, "Initialised Pongo USB device"); }
-                return 0;   
+                found = 0;
+                goto done;
             }
-            libusb_close(libusbHandle);
         }
         else {
             LOG(LOG_ERROR, "Failed to open USB device");
-            return -1;
+            goto done;
         }
     }
+done:
     libusb_free_device_list(list, 1);
-    return -1;
+    libusb_exit(context);
+    return found;
 }
 
 #else
@@ -218,8 +252,45 @@ done:
 
 #endif
 
+typedef struct {
+    volatile bool found;
+    volatile bool cancel;
+} dfu_watcher_t;
+
+// Purpose: Watch the bus for a device with a DFU serial number until cancelled
+void *DFUWatcherThread(void *arg) {
+    dfu_watcher_t *watcher = arg;
+    usb_handle_t handle;
+    char *serial;
+
+    while (!watcher->cancel && waitUSBHotplugEvent(0x5ac, 0x1227, USB_DEVICE_ARRIVED, DFU_ENTRY_TIMEOUT, &watcher->cancel)) {
+        initUSBHandle(&handle, 0x5ac, 0x1227);
+        // Opening has to give up when cancelled too, or the join below could block forever
+        if (waitUSBHandleUntil(&handle, NULL, NULL, DFU_ENTRY_TIMEOUT, &watcher->cancel)) {
+            serial = getDeviceSerialNumber(&handle);
+            closeUSBHandle(&handle);
+            if (serial != NULL && strstr(serial, "CPID:") != NULL && !isInDownloadMode(serial)) {
+                watcher->found = true;
+            }
+            free(serial);
+        }
+        if (watcher->found) {
+            break;
+        }
+        waitUSBHotplugEvent(0x5ac, 0x1227, USB_DEVICE_LEFT, DFU_ENTRY_TIMEOUT, &watcher->cancel);
+    }
+    return NULL;
+}
+
 bool getRecoveryDeviceIntoDFU(device_t *device) {
-    waitUSBHandle(&device->handle, NULL, NULL);
+    dfu_watcher_t watcher = { false, false };
+    bool automatic = getArgumentByName("Automatic DFU")->boolVal;
+    pthread_t watcherThread;
+
+    if (!waitUSBHandle(&device->handle, NULL, NULL)) {
+        LOG(LOG_ERROR, "Failed to open the device in recovery mode");
+        return false;
+    }
     bool ret = sendRecoveryModeCommand(&device->handle, "setenv auto-boot true");
     if (!ret) {
         LOG(LOG_ERROR, "Failed to send auto-boot true");
@@ -229,11 +300,32 @@ bool getRecoveryDeviceIntoDFU(device_t *device) {
         LOG(LOG_ERROR, "Failed to send saveenv");
     }
     LOG(LOG_DEBUG, "Sent auto-boot true and saveenv");
-    LOG_NO_NEWLINE(LOG_INFO, "Press Enter when you are ready to enter DFU mode");
-    getchar();
-    DFUHelper();
-    if (waitForDeviceInMode(device, MODE_DFU, 30) != 0) {
-        LOG(LOG_ERROR, "Could not find device in DFU mode after 30 seconds", device->serialNumber);
+    // The device comes back in DFU mode as a different device, which is opened again from scratch
+    closeUSBHandle(&device->handle);
+    if (!automatic) {
+        LOG_NO_NEWLINE(LOG_INFO, "Press Enter when you are ready to enter DFU mode");
+        getchar();
+    } else {
+        LOG(LOG_INFO, "Waiting for device to enter DFU mode");
+    }
+
+    // Run the countdown alongside a hotplug watcher, so we can
+    // start as soon as the device shows up in DFU mode
+    if (pthread_create(&watcherThread, NULL, DFUWatcherThread, &watcher) != 0) {
+        LOG(LOG_ERROR, "Failed to start DFU watcher");
+        return false;
+    }
+    if (!automatic) {
+        DFUHelper(&watcher.found);
+    }
+    for (int i = 0; !watcher.found && i < DFU_ENTRY_TIMEOUT / 10; i++) {
+        sleep_ms(10);
+    }
+    watcher.cancel = true;
+    pthread_join(watcherThread, NULL);
+
+    if (!watcher.found || waitForDeviceInMode(device, MODE_DFU, 0) != 0) {
+        LOG(LOG_ERROR, "Could not find device in DFU mode after %d seconds", DFU_ENTRY_TIMEOUT / 1000);
         return false;
     }
     LOG(LOG_SUCCESS, "Device entered DFU mode successfully!");
@@ -241,7 +333,7 @@ bool getRecoveryDeviceIntoDFU(device_t *device) {
 }
 
 int findDevice(device_t *device, bool waiting) {
-    idevice_t idevice = NULL;
+    struct timespec start, end;
     char **deviceIDs;
     int count;
     idevice_error_t listRet = idevice_get_device_list(&deviceIDs, &count);
@@ -252,6 +344,7 @@ int findDevice(device_t *device, bool waiting) {
     }
     if (count == 0)
     {
+        idevice_device_list_free(deviceIDs);
         LOG(LOG_DEBUG, "No devices in normal mode found, looking for recovery/DFU devices");
         if (findUSBDevice(device, waiting) != 0) {
             return -1;
@@ -263,40 +356,29 @@ int findDevice(device_t *device, bool waiting) {
     }
     if (count > 1)
     {
+        idevice_device_list_free(deviceIDs);
         LOG(LOG_ERROR, "More than one device found, Achilles currently does not support multiple device connections at once.");
         return -1;
     }
-    char *udid = deviceIDs[0];
-	lockdownd_client_t lockdown = NULL;
-	if (idevice_new(&idevice, udid) != IDEVICE_E_SUCCESS) {
-		LOG(LOG_ERROR, "Could not connect to device");
-		return -1;
-	}
     LOG(LOG_SUCCESS, "Found device in normal mode, entering recovery mode");
-    lockdownd_error_t ldret = lockdownd_client_new(idevice, &lockdown, "Achilles");
-    if (ldret != LOCKDOWN_E_SUCCESS) {
-        LOG(LOG_ERROR, "Could not connect to lockdownd: %s", lockdownd_strerror(ldret));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int ret = enterRecoveryMode(deviceIDs[0]);
+    idevice_device_list_free(deviceIDs);
+    if (ret != 0) {
         return -1;
     }
-    ldret = lockdownd_enter_recovery(lockdown);
-    if (ldret == LOCKDOWN_E_SESSION_INACTIVE) {
-        lockdownd_client_free(lockdown);
-        lockdown = NULL;
-        ldret = lockdownd_client_new_with_handshake(idevice, &lockdown, "Achilles");
-        if (ldret != LOCKDOWN_E_SUCCESS) {
-            LOG(LOG_ERROR, "Could not connect to lockdownd: %s", lockdownd_strerror(ldret));
-            return -1;
-        }
-        ldret = lockdownd_enter_recovery(lockdown);
-    }
-    if (ldret != LOCKDOWN_E_SUCCESS) {
-        LOG(LOG_ERROR, "Could not trigger entering recovery mode: %s", lockdownd_strerror(ldret));
+
+    // Complete on the recovery mode arrival event rather than
+    // sleeping and rescanning the bus until the device shows up
+    if (!waitUSBHotplugEvent(0x5ac, 0x1281, USB_DEVICE_ARRIVED, RECOVERY_ENTRY_TIMEOUT, NULL)) {
+        LOG(LOG_ERROR, "Could not find device in recovery mode after %d seconds", RECOVERY_ENTRY_TIMEOUT / 1000);
         return -1;
     }
-    lockdownd_client_free(lockdown);
-    idevice_free(idevice);
-    sleep(5);
-    waitForDeviceInMode(device, MODE_RECOVERY, 10);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    LOG(LOG_DEBUG, "Device entered recovery mode after %.2f seconds", (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9);
+    initUSBHandle(&device->handle, 0x5ac, 0x1281);
+    device->serialNumber = NULL;
+    device->mode = MODE_RECOVERY;
     
     if (!getRecoveryDeviceIntoDFU(device)) { return -1; }
     
@@ -0,0 +1,275 @@
+#include <usb/faults.h>
+#include <utils/random.h>
+#include <math.h>
+
+atomic_bool usbFaulting = false;
+atomic_bool usbFaultDisconnected = false;
+
+static usb_fault_rule_t faultRules[USB_FAULTS_MAX_RULES];
+static size_t faultRuleCount;
+static uint64_t faultSeed, faultState;
+static uint64_t faultCounts[USB_FAULT_COUNT], faultDelayed, faultDelay;
+static pthread_mutex_t faultLock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *faultNames[USB_FAULT_COUNT] = {NULL, "stall", "short", "timeout", "disconnect"};
+static const char *latencyNames[] = {NULL, "fixed", "uniform", "normal", "exponential", "lognormal"};
+
+// Purpose: Return a uniformly distributed number in [0, 1), the sequence only depends on the seed
+static double getUSBFaultRandom(void) {
+	return (getRandom(&faultState) >> 11) * 0x1p-53;
+}
+
+// Purpose: Draw a standard normal number with the Box-Muller transform
+static double getUSBFaultGaussian(void) {
+	double u = 1 - getUSBFaultRandom(), v = getUSBFaultRandom();
+	return sqrt(-2 * log(u)) * cos(2 * M_PI * v);
+}
+
+// Purpose: Draw an extra latency from a rule's distribution, in nanoseconds
+static uint64_t getUSBFaultLatency(const usb_fault_rule_t *rule) {
+	double ms;
+	switch (rule->latency) {
+		case USB_LATENCY_FIXED:
+			ms = rule->a;
+			break;
+		case USB_LATENCY_UNIFORM:
+			ms = rule->a + (rule->b - rule->a) * getUSBFaultRandom();
+			break;
+		case USB_LATENCY_NORMAL:
+			ms = rule->a + rule->b * getUSBFaultGaussian();
+			break;
+		case USB_LATENCY_EXPONENTIAL:
+			ms = -rule->a * log(1 - getUSBFaultRandom());
+			break;
+		case USB_LATENCY_LOGNORMAL:
+			ms = rule->a * exp(rule->b * getUSBFaultGaussian());
+			break;
+		default:
+			return 0;
+	}
+	return ms > 0 ? (uint64_t)(ms * 1e6) : 0;
+}
+
+// Purpose: Find the rule for a transfer, falling back to the default rule
+static const usb_fault_rule_t *findUSBFaultRule(const usb_future_t *future) {
+	const usb_fault_rule_t *fallback = NULL;
+	size_t i;
+	for (i = 0; i < faultRuleCount; i++) {
+		if (faultRules[i].any) {
+			fallback = &faultRules[i];
+		} else if (future->control ? !faultRules[i].bulk && faultRules[i].bmRequestType == future->bmRequestType && faultRules[i].bRequest == future->bRequest
+		: faultRules[i].bulk) {
+			return &faultRules[i];
+		}
+	}
+	return fallback;
+}
+
+// Purpose: Parse one "key=value" setting of a rule
+static bool parseUSBFaultSetting(usb_fault_rule_t *rule, char *setting) {
+	char *value = strchr(setting, '='), *end;
+	size_t i;
+
+	if (value == NULL) {
+		return false;
+	}
+	*value++ = '\0';
+	for (i = 1; i < USB_FAULT_COUNT; i++) {
+		if (strcmp(setting, faultNames[i]) == 0) {
+			rule->probability[i] = strtod(value, &end);
+			return *end == '\0' && rule->probability[i] >= 0 && rule->probability[i] <= 1;
+		}
+	}
+	if (strcmp(setting, "latency") != 0) {
+		return false;
+	}
+	for (i = 1; i < sizeof(latencyNames) / sizeof(latencyNames[0]); i++) {
+		if (strncmp(value, latencyNames[i], strlen(latencyNames[i])) == 0 && value[strlen(latencyNames[i])] == ':') {
+			rule->latency = (usb_latency_model_t)i;
+			rule->a = strtod(value + strlen(latencyNames[i]) + 1, &end);
+			rule->b = *end == ':' ? strtod(end + 1, &end) : 0;
+			return *end == '\0' && rule->a >= 0 && rule->b >= 0;
+		}
+	}
+	return false;
+}
+
+// Purpose: Parse a rule line, the request it matches followed by its settings
+static bool parseUSBFaultRule(usb_fault_rule_t *rule, char *line) {
+	unsigned bmRequestType, bRequest;
+	char *token, *save;
+
+	memset(rule, 0, sizeof(usb_fault_rule_t));
+	if ((token = strtok_r(line, " \t\r\n", &save)) == NULL) {
+		return false;
+	}
+	if (strcmp(token, "*") == 0) {
+		rule->any = true;
+	} else if (strcmp(token, "bulk") == 0) {
+		rule->bulk = true;
+	} else if (sscanf(token, "%x:%x", &bmRequestType, &bRequest) == 2 && bmRequestType <= UINT8_MAX && bRequest <= UINT8_MAX) {
+		rule->bmRequestType = (uint8_t)bmRequestType;
+		rule->bRequest = (uint8_t)bRequest;
+	} else {
+		return false;
+	}
+	while ((token = strtok_r(NULL, " \t\r\n", &save)) != NULL) {
+		if (!parseUSBFaultSetting(rule, token)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool startUSBFaults(const char *path) {
+	FILE *file;
+	char line[256], *start;
+	unsigned long long seed;
+	unsigned lineNumber = 0;
+	bool seeded = false;
+
+	if ((file = fopen(path, "r")) == NULL) {
+		LOG(LOG_ERROR, "Failed to open %s", path);
+		return false;
+	}
+	faultRuleCount = 0;
+	while (fgets(line, sizeof(line), file) != NULL) {
+		lineNumber++;
+		if ((start = strchr(line, '#')) != NULL) {
+			*start = '\0';
+		}
+		for (start = line; *start == ' ' || *start == '\t'; start++);
+		if (*start == '\0' || *start == '\n' || *start == '\r') {
+			continue;
+		}
+		if (sscanf(start, "seed %llu", &seed) == 1) {
+			faultSeed = seed;
+			seeded = true;
+			continue;
+		}
+		if (faultRuleCount == USB_FAULTS_MAX_RULES || !parseUSBFaultRule(&faultRules[faultRuleCount], start)) {
+			LOG(LOG_ERROR, "%s:%u: %s", path, lineNumber, faultRuleCount == USB_FAULTS_MAX_RULES ? "too many rules" : "invalid rule");
+			fclose(file);
+			return false;
+		}
+		faultRuleCount++;
+	}
+	fclose(file);
+
+	if (!seeded) {
+		faultSeed = getMonotonicTime();
+	}
+	faultState = faultSeed | 1;
+	memset(faultCounts, 0, sizeof(faultCounts));
+	faultDelayed = faultDelay = 0;
+	atomic_store(&usbFaultDisconnected, false);
+	atomic_store(&usbFaulting, true);
+	LOG(LOG_INFO, "Injecting USB faults with %zu rules from %s, seed %llu", faultRuleCount, path, (unsigned long long)faultSeed);
+	return true;
+}
+
+// Purpose: Pick the fault and extra latency of a transfer when it is first seen done
+static void drawUSBFault(usb_future_t *future) {
+	const usb_fault_rule_t *rule = findUSBFaultRule(future);
+	uint64_t latency;
+	double draw;
+	size_t i;
+
+	future->fault = USB_FAULT_NONE;
+	future->faultDue = future->completed;
+	if (atomic_load(&usbFaultDisconnected)) {
+		// Still gone from an earlier disconnect, fail straight away
+		future->fault = USB_FAULT_DISCONNECT;
+		return;
+	}
+	if (rule == NULL) {
+		return;
+	}
+	// A single draw picks at most one fault, so the probabilities of a rule add up
+	draw = getUSBFaultRandom();
+	for (i = 1; i < USB_FAULT_COUNT; i++) {
+		if (draw < rule->probability[i]) {
+			future->fault = (uint8_t)i;
+			break;
+		}
+		draw -= rule->probability[i];
+	}
+	latency = getUSBFaultLatency(rule);
+	if (future->fault == USB_FAULT_SHORT && future->ret.sz == 0) {
+		future->fault = USB_FAULT_NONE; // Nothing to cut short
+	}
+	if (future->fault == USB_FAULT_TIMEOUT) {
+		future->faultDue = MAX(future->completed, future->submitted + USB_FAULTS_TIMEOUT * 1000000ULL);
+	} else {
+		future->faultDue += latency;
+		if (latency != 0) {
+			faultDelayed++;
+			faultDelay += latency;
+		}
+	}
+	if (future->fault == USB_FAULT_DISCONNECT) {
+		atomic_store(&usbFaultDisconnected, true);
+	}
+	faultCounts[future->fault]++;
+}
+
+bool releaseUSBFault(usb_future_t *future) {
+	uint64_t now;
+
+	pthread_mutex_lock(&faultLock);
+	if (future->faultDue == UINT64_MAX) {
+		pthread_mutex_unlock(&faultLock);
+		return true;
+	}
+	if (future->faultDue == 0) {
+		drawUSBFault(future);
+	}
+	now = getMonotonicTime();
+	if (now < future->faultDue && !future->cancelled) {
+		pthread_mutex_unlock(&faultLock);
+		return false;
+	}
+	if (now < future->faultDue) {
+		// Cancelled while held back, so the cancellation won
+		future->ret.ret = USB_TRANSFER_ERROR;
+		future->ret.sz = 0;
+		future->completed = now;
+	} else {
+		future->completed = future->faultDue;
+		if (future->fault == USB_FAULT_STALL) {
+			future->ret.ret = USB_TRANSFER_STALL;
+			future->ret.sz = 0;
+		} else if (future->fault == USB_FAULT_SHORT) {
+			future->ret.sz = (uint32_t)(getUSBFaultRandom() * future->ret.sz);
+		} else if (future->fault != USB_FAULT_NONE) {
+			future->ret.ret = USB_TRANSFER_ERROR;
+			future->ret.sz = 0;
+		}
+	}
+	future->faultDue = UINT64_MAX; // Released, in case it is looked at again before it is finished
+	future->fault = USB_FAULT_NONE;
+	pthread_mutex_unlock(&faultLock);
+	return true;
+}
+
+uint64_t getUSBFaultDeadline(usb_future_t **futures, size_t count, uint64_t deadline) {
+	size_t i;
+	pthread_mutex_lock(&faultLock);
+	for (i = 0; i < count; i++) {
+		if (futures[i] != NULL && atomic_load(&futures[i]->done) && futures[i]->faultDue != 0 && futures[i]->faultDue != UINT64_MAX) {
+			deadline = MIN(deadline, futures[i]->faultDue);
+		}
+	}
+	pthread_mutex_unlock(&faultLock);
+	return deadline;
+}
+
+void printUSBFaults(void) {
+	pthread_mutex_lock(&faultLock);
+	LOG(LOG_INFO, "Injected %llu stalls, %llu short transfers, %llu timeouts and %llu disconnects, "
+		"and delayed %llu transfers by %.3fms in total, rerun with \"seed %llu\" to repeat them",
+		(unsigned long long)faultCounts[USB_FAULT_STALL], (unsigned long long)faultCounts[USB_FAULT_SHORT],
+		(unsigned long long)faultCounts[USB_FAULT_TIMEOUT], (unsigned long long)faultCounts[USB_FAULT_DISCONNECT],
+		(unsigned long long)faultDelayed, faultDelay / 1e6, (unsigned long long)faultSeed);
+	pthread_mutex_unlock(&faultLock);
+}
@@ -0,0 +1,174 @@
+#include <usb/hotplug.h>
+#include <usb/simulator.h>
+
+static uint64_t getMonotonicMilliseconds(void) {
+	return getMonotonicTime() / 1000000;
+}
+
+#ifdef ACHILLES_LIBUSB
+
+// Purpose: Look for the device in an already initialised context, so pollers don't set one up every time
+static bool isUSBDevicePresentInContext(libusb_context *context, uint16_t vid, uint16_t pid) {
+	struct libusb_device_descriptor desc;
+	libusb_device **list;
+	bool ret = false;
+	ssize_t count, i;
+
+	if ((count = libusb_get_device_list(context, &list)) >= 0) {
+		for (i = 0; i < count && !ret; i++) {
+			if (libusb_get_device_descriptor(list[i], &desc) == LIBUSB_SUCCESS && desc.idVendor == vid && desc.idProduct == pid) {
+				ret = true;
+			}
+		}
+		libusb_free_device_list(list, 1);
+	}
+	return ret;
+}
+
+bool isUSBDevicePresent(uint16_t vid, uint16_t pid) {
+	libusb_context *context = NULL;
+	bool ret;
+
+	if (atomic_load(&usbSimulating)) {
+		return true; // The simulated device is whatever the caller is looking for
+	}
+	if (libusb_init(&context) != LIBUSB_SUCCESS) {
+		return false;
+	}
+	ret = isUSBDevicePresentInContext(context, vid, pid);
+	libusb_exit(context);
+	return ret;
+}
+
+static int USBHotplugCallback(libusb_context *context, libusb_device *device, libusb_hotplug_event event, void *userData) {
+	*(int *)userData = 1;
+	return 1; // Deregister, we only need the first event
+}
+
+bool waitUSBHotplugEvent(uint16_t vid, uint16_t pid, usb_hotplug_event event, unsigned timeout, volatile bool *cancel) {
+	libusb_hotplug_callback_handle callbackHandle;
+	libusb_context *context = NULL;
+	uint64_t deadline = getMonotonicMilliseconds() + timeout, now;
+	struct timeval tv;
+	int completed = 0;
+
+	if (atomic_load(&usbSimulating)) {
+		// Leaving and arriving again is replayed when the handle is reopened
+		return true;
+	}
+	if (libusb_init(&context) != LIBUSB_SUCCESS) {
+		return false;
+	}
+	if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+		// No hotplug support on this platform, poll the device list of one context instead
+		while ((now = getMonotonicMilliseconds()) < deadline && (cancel == NULL || !*cancel)) {
+			if (isUSBDevicePresentInContext(context, vid, pid) == (event == USB_DEVICE_ARRIVED)) {
+				completed = 1;
+				break;
+			}
+			sleep_ms(10);
+		}
+		libusb_exit(context);
+		return completed != 0;
+	}
+	if (libusb_hotplug_register_callback(context,
+		event == USB_DEVICE_ARRIVED ? LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED : LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		event == USB_DEVICE_ARRIVED ? LIBUSB_HOTPLUG_ENUMERATE : LIBUSB_HOTPLUG_NO_FLAGS,
+		vid, pid, LIBUSB_HOTPLUG_MATCH_ANY, USBHotplugCallback, &completed, &callbackHandle) != LIBUSB_SUCCESS) {
+		libusb_exit(context);
+		return false;
+	}
+
+	// The device may have gone before the callback was registered
+	if (event == USB_DEVICE_LEFT && !isUSBDevicePresentInContext(context, vid, pid)) {
+		completed = 1;
+	}
+
+	while (completed == 0 && (now = getMonotonicMilliseconds()) < deadline && (cancel == NULL || !*cancel)) {
+		tv.tv_sec = 0;
+		tv.tv_usec = MIN(deadline - now, 10) * 1000;
+		if (libusb_handle_events_timeout_completed(context, &tv, &completed) != LIBUSB_SUCCESS) {
+			break;
+		}
+	}
+
+	libusb_hotplug_deregister_callback(context, callbackHandle);
+	libusb_exit(context);
+	return completed != 0;
+}
+
+#else
+
+bool isUSBDevicePresent(uint16_t vid, uint16_t pid) {
+	CFMutableDictionaryRef matchingDict;
+	io_iterator_t iter;
+	io_service_t serv;
+	bool ret = false;
+
+	if ((matchingDict = IOServiceMatching(kIOUSBDeviceClassName)) != NULL) {
+		cfDictionarySetInt16(matchingDict, CFSTR(kUSBVendorID), vid);
+		cfDictionarySetInt16(matchingDict, CFSTR(kUSBProductID), pid);
+		if (IOServiceGetMatchingServices(0, matchingDict, &iter) == kIOReturnSuccess) {
+			if ((serv = IOIteratorNext(iter)) != IO_OBJECT_NULL) {
+				ret = true;
+				IOObjectRelease(serv);
+			}
+			IOObjectRelease(iter);
+		}
+	}
+	return ret;
+}
+
+static void USBHotplugCallback(void *refcon, io_iterator_t iter) {
+	io_service_t serv;
+	while ((serv = IOIteratorNext(iter)) != IO_OBJECT_NULL) {
+		*(bool *)refcon = true;
+		IOObjectRelease(serv);
+	}
+}
+
+bool waitUSBHotplugEvent(uint16_t vid, uint16_t pid, usb_hotplug_event event, unsigned timeout, volatile bool *cancel) {
+	CFMutableDictionaryRef matchingDict;
+	IONotificationPortRef notificationPort;
+	CFRunLoopSourceRef source;
+	uint64_t deadline = getMonotonicMilliseconds() + timeout, now;
+	io_iterator_t iter;
+	bool completed = false;
+
+	if ((matchingDict = IOServiceMatching(kIOUSBDeviceClassName)) == NULL) {
+		return false;
+	}
+	cfDictionarySetInt16(matchingDict, CFSTR(kUSBVendorID), vid);
+	cfDictionarySetInt16(matchingDict, CFSTR(kUSBProductID), pid);
+
+	if ((notificationPort = IONotificationPortCreate(kIOMainPortDefault)) == NULL) {
+		CFRelease(matchingDict);
+		return false;
+	}
+	source = IONotificationPortGetRunLoopSource(notificationPort);
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+
+	// This consumes the matching dictionary
+	if (IOServiceAddMatchingNotification(notificationPort,
+		event == USB_DEVICE_ARRIVED ? kIOFirstMatchNotification : kIOTerminatedNotification,
+		matchingDict, USBHotplugCallback, &completed, &iter) == kIOReturnSuccess) {
+		// Drain the iterator to arm the notification, this also picks up devices that are already connected
+		USBHotplugCallback(&completed, iter);
+
+		// The device may have gone before the notification was armed
+		if (event == USB_DEVICE_LEFT && !isUSBDevicePresent(vid, pid)) {
+			completed = true;
+		}
+
+		while (!completed && (now = getMonotonicMilliseconds()) < deadline && (cancel == NULL || !*cancel)) {
+			CFRunLoopRunInMode(kCFRunLoopDefaultMode, MIN(deadline - now, 10) / 1000.0, true);
+		}
+		IOObjectRelease(iter);
+	}
+
+	CFRunLoopRemoveSource(CFRunLoopGetCurrent(), source, kCFRunLoopDefaultMode);
+	IONotificationPortDestroy(notificationPort);
+	return completed;
+}
+
+#endif
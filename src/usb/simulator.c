@@ -0,0 +1,536 @@
+#include <usb/simulator.h>
+#include <exploit/dfu.h>
+#include <exploit/exploit.h>
+
+#ifdef ACHILLES_LIBUSB
+
+atomic_bool usbSimulating = false;
+
+static usb_trace_transfer_t *simulatorTransfers;
+static size_t simulatorCount, simulatorNext;
+static size_t simulatorMatched, simulatorSkipped, simulatorMismatched;
+static uint64_t simulatorLastCompletion; // Monotonic time the last replayed transfer completed
+static uint64_t simulatorRecordedCompletion; // When the last replayed transfer completed in the recording
+static bool simulatorClosed; // The device was closed since the last transfer, so it has to re-enumerate
+static pthread_mutex_t simulatorLock = PTHREAD_MUTEX_INITIALIZER;
+
+// The device model, used instead of a recording when simulatorModelled is set
+static bool simulatorModelled;
+static usb_simulator_device_t simulatorDevice;
+static usb_simulator_mode_t simulatorMode, simulatorOpenedMode; // The mode the device is in, and was in when it was last opened
+static uint8_t simulatorState, simulatorStatus; // Of the DFU state machine
+static size_t simulatorDownloaded; // Bytes downloaded since DFU was last idle
+static uint64_t simulatorMemory[DFU_MAX_TRANSFER_SIZE / sizeof(uint64_t)]; // The start of the load buffer, where the payload reads commands
+static size_t simulatorLoaded; // Bytes written to the load buffer since the last manifest
+static size_t simulatorAnswered;
+static bool simulatorSprayed, simulatorTriggered; // Which checkm8 races were held since the SecureROM last restarted
+
+bool startUSBSimulator(const char *path) {
+	if (!readUSBTrace(path, &simulatorTransfers, &simulatorCount)) {
+		return false;
+	}
+	if (simulatorCount == 0) {
+		LOG(LOG_ERROR, "%s has no control or bulk transfers to replay", path);
+		freeUSBTrace(simulatorTransfers, simulatorCount);
+		return false;
+	}
+	simulatorNext = simulatorMatched = simulatorSkipped = simulatorMismatched = 0;
+	simulatorLastCompletion = simulatorRecordedCompletion = 0;
+	simulatorClosed = false;
+	atomic_store(&usbRecordedTime, 0);
+	atomic_store(&usbReplayedTime, 0);
+	atomic_store(&usbSimulating, true);
+	LOG(LOG_INFO, "Replaying %zu transfers from %s", simulatorCount, path);
+	return true;
+}
+
+// Purpose: Reset the DFU state machine, as the SecureROM does when it restarts DFU after a reset
+static void restartUSBSimulatorDFU(void) {
+	simulatorState = DFU_STATE_IDLE;
+	simulatorStatus = DFU_STATUS_OK;
+	simulatorDownloaded = simulatorLoaded = 0;
+	simulatorSprayed = simulatorTriggered = false;
+}
+
+void startUSBSimulatorDevice(const usb_simulator_device_t *device) {
+	static const char *modeNames[] = {"DFU", "pwned DFU", "YoloDFU", "PongoOS", "booted"};
+	pthread_mutex_lock(&simulatorLock);
+	simulatorDevice = *device;
+	simulatorMode = device->mode;
+	simulatorAnswered = 0;
+	simulatorClosed = false;
+	restartUSBSimulatorDFU();
+	simulatorModelled = true;
+	pthread_mutex_unlock(&simulatorLock);
+	atomic_store(&usbSimulating, true);
+	LOG(LOG_DEBUG, "Simulating a CPID 0x%04X device in %s mode", device->cpid, modeNames[device->mode]);
+}
+
+usb_simulator_mode_t getUSBSimulatorMode(void) {
+	usb_simulator_mode_t mode;
+	pthread_mutex_lock(&simulatorLock);
+	mode = simulatorMode;
+	pthread_mutex_unlock(&simulatorLock);
+	return mode;
+}
+
+// Purpose: Whether the simulated device is still around to answer requests
+static bool isUSBSimulatorDevicePresent(void) {
+	return simulatorMode != USB_SIMULATOR_MODE_BOOTED && (simulatorDevice.lifetime == 0 || simulatorAnswered < simulatorDevice.lifetime);
+}
+
+// Purpose: Build the serial number the simulated device reports in its current mode
+static void getUSBSimulatorDeviceSerial(char *serial, size_t size) {
+	int length = snprintf(serial, size, "CPID:%04X CPRV:11 CPFM:03 SCEP:01 BDID:%02X ECID:001A2B3C4D5E6F70 IBFL:3C",
+		simulatorDevice.cpid, simulatorDevice.bdid);
+	if (simulatorMode == USB_SIMULATOR_MODE_PONGO) {
+		snprintf(serial + length, size - length, " SRTG:[PongoOS-2.6.0]");
+	} else {
+		snprintf(serial + length, size - length, " SRTG:[%s]%s", simulatorDevice.srtg,
+			simulatorMode == USB_SIMULATOR_MODE_PWND ? " PWND:[checkm8]" : simulatorMode == USB_SIMULATOR_MODE_YOLO ? " YOLO:checkra1n" : "");
+	}
+}
+
+static void replyUSBSimulatorTransfer(usb_future_t *future, const void *data, size_t length) {
+	future->ret.ret = USB_TRANSFER_OK;
+	future->ret.sz = (uint32_t)MIN(length, future->length);
+	if (future->ret.sz != 0) {
+		memcpy(future->slot->buffer + USB_TRANSFER_POOL_DATA_OFFSET, data, future->ret.sz);
+		future->slot->dirty = true;
+	}
+}
+
+static void stallUSBSimulatorTransfer(usb_future_t *future) {
+	future->ret.ret = USB_TRANSFER_STALL;
+	future->ret.sz = 0;
+}
+
+// Purpose: Leave a request pending until it is aborted, the way the SecureROM leaves the ones checkm8 races
+static void holdUSBSimulatorTransfer(usb_future_t *future) {
+	future->ret.ret = USB_TRANSFER_ERROR;
+	future->ret.sz = 0;
+	future->due = UINT64_MAX;
+}
+
+// Purpose: Answer the standard requests of enumeration and the heap spray
+static void answerUSBSimulatorStandardRequest(usb_future_t *future) {
+	uint8_t descriptor[2 + 2 * USB_SIMULATOR_SERIAL_SIZE] = { 18, 1, 0x00, 0x02, 0, 0, 0, EP0_MAX_PACKET_SIZE, 0xAC, 0x05, 0x27, 0x12, 0, 0, 1, 2, 3, 1 };
+	char serial[USB_SIMULATOR_SERIAL_SIZE];
+	uint8_t index = future->wValue & 0xFF;
+	size_t i;
+
+	if (future->bmRequestType == 0x2 && future->bRequest == 3 && future->length == 0) {
+		// checkm8USBRequestStall() halting the IN endpoint
+		if (simulatorDevice.failure == USB_SIMULATOR_FAIL_STALL) {
+			stallUSBSimulatorTransfer(future);
+			return;
+		}
+		simulatorSprayed |= simulatorMode == USB_SIMULATOR_MODE_DFU;
+		replyUSBSimulatorTransfer(future, NULL, 0);
+		return;
+	}
+	if (future->bmRequestType != 0x80 || future->bRequest != 6) {
+		stallUSBSimulatorTransfer(future);
+		return;
+	}
+	if (future->wValue >> 8 == 1) {
+		if (simulatorMode == USB_SIMULATOR_MODE_PONGO) {
+			descriptor[10] = 0x41;
+			descriptor[11] = 0x41;
+		}
+		replyUSBSimulatorTransfer(future, descriptor, 18);
+	} else if (future->wValue >> 8 != 3) {
+		stallUSBSimulatorTransfer(future);
+	} else if (index == 4 && future->wIndex != 0x409 && simulatorMode == USB_SIMULATOR_MODE_DFU) {
+		// The stall race of checkm8Stall(), held so the abort wins and the requests after it stall
+		if (simulatorDevice.failure == USB_SIMULATOR_FAIL_STALL) {
+			memset(descriptor, '\0', sizeof(descriptor));
+			replyUSBSimulatorTransfer(future, descriptor, sizeof(descriptor));
+		} else if (!simulatorSprayed && future->length == 0xC0) {
+			holdUSBSimulatorTransfer(future);
+		} else {
+			stallUSBSimulatorTransfer(future);
+		}
+		simulatorSprayed = true;
+	} else if (index == 0) {
+		descriptor[0] = 4;
+		descriptor[1] = 3;
+		descriptor[2] = 0x09;
+		descriptor[3] = 0x04;
+		replyUSBSimulatorTransfer(future, descriptor, 4);
+	} else if (index == 3) {
+		getUSBSimulatorDeviceSerial(serial, sizeof(serial));
+		descriptor[0] = (uint8_t)(2 + 2 * strlen(serial));
+		descriptor[1] = 3;
+		for (i = 0; serial[i] != '\0'; i++) {
+			descriptor[2 + 2 * i] = (uint8_t)serial[i];
+			descriptor[3 + 2 * i] = 0;
+		}
+		replyUSBSimulatorTransfer(future, descriptor, descriptor[0]);
+	} else {
+		stallUSBSimulatorTransfer(future);
+	}
+}
+
+// Purpose: Run the command in the load buffer the way the gaster payload does, replying with DONE_MAGIC and the return value
+static void runUSBSimulatorCommand(void) {
+	uint8_t *memory = (uint8_t *)simulatorMemory, copy[sizeof(simulatorMemory)];
+	uint64_t destination = simulatorMemory[2], source = simulatorMemory[3], length = simulatorMemory[4], address;
+	size_t i;
+
+	if (simulatorMemory[0] == EXEC_MAGIC) {
+		// Nothing in the SecureROM can run here, so every function returns its first argument
+		simulatorMemory[0] = DONE_MAGIC;
+		simulatorMemory[1] = simulatorMemory[2];
+	} else if (simulatorMemory[0] == MEMC_MAGIC) {
+		// Only the load buffer is modelled, every other byte reads as the low byte of its address and ignores writes
+		length = MIN(length, sizeof(copy));
+		for (i = 0; i < length; i++) {
+			address = source + i;
+			copy[i] = address >= insecure_memory_base && address - insecure_memory_base < sizeof(simulatorMemory) ? memory[address - insecure_memory_base] : (uint8_t)address;
+		}
+		for (i = 0; i < length; i++) {
+			address = destination + i;
+			if (address >= insecure_memory_base && address - insecure_memory_base < sizeof(simulatorMemory)) {
+				memory[address - insecure_memory_base] = copy[i];
+			}
+		}
+		simulatorMemory[0] = DONE_MAGIC;
+		simulatorMemory[1] = destination;
+	}
+}
+
+// Purpose: Answer the DFU requests, which run a payload once one has been sent after the use-after-free
+static void answerUSBSimulatorDFURequest(usb_future_t *future) {
+	uint8_t status[6] = { simulatorStatus, 0, 0, 0, simulatorState, 0 };
+	static const uint8_t zeroes[DFU_MAX_TRANSFER_SIZE];
+
+	if (future->bmRequestType == 0x21 && future->bRequest == DFU_DNLOAD) {
+		if (simulatorState == DFU_STATE_ERROR) {
+			stallUSBSimulatorTransfer(future);
+		} else if (simulatorMode == USB_SIMULATOR_MODE_DFU && simulatorSprayed && !simulatorTriggered && future->length == DFU_MAX_TRANSFER_SIZE) {
+			if (simulatorDevice.failure == USB_SIMULATOR_FAIL_TRIGGER) {
+				// Taken in full as soon as it is submitted, so not even an abort without a delay cuts it short
+				future->ret.ret = USB_TRANSFER_OK;
+				future->ret.sz = future->length;
+				future->due = future->submitted;
+			} else {
+				// The use-after-free trigger, held so the abort leaves the IO buffer freed and the overwrite stalls
+				simulatorTriggered = true;
+				holdUSBSimulatorTransfer(future);
+			}
+		} else if (future->length == 0) {
+			if (simulatorDevice.failure == USB_SIMULATOR_FAIL_RESET) {
+				simulatorState = DFU_STATE_ERROR;
+				simulatorStatus = DFU_STATUS_ERR_UNKNOWN;
+			} else {
+				simulatorState = DFU_STATE_MANIFEST_SYNC;
+			}
+			simulatorLoaded = 0; // The next download is loaded from the start of the buffer again
+			replyUSBSimulatorTransfer(future, NULL, 0);
+		} else {
+			if (simulatorLoaded < sizeof(simulatorMemory)) {
+				memcpy((uint8_t *)simulatorMemory + simulatorLoaded, future->slot->buffer + USB_TRANSFER_POOL_DATA_OFFSET,
+					MIN(future->length, sizeof(simulatorMemory) - simulatorLoaded));
+			}
+			simulatorLoaded += future->length;
+			simulatorDownloaded += future->length;
+			// DNLOAD is also taken while waiting for a reset, checkm8Reset() relies on it
+			if (simulatorState != DFU_STATE_MANIFEST_WAIT_RESET) {
+				simulatorState = DFU_STATE_DNLOAD_SYNC;
+			}
+			future->ret.ret = USB_TRANSFER_OK;
+			future->ret.sz = future->length;
+		}
+	} else if (future->bmRequestType == 0xA1 && future->bRequest == DFU_GETSTATUS) {
+		replyUSBSimulatorTransfer(future, status, sizeof(status));
+		// The state is reported before moving on, so a manifest takes three GETSTATUS requests
+		if (simulatorState == DFU_STATE_DNLOAD_SYNC) {
+			simulatorState = DFU_STATE_DNLOAD_IDLE;
+		} else if (simulatorState == DFU_STATE_MANIFEST_SYNC) {
+			simulatorState = DFU_STATE_MANIFEST;
+		} else if (simulatorState == DFU_STATE_MANIFEST) {
+			simulatorState = DFU_STATE_MANIFEST_WAIT_RESET;
+		}
+	} else if (future->bmRequestType == 0xA1 && future->bRequest == DFU_GETSTATE) {
+		replyUSBSimulatorTransfer(future, &simulatorState, 1);
+	} else if (future->bmRequestType == 0x21 && (future->bRequest == DFU_CLRSTATUS || future->bRequest == DFU_ABORT)) {
+		replyUSBSimulatorTransfer(future, NULL, 0);
+		if (future->bRequest == DFU_CLRSTATUS && simulatorDownloaded != 0) {
+			// Run the download, which re-enumerates the device in its next mode
+			if (simulatorMode == USB_SIMULATOR_MODE_DFU && simulatorTriggered && simulatorDevice.failure != USB_SIMULATOR_FAIL_PAYLOAD) {
+				simulatorMode = simulatorDevice.yolo ? USB_SIMULATOR_MODE_YOLO : USB_SIMULATOR_MODE_PWND;
+			} else if (simulatorMode == USB_SIMULATOR_MODE_YOLO) {
+				simulatorMode = USB_SIMULATOR_MODE_PONGO;
+			}
+		}
+		simulatorState = DFU_STATE_IDLE;
+		simulatorStatus = DFU_STATUS_OK;
+		simulatorDownloaded = simulatorLoaded = 0;
+	} else if (future->bmRequestType == 0xA1 && future->bRequest == DFU_UPLOAD && simulatorMode == USB_SIMULATOR_MODE_PWND && future->wValue == 0xFFFF) {
+		// The payload's hook, which runs the command in the load buffer and replies with the buffer
+		runUSBSimulatorCommand();
+		replyUSBSimulatorTransfer(future, simulatorMemory, sizeof(simulatorMemory));
+	} else if (future->bmRequestType == 0xA1 && future->bRequest == DFU_UPLOAD && simulatorMode == USB_SIMULATOR_MODE_PWND) {
+		replyUSBSimulatorTransfer(future, zeroes, sizeof(zeroes));
+	} else {
+		stallUSBSimulatorTransfer(future);
+	}
+}
+
+// Purpose: Answer the commands and uploads PongoOS takes
+static void answerUSBSimulatorPongoRequest(usb_future_t *future) {
+	const char *command = (const char *)future->slot->buffer + USB_TRANSFER_POOL_DATA_OFFSET;
+	if (!future->control) {
+		future->ret.ret = USB_TRANSFER_OK;
+		future->ret.sz = future->length;
+	} else if (future->bmRequestType == 0x21) {
+		future->ret.ret = USB_TRANSFER_OK;
+		future->ret.sz = future->length;
+		if (future->bRequest == 3 && future->length >= 4 && strncmp(command, "boot", 4) == 0) {
+			simulatorMode = USB_SIMULATOR_MODE_BOOTED;
+		}
+	} else if (future->bmRequestType == 0x80) {
+		answerUSBSimulatorStandardRequest(future);
+	} else {
+		stallUSBSimulatorTransfer(future);
+	}
+}
+
+// Purpose: Answer a request from the device model, returning false once the device has gone away
+static bool answerUSBSimulatorTransfer(usb_future_t *future) {
+	if (!isUSBSimulatorDevicePresent()) {
+		return false;
+	}
+	simulatorAnswered++;
+	future->due = future->submitted + simulatorDevice.latency * 1000ULL;
+	if (simulatorMode == USB_SIMULATOR_MODE_PONGO) {
+		answerUSBSimulatorPongoRequest(future);
+	} else if (!future->control) {
+		future->ret.ret = USB_TRANSFER_ERROR;
+		future->ret.sz = 0;
+	} else if ((future->bmRequestType & 0x60) == 0) {
+		answerUSBSimulatorStandardRequest(future);
+	} else {
+		answerUSBSimulatorDFURequest(future);
+	}
+	return true;
+}
+
+void stopUSBSimulator(void) {
+	if (!atomic_exchange(&usbSimulating, false)) {
+		return;
+	}
+	if (simulatorModelled) {
+		LOG(LOG_DEBUG, "The simulated device answered %zu transfers", simulatorAnswered);
+		simulatorModelled = false;
+		return;
+	}
+	LOG(LOG_INFO, "Replayed %zu of %zu recorded transfers, %zu were skipped and %zu requests did not match the recording",
+		simulatorMatched, simulatorCount, simulatorSkipped, simulatorMismatched);
+	freeUSBTrace(simulatorTransfers, simulatorCount);
+	simulatorTransfers = NULL;
+	simulatorCount = 0;
+}
+
+static bool matchUSBSimulatorTransfer(const usb_trace_transfer_t *transfer, const usb_future_t *future) {
+	if (transfer->control != future->control) {
+		return false;
+	}
+	if (!future->control) {
+		return !transfer->in;
+	}
+	return transfer->setup[0] == future->bmRequestType && transfer->setup[1] == future->bRequest
+		&& (transfer->setup[2] | transfer->setup[3] << 8) == future->wValue
+		&& (transfer->setup[4] | transfer->setup[5] << 8) == future->wIndex
+		&& (transfer->setup[6] | transfer->setup[7] << 8) == (future->length & 0xFFFF);
+}
+
+bool replayUSBSimulatorTransfer(usb_future_t *future) {
+	const usb_trace_transfer_t *transfer;
+	uint8_t *buffer = future->slot->buffer + USB_TRANSFER_POOL_DATA_OFFSET;
+	size_t i, end;
+	bool present;
+
+	pthread_mutex_lock(&simulatorLock);
+	if (simulatorModelled) {
+		present = answerUSBSimulatorTransfer(future);
+		pthread_mutex_unlock(&simulatorLock);
+		return present;
+	}
+	// Allow for a few requests the recording has and this run does not, e.g. retries
+	end = MIN(simulatorNext + USB_SIMULATOR_RESYNC_WINDOW, simulatorCount);
+	for (i = simulatorNext; i < end && !matchUSBSimulatorTransfer(&simulatorTransfers[i], future); i++);
+	if (i == end) {
+		simulatorMismatched++;
+		LOG(LOG_DEBUG, "Request 0x%02X 0x%02X 0x%04X 0x%04X 0x%X is not in the recording, stalling it",
+			future->bmRequestType, future->bRequest, future->wValue, future->wIndex, future->length);
+		future->ret.ret = future->control ? USB_TRANSFER_STALL : USB_TRANSFER_ERROR;
+		future->ret.sz = 0;
+		future->due = future->submitted;
+		pthread_mutex_unlock(&simulatorLock);
+		return true;
+	}
+	transfer = &simulatorTransfers[i];
+	simulatorSkipped += i - simulatorNext;
+	simulatorMatched++;
+	simulatorNext = i + 1;
+
+	if (transfer->status == 0) {
+		future->ret.ret = USB_TRANSFER_OK;
+	} else if (transfer->status == -USBMON_EPIPE) {
+		future->ret.ret = USB_TRANSFER_STALL;
+	} else {
+		future->ret.ret = USB_TRANSFER_ERROR;
+	}
+	future->ret.sz = MIN(transfer->transferred, future->length);
+	if (future->control && transfer->in && future->ret.sz != 0) {
+		// Truncated recordings are padded with zeroes
+		memset(buffer, '\0', future->ret.sz);
+		memcpy(buffer, transfer->data, MIN(transfer->captured, future->ret.sz));
+		future->slot->dirty = true;
+	}
+	// Recorded aborts never completed on their own, so leave them pending until this run aborts them too
+	future->due = transfer->status == -USBMON_ECONNRESET ? UINT64_MAX : future->submitted + (transfer->completed - transfer->submitted);
+
+	// Compare the host's time between transfers with the recording's, the latencies are counted as they complete
+	if (simulatorRecordedCompletion != 0) {
+		atomic_fetch_add(&usbRecordedTime, transfer->submitted > simulatorRecordedCompletion ? transfer->submitted - simulatorRecordedCompletion : 0);
+		atomic_fetch_add(&usbReplayedTime, future->submitted > simulatorLastCompletion ? future->submitted - simulatorLastCompletion : 0);
+	}
+	atomic_fetch_add(&usbRecordedTime, transfer->completed - transfer->submitted);
+	simulatorRecordedCompletion = MAX(simulatorRecordedCompletion, transfer->completed);
+	pthread_mutex_unlock(&simulatorLock);
+	return true;
+}
+
+void cancelUSBSimulatorFuture(usb_future_t *future) {
+	uint64_t now = getMonotonicTime();
+	pthread_mutex_lock(&simulatorLock);
+	if (!atomic_load(&future->done) && future->due > now) {
+		future->ret.ret = USB_TRANSFER_ERROR;
+		future->ret.sz = 0;
+		future->due = now;
+	}
+	pthread_mutex_unlock(&simulatorLock);
+}
+
+void pollUSBSimulator(usb_future_t **futures, size_t count, uint64_t deadline) {
+	uint64_t now = getMonotonicTime(), next = UINT64_MAX;
+	bool completed = false;
+	size_t i;
+
+	pthread_mutex_lock(&simulatorLock);
+	for (i = 0; i < count; i++) {
+		if (futures[i] == NULL || atomic_load(&futures[i]->done)) {
+			continue;
+		}
+		if (futures[i]->due <= now) {
+			futures[i]->completed = futures[i]->due;
+			simulatorLastCompletion = MAX(simulatorLastCompletion, futures[i]->due);
+			atomic_fetch_add(&usbReplayedTime, futures[i]->due - futures[i]->submitted);
+			atomic_store(&futures[i]->done, true);
+			completed = true;
+		} else {
+			next = MIN(next, futures[i]->due);
+		}
+	}
+	pthread_mutex_unlock(&simulatorLock);
+	if (!completed && now < deadline) {
+		// Wake up now and then in case another thread aborts one of them
+		sleepUntil(MIN(MIN(deadline, next), now + USB_EVENT_POLL_INTERVAL * 1000000ULL), 0);
+	}
+}
+
+bool waitUSBSimulatorDevice(void) {
+	const usb_trace_transfer_t *previous, *next;
+	uint64_t gap;
+	bool present;
+
+	pthread_mutex_lock(&simulatorLock);
+	if (simulatorModelled) {
+		present = isUSBSimulatorDevicePresent();
+		simulatorOpenedMode = simulatorMode;
+		pthread_mutex_unlock(&simulatorLock);
+		return present;
+	}
+	if (simulatorNext == simulatorCount) {
+		pthread_mutex_unlock(&simulatorLock);
+		return false;
+	}
+	if (simulatorClosed && simulatorNext != 0) {
+		// Stay away for as long as the device was quiet in the recording, e.g. while it re-enumerated
+		previous = &simulatorTransfers[simulatorNext - 1];
+		next = &simulatorTransfers[simulatorNext];
+		gap = next->submitted > previous->completed ? next->submitted - previous->completed : 0;
+		pthread_mutex_unlock(&simulatorLock);
+		sleepUntil(simulatorLastCompletion + gap, 0);
+		pthread_mutex_lock(&simulatorLock);
+	}
+	simulatorClosed = false;
+	pthread_mutex_unlock(&simulatorLock);
+	return true;
+}
+
+bool resetUSBSimulatorDevice(void) {
+	bool kept = false;
+
+	pthread_mutex_lock(&simulatorLock);
+	if (simulatorModelled) {
+		if (simulatorState == DFU_STATE_MANIFEST_WAIT_RESET) {
+			restartUSBSimulatorDFU(); // The reset checkm8Reset() asked for
+		}
+		// The descriptors only change when a payload moved the device into another mode
+		kept = isUSBSimulatorDevicePresent() && simulatorMode == simulatorOpenedMode;
+	}
+	pthread_mutex_unlock(&simulatorLock);
+	return kept;
+}
+
+void closeUSBSimulatorDevice(void) {
+	pthread_mutex_lock(&simulatorLock);
+	simulatorClosed = true;
+	if (simulatorModelled && simulatorState == DFU_STATE_MANIFEST_WAIT_RESET) {
+		restartUSBSimulatorDFU(); // Closed without the reset it was waiting for, it restarts DFU when it re-enumerates
+	}
+	pthread_mutex_unlock(&simulatorLock);
+}
+
+char *getUSBSimulatorSerialNumber(void) {
+	const usb_trace_transfer_t *transfer;
+	char *serial;
+	size_t i, j, length;
+
+	if (simulatorModelled) {
+		if ((serial = malloc(USB_SIMULATOR_SERIAL_SIZE)) != NULL) {
+			pthread_mutex_lock(&simulatorLock);
+			getUSBSimulatorDeviceSerial(serial, USB_SIMULATOR_SERIAL_SIZE);
+			pthread_mutex_unlock(&simulatorLock);
+		}
+		return serial;
+	}
+	for (i = 0; i < simulatorCount; i++) {
+		transfer = &simulatorTransfers[i];
+		// A GET_DESCRIPTOR for a string, answered with a UTF-16 descriptor mentioning the CPID
+		if (!transfer->control || transfer->setup[0] != 0x80 || transfer->setup[1] != 6 || transfer->setup[3] != 3
+		|| transfer->status != 0 || transfer->captured < 2 || (length = MIN(transfer->data[0], transfer->captured) / 2) < 2
+		|| (serial = malloc(length)) == NULL) {
+			continue;
+		}
+		for (j = 1; j < length; j++) {
+			serial[j - 1] = (char)transfer->data[2 * j];
+		}
+		serial[length - 1] = '\0';
+		if (strstr(serial, "CPID:") != NULL) {
+			return serial;
+		}
+		free(serial);
+	}
+	return NULL;
+}
+
+uint16_t getUSBSimulatorBus(void) {
+	return simulatorCount != 0 ? simulatorTransfers[0].bus : 0;
+}
+
+#endif
@@ -0,0 +1,201 @@
+#include <usb/stats.h>
+
+#define USB_STATS_BULK_KEY 0x10000
+
+// Recording only touches atomics in one entry, so it is cheap enough to leave on all the time
+typedef struct {
+	atomic_uint key; // 0 while the entry is free, otherwise the key plus one
+	_Atomic uint64_t count, stalls, errors, cancelled, bytes;
+	_Atomic uint64_t minLatency, maxLatency, totalLatency; // The minimum is stored as UINT64_MAX minus the latency, so 0 means none yet
+	atomic_uint histogram[USB_STATS_BUCKETS];
+} usb_stats_entry_t;
+
+static usb_stats_entry_t usbStats[USB_STATS_MAX_KEYS];
+static _Atomic uint64_t usbStatsDropped; // Transfers of request types that did not fit in the table
+
+static const char *dfuRequestNames[] = {"DFU_DETACH", "DFU_DNLOAD", "DFU_UPLOAD", "DFU_GETSTATUS", "DFU_CLRSTATUS", "DFU_GETSTATE", "DFU_ABORT"};
+static const char *standardRequestNames[] = {"GET_STATUS", "CLEAR_FEATURE", NULL, "SET_FEATURE", NULL, "SET_ADDRESS", "GET_DESCRIPTOR", "SET_DESCRIPTOR", "GET_CONFIGURATION", "SET_CONFIGURATION"};
+
+// Purpose: Find the entry for a key, claiming a free one the first time the key is seen
+static usb_stats_entry_t *getUSBStatsEntry(unsigned key) {
+	unsigned expected, i, index;
+	for (i = 0; i < USB_STATS_MAX_KEYS; i++) {
+		index = (key * 0x9E3779B1u + i) % USB_STATS_MAX_KEYS;
+		expected = atomic_load_explicit(&usbStats[index].key, memory_order_acquire);
+		if (expected == 0) {
+			// Another thread may claim it first, in which case check whose key it took
+			atomic_compare_exchange_strong(&usbStats[index].key, &expected, key + 1);
+			expected = atomic_load_explicit(&usbStats[index].key, memory_order_acquire);
+		}
+		if (expected == key + 1) {
+			return &usbStats[index];
+		}
+	}
+	return NULL;
+}
+
+static void atomicMaxUSBStat(_Atomic uint64_t *stat, uint64_t value) {
+	uint64_t current = atomic_load_explicit(stat, memory_order_relaxed);
+	while (value > current && !atomic_compare_exchange_weak_explicit(stat, &current, value, memory_order_relaxed, memory_order_relaxed));
+}
+
+// Purpose: Map a latency to its log-linear histogram bucket, exact below 2^USB_STATS_SUB_BUCKET_BITS
+static size_t getUSBStatsBucket(uint64_t value) {
+	unsigned exponent;
+	if (value < (1 << USB_STATS_SUB_BUCKET_BITS)) {
+		return value;
+	}
+	exponent = 63 - __builtin_clzll(value);
+	return ((exponent - USB_STATS_SUB_BUCKET_BITS + 1) << USB_STATS_SUB_BUCKET_BITS)
+		| ((value >> (exponent - USB_STATS_SUB_BUCKET_BITS)) & ((1 << USB_STATS_SUB_BUCKET_BITS) - 1));
+}
+
+// Purpose: The smallest latency that falls in a bucket, the inverse of getUSBStatsBucket()
+static uint64_t getUSBStatsBucketStart(size_t bucket) {
+	size_t subBuckets = 1 << USB_STATS_SUB_BUCKET_BITS;
+	if (bucket < subBuckets) {
+		return bucket;
+	}
+	return (uint64_t)(subBuckets | bucket % subBuckets) << (bucket / subBuckets - 1);
+}
+
+void recordUSBTransfer(const usb_future_t *future) {
+	usb_stats_entry_t *entry;
+	uint64_t latency;
+
+	entry = getUSBStatsEntry(future->control ? (unsigned)future->bmRequestType << 8 | future->bRequest : USB_STATS_BULK_KEY);
+	if (entry == NULL) {
+		atomic_fetch_add_explicit(&usbStatsDropped, 1, memory_order_relaxed);
+		return;
+	}
+	latency = future->completed > future->submitted ? future->completed - future->submitted : 0;
+	atomic_fetch_add_explicit(&entry->count, 1, memory_order_relaxed);
+	if (future->cancelled) {
+		atomic_fetch_add_explicit(&entry->cancelled, 1, memory_order_relaxed);
+	} else if (future->ret.ret == USB_TRANSFER_STALL) {
+		atomic_fetch_add_explicit(&entry->stalls, 1, memory_order_relaxed);
+	} else if (future->ret.ret == USB_TRANSFER_ERROR) {
+		atomic_fetch_add_explicit(&entry->errors, 1, memory_order_relaxed);
+	}
+	atomic_fetch_add_explicit(&entry->bytes, future->ret.sz, memory_order_relaxed);
+	atomic_fetch_add_explicit(&entry->totalLatency, latency, memory_order_relaxed);
+	atomicMaxUSBStat(&entry->minLatency, UINT64_MAX - latency);
+	atomicMaxUSBStat(&entry->maxLatency, latency);
+	atomic_fetch_add_explicit(&entry->histogram[getUSBStatsBucket(latency)], 1, memory_order_relaxed);
+}
+
+size_t getUSBStats(usb_stats_t *stats, size_t count) {
+	usb_stats_entry_t *entry;
+	usb_stats_t *snapshot;
+	size_t found = 0, i, j;
+	unsigned key;
+
+	for (i = 0; i < USB_STATS_MAX_KEYS; i++) {
+		entry = &usbStats[i];
+		if ((key = atomic_load_explicit(&entry->key, memory_order_acquire)) == 0) {
+			continue;
+		}
+		if (stats != NULL && found < count) {
+			snapshot = &stats[found];
+			key--;
+			snapshot->bulk = key == USB_STATS_BULK_KEY;
+			snapshot->bmRequestType = snapshot->bulk ? 0 : key >> 8;
+			snapshot->bRequest = snapshot->bulk ? 0 : key & 0xFF;
+			snapshot->count = atomic_load_explicit(&entry->count, memory_order_relaxed);
+			snapshot->stalls = atomic_load_explicit(&entry->stalls, memory_order_relaxed);
+			snapshot->errors = atomic_load_explicit(&entry->errors, memory_order_relaxed);
+			snapshot->cancelled = atomic_load_explicit(&entry->cancelled, memory_order_relaxed);
+			snapshot->bytes = atomic_load_explicit(&entry->bytes, memory_order_relaxed);
+			snapshot->minLatency = UINT64_MAX - atomic_load_explicit(&entry->minLatency, memory_order_relaxed);
+			snapshot->maxLatency = atomic_load_explicit(&entry->maxLatency, memory_order_relaxed);
+			snapshot->totalLatency = atomic_load_explicit(&entry->totalLatency, memory_order_relaxed);
+			for (j = 0; j < USB_STATS_BUCKETS; j++) {
+				snapshot->histogram[j] = atomic_load_explicit(&entry->histogram[j], memory_order_relaxed);
+			}
+		}
+		found++;
+	}
+	return found;
+}
+
+uint64_t getUSBStatsPercentile(const usb_stats_t *stats, double percentile) {
+	uint64_t total = 0, target, seen = 0;
+	size_t i;
+
+	for (i = 0; i < USB_STATS_BUCKETS; i++) {
+		total += stats->histogram[i];
+	}
+	if (total == 0) {
+		return 0;
+	}
+	if ((target = (uint64_t)(percentile / 100 * total + 0.5)) == 0) {
+		target = 1;
+	}
+	for (i = 0; i < USB_STATS_BUCKETS; i++) {
+		if ((seen += stats->histogram[i]) >= target) {
+			break;
+		}
+	}
+	// The last bucket has no end, so fall back to the largest latency seen
+	if (i + 1 >= USB_STATS_BUCKETS) {
+		return stats->maxLatency;
+	}
+	return MIN(getUSBStatsBucketStart(i + 1) - 1, stats->maxLatency);
+}
+
+void resetUSBStats(void) {
+	// Only meant for between runs, a transfer finishing during the reset may be half counted
+	memset(usbStats, 0, sizeof(usbStats));
+	atomic_store(&usbStatsDropped, 0);
+}
+
+static int compareUSBStats(const void *a, const void *b) {
+	const usb_stats_t *left = a, *right = b;
+	if (left->bulk != right->bulk) {
+		return left->bulk - right->bulk;
+	}
+	return (left->bmRequestType << 8 | left->bRequest) - (right->bmRequestType << 8 | right->bRequest);
+}
+
+const char *getUSBRequestName(uint8_t bmRequestType, uint8_t bRequest) {
+	if ((bmRequestType & 0x60) == 0x20 && bRequest < sizeof(dfuRequestNames) / sizeof(dfuRequestNames[0])) {
+		return dfuRequestNames[bRequest];
+	}
+	if ((bmRequestType & 0x60) == 0 && bRequest < sizeof(standardRequestNames) / sizeof(standardRequestNames[0])) {
+		return standardRequestNames[bRequest];
+	}
+	return NULL;
+}
+
+void printUSBStats(void) {
+	usb_stats_t *stats;
+	const char *name;
+	char label[32];
+	size_t count, i;
+
+	if ((stats = malloc(USB_STATS_MAX_KEYS * sizeof(usb_stats_t))) == NULL) {
+		return;
+	}
+	count = MIN(getUSBStats(stats, USB_STATS_MAX_KEYS), USB_STATS_MAX_KEYS);
+	qsort(stats, count, sizeof(usb_stats_t), compareUSBStats);
+	LOG(LOG_INFO, "USB statistics (latencies in milliseconds):");
+	for (i = 0; i < count; i++) {
+		if (stats[i].bulk) {
+			snprintf(label, sizeof(label), "Bulk upload");
+		} else if ((name = getUSBRequestName(stats[i].bmRequestType, stats[i].bRequest)) != NULL) {
+			snprintf(label, sizeof(label), "0x%02X 0x%02X %s", stats[i].bmRequestType, stats[i].bRequest, name);
+		} else {
+			snprintf(label, sizeof(label), "0x%02X 0x%02X", stats[i].bmRequestType, stats[i].bRequest);
+		}
+		LOG(LOG_INFO, "%s: %llu transfers (%llu stalls, %llu errors, %llu cancelled), 0x%llX bytes, min %.3f mean %.3f p50 %.3f p90 %.3f p99 %.3f max %.3f",
+			label, (unsigned long long)stats[i].count, (unsigned long long)stats[i].stalls, (unsigned long long)stats[i].errors,
+			(unsigned long long)stats[i].cancelled, (unsigned long long)stats[i].bytes,
+			stats[i].minLatency / 1e6, stats[i].count != 0 ? stats[i].totalLatency / 1e6 / stats[i].count : 0,
+			getUSBStatsPercentile(&stats[i], 50) / 1e6, getUSBStatsPercentile(&stats[i], 90) / 1e6,
+			getUSBStatsPercentile(&stats[i], 99) / 1e6, stats[i].maxLatency / 1e6);
+	}
+	if (atomic_load(&usbStatsDropped) != 0) {
+		LOG(LOG_WARNING, "%llu transfers were not counted, increase USB_STATS_MAX_KEYS", (unsigned long long)atomic_load(&usbStatsDropped));
+	}
+	free(stats);
+}
@@ -0,0 +1,353 @@
+#include <usb/trace.h>
+#include <time.h>
+
+typedef struct {
+	atomic_size_t sequence; // Equal to the position when free, the position plus one once filled
+	usb_trace_record_t record;
+} usb_trace_cell_t;
+
+atomic_bool usbTracing = false;
+
+// Bounded multi-producer queue: transfers can finish on any thread, only the flush thread consumes.
+// Static so that a transfer finishing while the trace stops never writes to freed memory.
+static usb_trace_cell_t usbTraceRing[USB_TRACE_RING_SIZE];
+static atomic_size_t usbTraceTail;
+static size_t usbTraceHead;
+static _Atomic uint64_t usbTraceNextID, usbTraceDropped;
+static size_t usbTraceMaxPayload;
+static uint64_t usbTraceClockOffset; // Wall clock minus monotonic time, in nanoseconds
+static FILE *usbTraceFile;
+static pthread_t usbTraceThread;
+static atomic_bool usbTraceRunning;
+
+typedef struct {
+	uint32_t magic;
+	uint16_t versionMajor, versionMinor;
+	int32_t timezone;
+	uint32_t sigfigs, snaplen, linktype;
+} pcap_header_t;
+
+typedef struct {
+	uint32_t seconds, nanoseconds, capturedLength, length;
+} pcap_record_header_t;
+
+// Purpose: Write one usbmon packet, the submission or the completion of a transfer
+static void writeUSBTracePacket(const usb_trace_record_t *record, bool completion) {
+	pcap_record_header_t pcapHeader;
+	usbmon_header_t header = {0};
+	uint64_t time = (completion ? record->completed : record->submitted) + usbTraceClockOffset;
+	// OUT data goes with the submission and IN data with the completion, as usbmon does
+	bool hasData = record->in == completion && record->captured != 0;
+
+	header.id = record->id;
+	header.type = completion ? 'C' : 'S';
+	header.transferType = record->control ? 2 : 3;
+	header.endpoint = (record->control ? 0 : USB_BULK_ENDPOINT) | (record->in ? 0x80 : 0);
+	header.device = 1; // The handle does not know its address, and there is only ever one device
+	header.bus = record->bus;
+	header.seconds = time / 1000000000ULL;
+	header.microseconds = (time % 1000000000ULL) / 1000;
+	if (!completion && record->control) {
+		memcpy(header.setup, record->setup, sizeof(header.setup));
+	} else {
+		header.setupFlag = '-';
+	}
+	header.dataFlag = hasData ? 0 : (record->in ? '<' : '>');
+	header.status = completion ? record->status : -115; // -EINPROGRESS on submission
+	header.length = completion ? record->transferred : record->requested;
+	header.capturedLength = hasData ? record->captured : 0;
+
+	pcapHeader.seconds = (uint32_t)(time / 1000000000ULL);
+	pcapHeader.nanoseconds = time % 1000000000ULL;
+	pcapHeader.capturedLength = sizeof(header) + header.capturedLength;
+	pcapHeader.length = sizeof(header) + (hasData ? (completion ? record->transferred : record->requested) : 0);
+	fwrite(&pcapHeader, sizeof(pcapHeader), 1, usbTraceFile);
+	fwrite(&header, sizeof(header), 1, usbTraceFile);
+	if (hasData) {
+		fwrite(record->data, record->captured, 1, usbTraceFile);
+	}
+}
+
+// Purpose: Write out every record the producers have finished filling in
+static void flushUSBTrace(void) {
+	usb_trace_cell_t *cell;
+	bool flushed = false;
+
+	for (;;) {
+		cell = &usbTraceRing[usbTraceHead % USB_TRACE_RING_SIZE];
+		if (atomic_load_explicit(&cell->sequence, memory_order_acquire) != usbTraceHead + 1) {
+			break;
+		}
+		writeUSBTracePacket(&cell->record, false);
+		writeUSBTracePacket(&cell->record, true);
+		atomic_store_explicit(&cell->sequence, usbTraceHead + USB_TRACE_RING_SIZE, memory_order_release);
+		usbTraceHead++;
+		flushed = true;
+	}
+	if (flushed) {
+		fflush(usbTraceFile);
+	}
+}
+
+static void *USBTraceThread(void *arg) {
+	while (atomic_load(&usbTraceRunning)) {
+		flushUSBTrace();
+		usleep(USB_TRACE_FLUSH_INTERVAL * 1000);
+	}
+	return NULL;
+}
+
+bool startUSBTrace(const char *path, size_t maxPayload) {
+	pcap_header_t header = {USB_TRACE_MAGIC, 2, 4, 0, 0, sizeof(usbmon_header_t) + USB_TRACE_MAX_PAYLOAD, USB_TRACE_LINKTYPE};
+	struct timespec now;
+	size_t i;
+
+	if (usbTraceFile != NULL) {
+		return false;
+	}
+	if ((usbTraceFile = fopen(path, "wb")) == NULL) {
+		LOG(LOG_ERROR, "Failed to open %s for writing", path);
+		return false;
+	}
+	fwrite(&header, sizeof(header), 1, usbTraceFile);
+	for (i = 0; i < USB_TRACE_RING_SIZE; i++) {
+		atomic_store(&usbTraceRing[i].sequence, i);
+	}
+	atomic_store(&usbTraceTail, 0);
+	atomic_store(&usbTraceDropped, 0);
+	usbTraceHead = 0;
+	usbTraceMaxPayload = MIN(maxPayload, USB_TRACE_MAX_PAYLOAD);
+	clock_gettime(CLOCK_REALTIME, &now);
+	usbTraceClockOffset = now.tv_sec * 1000000000ULL + now.tv_nsec - getMonotonicTime();
+	atomic_store(&usbTraceRunning, true);
+	if (pthread_create(&usbTraceThread, NULL, USBTraceThread, NULL) != 0) {
+		LOG(LOG_ERROR, "Failed to start the USB trace thread");
+		fclose(usbTraceFile);
+		usbTraceFile = NULL;
+		return false;
+	}
+	atomic_store(&usbTracing, true);
+	LOG(LOG_VERBOSE, "Recording USB transfers to %s", path);
+	return true;
+}
+
+void traceUSBTransfer(const usb_future_t *future, const void *data) {
+	usb_trace_record_t *record;
+	usb_trace_cell_t *cell;
+	size_t position = atomic_load_explicit(&usbTraceTail, memory_order_relaxed), sequence;
+
+	for (;;) {
+		cell = &usbTraceRing[position % USB_TRACE_RING_SIZE];
+		sequence = atomic_load_explicit(&cell->sequence, memory_order_acquire);
+		if (sequence == position) {
+			if (atomic_compare_exchange_weak_explicit(&usbTraceTail, &position, position + 1, memory_order_relaxed, memory_order_relaxed)) {
+				break;
+			}
+		} else if (sequence < position) {
+			// Full, never make the exploit wait for the file
+			atomic_fetch_add_explicit(&usbTraceDropped, 1, memory_order_relaxed);
+			return;
+		} else {
+			position = atomic_load_explicit(&usbTraceTail, memory_order_relaxed);
+		}
+	}
+
+	record = &cell->record;
+	record->id = atomic_fetch_add_explicit(&usbTraceNextID, 1, memory_order_relaxed);
+	record->submitted = future->submitted;
+	record->completed = future->completed;
+	record->control = future->control;
+	record->in = !future->out;
+	record->bus = (uint16_t)getUSBHostControllerID(future->handle);
+	if (future->ret.ret == USB_TRANSFER_OK) {
+		record->status = 0;
+	} else if (future->ret.ret == USB_TRANSFER_STALL) {
+		record->status = -USBMON_EPIPE;
+	} else {
+		record->status = future->cancelled ? -USBMON_ECONNRESET : -USBMON_EPROTO;
+	}
+	record->setup[0] = future->bmRequestType;
+	record->setup[1] = future->bRequest;
+	record->setup[2] = future->wValue & 0xFF;
+	record->setup[3] = future->wValue >> 8;
+	record->setup[4] = future->wIndex & 0xFF;
+	record->setup[5] = future->wIndex >> 8;
+	record->setup[6] = future->length & 0xFF;
+	record->setup[7] = (future->length >> 8) & 0xFF;
+	record->requested = future->length;
+	record->transferred = future->ret.sz;
+	record->captured = data != NULL ? MIN(record->in ? record->transferred : record->requested, usbTraceMaxPayload) : 0;
+	if (record->captured != 0) {
+		memcpy(record->data, data, record->captured);
+	}
+	atomic_store_explicit(&cell->sequence, position + 1, memory_order_release);
+}
+
+void stopUSBTrace(void) {
+	uint64_t dropped;
+	if (!atomic_exchange(&usbTracing, false)) {
+		return;
+	}
+	atomic_store(&usbTraceRunning, false);
+	pthread_join(usbTraceThread, NULL);
+	flushUSBTrace();
+	fclose(usbTraceFile);
+	usbTraceFile = NULL;
+	if ((dropped = atomic_load(&usbTraceDropped)) != 0) {
+		LOG(LOG_WARNING, "%llu USB transfers were left out of the recording because it could not keep up", (unsigned long long)dropped);
+	}
+}
+
+typedef struct {
+	uint64_t id;
+	size_t index;
+} usb_trace_submission_t;
+
+static int compareUSBTraceTransfers(const void *a, const void *b) {
+	const usb_trace_transfer_t *left = a, *right = b;
+	if (left->submitted != right->submitted) {
+		return left->submitted < right->submitted ? -1 : 1;
+	}
+	return left->completed < right->completed ? -1 : left->completed > right->completed;
+}
+
+// Purpose: Read the next packet of a pcap file, growing the buffer as needed
+static bool readUSBTracePacket(FILE *file, bool nanoseconds, uint64_t *time, uint8_t **buffer, size_t *bufferSize, uint32_t *length) {
+	pcap_record_header_t header;
+	uint8_t *grown;
+
+	if (fread(&header, sizeof(header), 1, file) != 1) {
+		return false;
+	}
+	if (header.capturedLength > *bufferSize) {
+		if ((grown = realloc(*buffer, header.capturedLength)) == NULL) {
+			return false;
+		}
+		*buffer = grown;
+		*bufferSize = header.capturedLength;
+	}
+	if (fread(*buffer, 1, header.capturedLength, file) != header.capturedLength) {
+		return false;
+	}
+	*time = header.seconds * 1000000000ULL + header.nanoseconds * (nanoseconds ? 1 : 1000);
+	*length = header.capturedLength;
+	return true;
+}
+
+bool readUSBTrace(const char *path, usb_trace_transfer_t **transfers, size_t *count) {
+	usb_trace_submission_t *submissions = NULL, *grownSubmissions;
+	usb_trace_transfer_t *list = NULL, *grownList, *transfer;
+	size_t listSize = 0, listCount = 0, submissionSize = 0, submissionCount = 0, bufferSize = 0, headerSize, i, j;
+	uint32_t length, dataLength;
+	usbmon_header_t header;
+	uint8_t *buffer = NULL, *data;
+	pcap_header_t fileHeader;
+	bool nanoseconds;
+	uint64_t time;
+	FILE *file;
+
+	if ((file = fopen(path, "rb")) == NULL) {
+		LOG(LOG_ERROR, "Failed to open %s", path);
+		return false;
+	}
+	if (fread(&fileHeader, sizeof(fileHeader), 1, file) != 1
+	|| (fileHeader.magic != USB_TRACE_MAGIC && fileHeader.magic != 0xA1B2C3D4)
+	|| (fileHeader.linktype != USB_TRACE_LINKTYPE && fileHeader.linktype != 220)) {
+		LOG(LOG_ERROR, "%s is not a usbmon capture in host byte order", path);
+		fclose(file);
+		return false;
+	}
+	nanoseconds = fileHeader.magic == USB_TRACE_MAGIC;
+	// LINKTYPE_USB_LINUX_MMAPPED adds isochronous fields after the same 48 bytes
+	headerSize = fileHeader.linktype == USB_TRACE_LINKTYPE ? sizeof(usbmon_header_t) : 64;
+
+	while (readUSBTracePacket(file, nanoseconds, &time, &buffer, &bufferSize, &length)) {
+		if (length < headerSize) {
+			continue;
+		}
+		memcpy(&header, buffer, sizeof(header));
+		if (header.transferType != 2 && header.transferType != 3) {
+			continue;
+		}
+		data = buffer + headerSize;
+		dataLength = MIN(header.capturedLength, length - headerSize);
+		if (header.type == 'S') {
+			if (listCount == listSize) {
+				listSize = listSize != 0 ? listSize * 2 : 256;
+				if ((grownList = realloc(list, listSize * sizeof(usb_trace_transfer_t))) == NULL) {
+					break;
+				}
+				list = grownList;
+			}
+			if (submissionCount == submissionSize) {
+				submissionSize = submissionSize != 0 ? submissionSize * 2 : 16;
+				if ((grownSubmissions = realloc(submissions, submissionSize * sizeof(usb_trace_submission_t))) == NULL) {
+					break;
+				}
+				submissions = grownSubmissions;
+			}
+			transfer = &list[listCount];
+			memset(transfer, 0, sizeof(usb_trace_transfer_t));
+			transfer->submitted = time;
+			transfer->control = header.transferType == 2;
+			transfer->in = (header.endpoint & 0x80) != 0;
+			transfer->endpoint = header.endpoint;
+			transfer->device = header.device;
+			transfer->bus = header.bus;
+			transfer->requested = header.length;
+			if (header.setupFlag == 0) {
+				memcpy(transfer->setup, header.setup, sizeof(transfer->setup));
+			}
+			if (header.dataFlag == 0 && dataLength != 0 && (transfer->data = malloc(dataLength)) != NULL) {
+				memcpy(transfer->data, data, dataLength);
+				transfer->captured = dataLength;
+			}
+			submissions[submissionCount].id = header.id;
+			submissions[submissionCount++].index = listCount++;
+		} else if (header.type == 'C' || header.type == 'E') {
+			// Completions usually follow their submission closely, so search from the newest
+			for (i = submissionCount; i-- > 0 && submissions[i].id != header.id;);
+			if (i == (size_t)-1) {
+				continue;
+			}
+			transfer = &list[submissions[i].index];
+			transfer->completed = time;
+			transfer->status = header.type == 'E' ? -USBMON_EPROTO : header.status;
+			transfer->transferred = header.length;
+			if (header.dataFlag == 0 && dataLength != 0 && transfer->data == NULL && (transfer->data = malloc(dataLength)) != NULL) {
+				memcpy(transfer->data, data, dataLength);
+				transfer->captured = dataLength;
+			}
+			memmove(&submissions[i], &submissions[i + 1], (--submissionCount - i) * sizeof(usb_trace_submission_t));
+		}
+	}
+	fclose(file);
+	free(buffer);
+
+	// Drop submissions that never completed, the capture ended first
+	for (i = 0; i < submissionCount; i++) {
+		free(list[submissions[i].index].data);
+		list[submissions[i].index].data = NULL;
+		list[submissions[i].index].completed = 0;
+	}
+	free(submissions);
+	for (i = j = 0; i < listCount; i++) {
+		if (list[i].completed != 0) {
+			list[j++] = list[i];
+		}
+	}
+	if (j != 0) {
+		qsort(list, j, sizeof(usb_trace_transfer_t), compareUSBTraceTransfers);
+	}
+	*transfers = list;
+	*count = j;
+	return true;
+}
+
+void freeUSBTrace(usb_trace_transfer_t *transfers, size_t count) {
+	size_t i;
+	for (i = 0; i < count; i++) {
+		free(transfers[i].data);
+	}
+	free(transfers);
+}
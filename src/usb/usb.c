@@ -1,4 +1,13 @@
 #include <usb/usb.h>
+#include <usb/stats.h>
+#include <usb/trace.h>
+#include <usb/simulator.h>
+#include <usb/faults.h>
+
+unsigned usbAbortSpin = 0;
+atomic_size_t usbRequestAllocations = 0;
+_Atomic uint64_t usbControlTransfers = 0, usbControlBytes = 0, usbBulkBytes = 0;
+_Atomic uint64_t usbRecordedTime = 0, usbReplayedTime = 0;
 
 char *getDeviceSerialNumber(usb_handle_t *handle) {
 	transfer_ret_t transfer_ret;
@@ -24,94 +33,623 @@ void sleep_ms(unsigned ms) {
 	nanosleep(&ts, NULL);
 }
 
+static bool initUSBTransferSlot(usb_transfer_slot_t *slot, bool pooled) {
+	void *buffer;
+	memset(slot, 0, sizeof(usb_transfer_slot_t));
+	if (posix_memalign(&buffer, getpagesize(), USB_TRANSFER_POOL_DATA_OFFSET + USB_TRANSFER_POOL_BUFFER_SIZE) != 0) {
+		return false;
+	}
+	memset(buffer, '\0', USB_TRANSFER_POOL_DATA_OFFSET + USB_TRANSFER_POOL_BUFFER_SIZE);
+	slot->buffer = buffer;
 #ifdef ACHILLES_LIBUSB
+	if ((slot->transfer = libusb_alloc_transfer(0)) == NULL) {
+		free(slot->buffer);
+		return false;
+	}
+#endif
+	slot->pooled = pooled;
+	return true;
+}
 
-void closeUSBHandle(usb_handle_t *handle) {
-	libusb_release_interface(handle->device, 0);
-	libusb_close(handle->device);
-	libusb_exit(handle->context);
+static void freeUSBTransferSlot(usb_transfer_slot_t *slot) {
+#ifdef ACHILLES_LIBUSB
+	libusb_free_transfer(slot->transfer);
+#endif
+	free(slot->buffer);
 }
 
-void resetUSBHandle(usb_handle_t *handle) {
-	libusb_reset_device(handle->device);
+static void createUSBTransferPool(usb_handle_t *handle) {
+	size_t i;
+	if (handle->pool != NULL || (handle->pool = malloc(sizeof(usb_transfer_pool_t))) == NULL) {
+		return;
+	}
+	for (i = 0; i < USB_TRANSFER_POOL_SIZE; i++) {
+		if (!initUSBTransferSlot(&handle->pool->slots[i], true)) {
+			while (i-- > 0) {
+				freeUSBTransferSlot(&handle->pool->slots[i]);
+			}
+			free(handle->pool);
+			handle->pool = NULL;
+			return;
+		}
+	}
 }
 
-bool waitUSBHandle(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg) {
-	if (libusb_init(NULL) == LIBUSB_SUCCESS) {
-		for (;;) {
-			if ((handle->device = libusb_open_device_with_vid_pid(NULL, handle->vid, handle->pid)) != NULL) {
-				LOG(LOG_DEBUG, "Opened device 0x%X, 0x%X", handle->vid, handle->pid);
-				if (libusb_set_configuration(handle->device, 1) == LIBUSB_SUCCESS && (usb_check_cb == NULL || usb_check_cb(handle, arg))) {
-					return true;
-				}
-				libusb_close(handle->device);
+static void destroyUSBTransferPool(usb_handle_t *handle) {
+	size_t i;
+	if (handle->pool == NULL) {
+		return;
+	}
+	for (i = 0; i < USB_TRANSFER_POOL_SIZE; i++) {
+		freeUSBTransferSlot(&handle->pool->slots[i]);
+	}
+	free(handle->pool);
+	handle->pool = NULL;
+}
+
+// Purpose: Take a transfer and buffer from the handle's pool, only allocating if the pool is exhausted or too small
+static usb_transfer_slot_t *acquireUSBTransferSlot(const usb_handle_t *handle, size_t wLength, bool zero) {
+	usb_transfer_slot_t *slot = NULL;
+	size_t i;
+
+	if (handle->pool != NULL && wLength <= USB_TRANSFER_POOL_BUFFER_SIZE) {
+		for (i = 0; i < USB_TRANSFER_POOL_SIZE && slot == NULL; i++) {
+			// Claim the slot atomically, requests may be submitted from several threads
+			if (!atomic_exchange(&handle->pool->slots[i].inUse, true)) {
+				slot = &handle->pool->slots[i];
 			}
-			sleep_ms(USB_TIMEOUT);
+		}
+	}
+	if (slot == NULL) {
+		atomic_fetch_add_explicit(&usbRequestAllocations, 1, memory_order_relaxed);
+		if (wLength > USB_TRANSFER_POOL_BUFFER_SIZE) {
+			// Too big for a pool buffer, allocate one to size
+			if ((slot = calloc(1, sizeof(usb_transfer_slot_t))) == NULL) {
+				return NULL;
+			}
+			if ((slot->buffer = calloc(1, USB_TRANSFER_POOL_DATA_OFFSET + wLength)) == NULL) {
+				free(slot);
+				return NULL;
+			}
+#ifdef ACHILLES_LIBUSB
+			if ((slot->transfer = libusb_alloc_transfer(0)) == NULL) {
+				free(slot->buffer);
+				free(slot);
+				return NULL;
+			}
+#endif
+		} else if ((slot = malloc(sizeof(usb_transfer_slot_t))) == NULL || !initUSBTransferSlot(slot, false)) {
+			free(slot);
+			return NULL;
+		}
+	} else if (zero && slot->dirty) {
+		memset(slot->buffer + USB_TRANSFER_POOL_DATA_OFFSET, '\0', USB_TRANSFER_POOL_BUFFER_SIZE);
+		slot->dirty = false;
+	}
+	atomic_store(&slot->inUse, true);
+	return slot;
+}
+
+static void releaseUSBTransferSlot(usb_transfer_slot_t *slot) {
+	if (slot->pooled) {
+		atomic_store(&slot->inUse, false);
+		return;
+	}
+	freeUSBTransferSlot(slot);
+	free(slot);
+}
+
+// Purpose: Find a future that has completed, skipping NULL entries and ones an injected fault still holds back
+static bool findDoneUSBFuture(usb_future_t **futures, size_t count, size_t *index) {
+	size_t i;
+	for (i = 0; i < count; i++) {
+		if (futures[i] != NULL && atomic_load(&futures[i]->done)
+		&& (!atomic_load_explicit(&usbFaulting, memory_order_relaxed) || releaseUSBFault(futures[i]))) {
+			*index = i;
+			return true;
 		}
 	}
 	return false;
 }
 
-void USBAsyncCallback(struct libusb_transfer *transfer) {
-	*(int *)transfer->user_data = 1;
+// Purpose: Claim a slot for a request and fill in the parts of its future that every backend shares
+static usb_future_t *prepareUSBFuture(const usb_handle_t *handle, bool control, bool out, void *pData, size_t wLength) {
+	usb_transfer_slot_t *slot;
+	usb_future_t *future;
+
+	// Bulk uploads are sent straight from the caller's buffer, only control requests use the pool buffer
+	if ((slot = acquireUSBTransferSlot(handle, control ? wLength : 0, control && out && pData == NULL)) == NULL) {
+		return NULL;
+	}
+	// A NULL pData on an OUT request sends zeroes straight from the pool buffer
+	if (control && out && pData != NULL) {
+		memcpy(slot->buffer + USB_TRANSFER_POOL_DATA_OFFSET, pData, wLength);
+		slot->dirty = true;
+	}
+	future = &slot->future;
+	future->handle = handle;
+	future->slot = slot;
+	future->pData = pData;
+	future->out = out;
+	future->control = control;
+	future->cancelled = false;
+	future->bmRequestType = future->bRequest = 0;
+	future->wValue = future->wIndex = 0;
+	future->length = (uint32_t)wLength;
+	future->ret.ret = USB_TRANSFER_ERROR;
+	future->ret.sz = 0;
+	future->fault = 0;
+	future->faultDue = 0;
+#ifdef ACHILLES_USBFS
+	future->urb = false;
+#endif
+	atomic_store(&future->done, false);
+	return future;
+}
+
+static uint64_t getUSBFutureDeadline(unsigned timeout) {
+	return timeout == USB_FUTURE_WAIT_FOREVER ? UINT64_MAX : getMonotonicTime() + timeout * 1000000ULL;
 }
 
-bool sendUSBControlRequest(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength, transfer_ret_t *transferRet) {
-	int ret = libusb_control_transfer(handle->device, bmRequestType, bRequest, wValue, wIndex, pData, (uint16_t)wLength, USB_TIMEOUT);
+#ifdef ACHILLES_LIBUSB
 
+#ifdef ACHILLES_USBFS
+
+// Purpose: Open a second usbfs node for the device behind a libusb handle, so control requests bypass libusb
+static void openUSBFSNode(usb_handle_t *handle) {
+	libusb_device *device = libusb_get_device(handle->device);
+	struct epoll_event event;
+	unsigned int interface = 0;
+	char path[32];
+
+	snprintf(path, sizeof(path), "/dev/bus/usb/%03u/%03u", libusb_get_bus_number(device), libusb_get_device_address(device));
+	if ((handle->fd = open(path, O_RDWR | O_CLOEXEC)) == -1) {
+		LOG(LOG_DEBUG, "Failed to open %s (%s), falling back to libusb", path, strerror(errno));
+		return;
+	}
+	// usbfs reports reapable URBs as writable
+	event.events = EPOLLOUT;
+	event.data.fd = handle->fd;
+	if ((handle->epollFd = epoll_create1(EPOLL_CLOEXEC)) == -1 || epoll_ctl(handle->epollFd, EPOLL_CTL_ADD, handle->fd, &event) == -1) {
+		LOG(LOG_DEBUG, "Failed to set up epoll on %s, falling back to libusb", path);
+		if (handle->epollFd != -1) {
+			close(handle->epollFd);
+		}
+		close(handle->fd);
+		handle->fd = handle->epollFd = -1;
+		return;
+	}
+	// DFU and PongoOS class requests go to interface 0, and the kernel would otherwise claim it
+	// for this node on the first one, with a warning, and keep libusb from claiming it later
+	handle->fdInterface = ioctl(handle->fd, USBDEVFS_CLAIMINTERFACE, &interface) == 0;
+	if (!handle->fdInterface) {
+		LOG(LOG_DEBUG, "Failed to claim interface 0 on %s (%s), sending interface requests through libusb", path, strerror(errno));
+	}
+}
+
+// Purpose: Hand interface 0 over from the usbfs node to libusb, interface requests follow it
+static void releaseUSBFSInterface(usb_handle_t *handle) {
+	unsigned int interface = 0;
+	if (handle->fdInterface) {
+		ioctl(handle->fd, USBDEVFS_RELEASEINTERFACE, &interface);
+		handle->fdInterface = false;
+	}
+}
+
+static void closeUSBFSNode(usb_handle_t *handle) {
+	if (handle->fd != -1) {
+		releaseUSBFSInterface(handle);
+		close(handle->epollFd);
+		close(handle->fd);
+		handle->fd = handle->epollFd = -1;
+	}
+}
+
+static void setUSBFSTransferRet(int status, uint32_t sz, transfer_ret_t *transferRet) {
 	if(transferRet != NULL) {
-		if(ret >= 0) {
-			transferRet->sz = (uint32_t)ret;
+		transferRet->sz = sz;
+		if(status == 0) {
 			transferRet->ret = USB_TRANSFER_OK;
-		} else if(ret == LIBUSB_ERROR_PIPE) {
+		} else if(status == -EPIPE) {
 			transferRet->ret = USB_TRANSFER_STALL;
 		} else {
 			transferRet->ret = USB_TRANSFER_ERROR;
 		}
 	}
-	return true;
 }
 
-bool sendUSBControlRequestAsync(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength, unsigned usbAbortTimeout, transfer_ret_t *transferRet) {
-	struct libusb_transfer *transfer = libusb_alloc_transfer(0);
-	struct timeval tv;
-	int completed = 0;
-	uint8_t *buf;
+// Purpose: Reap every completed URB on the handle's usbfs node and fill in the results of their futures
+static void reapUSBFSURBs(const usb_handle_t *handle) {
+	struct usbdevfs_urb *urb;
+	usb_future_t *future;
 
-	if(transfer != NULL) {
-		if((buf = malloc(LIBUSB_CONTROL_SETUP_SIZE + wLength)) != NULL) {
-			if((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT) {
-				memcpy(buf + LIBUSB_CONTROL_SETUP_SIZE, pData, wLength);
-			}
-			libusb_fill_control_setup(buf, bmRequestType, bRequest, wValue, wIndex, (uint16_t)wLength);
-			libusb_fill_control_transfer(transfer, handle->device, buf, USBAsyncCallback, &completed, USB_TIMEOUT);
-			if(libusb_submit_transfer(transfer) == LIBUSB_SUCCESS) {
-				tv.tv_sec = usbAbortTimeout / 1000;
-				tv.tv_usec = (usbAbortTimeout % 1000) * 1000;
-				while(completed == 0 && libusb_handle_events_timeout_completed(NULL, &tv, &completed) == LIBUSB_SUCCESS) {
-					libusb_cancel_transfer(transfer);
-				}
-				if(completed != 0) {
-					if((bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_IN) {
-						memcpy(pData, libusb_control_transfer_get_data(transfer), transfer->actual_length);
-					}
-					if(transferRet != NULL) {
-						transferRet->sz = (uint32_t)transfer->actual_length;
-						if(transfer->status == LIBUSB_TRANSFER_COMPLETED) {
-							transferRet->ret = USB_TRANSFER_OK;
-						} else if(transfer->status == LIBUSB_TRANSFER_STALL) {
-							transferRet->ret = USB_TRANSFER_STALL;
-						} else {
-							transferRet->ret = USB_TRANSFER_ERROR;
-						}
+	while (ioctl(handle->fd, USBDEVFS_REAPURBNDELAY, &urb) == 0) {
+		future = urb->usercontext;
+		// Discarded URBs come back with -ENOENT or -ECONNRESET, which the exploit treats as an error
+		setUSBFSTransferRet(urb->status, (uint32_t)urb->actual_length, &future->ret);
+		future->completed = getMonotonicTime();
+		atomic_store(&future->done, true);
+	}
+}
+
+static usb_future_t *submitUSBFSControlRequest(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength) {
+	bool out = (bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
+	struct usbdevfs_urb *urb;
+	usb_future_t *future;
+
+	if ((future = prepareUSBFuture(handle, true, out, pData, wLength)) == NULL) {
+		return NULL;
+	}
+	future->bmRequestType = bmRequestType;
+	future->bRequest = bRequest;
+	future->wValue = wValue;
+	future->wIndex = wIndex;
+	future->urb = true;
+	urb = &future->slot->urb;
+	libusb_fill_control_setup(future->slot->buffer, bmRequestType, bRequest, wValue, wIndex, (uint16_t)wLength);
+	memset(urb, 0, sizeof(struct usbdevfs_urb));
+	urb->type = USBDEVFS_URB_TYPE_CONTROL;
+	urb->endpoint = 0;
+	urb->buffer = future->slot->buffer;
+	urb->buffer_length = LIBUSB_CONTROL_SETUP_SIZE + wLength;
+	urb->usercontext = future;
+	future->submitted = getMonotonicTime();
+	if (ioctl(handle->fd, USBDEVFS_SUBMITURB, urb) != 0) {
+		releaseUSBTransferSlot(future->slot);
+		return NULL;
+	}
+	return future;
+}
+
+#endif
+
+// Purpose: Deliver transfer completions for a handle's context until the handle is closed
+static void *USBEventThread(void *arg) {
+	usb_event_thread_t *events = arg;
+	while (atomic_load(&events->running)) {
+		libusb_handle_events_completed(events->context, NULL);
+	}
+	return NULL;
+}
+
+static void startUSBEventThread(usb_handle_t *handle) {
+	pthread_condattr_t attr;
+	usb_event_thread_t *events;
+
+	if ((events = calloc(1, sizeof(usb_event_thread_t))) == NULL) {
+		return;
+	}
+	events->context = handle->context;
+	atomic_store(&events->running, true);
+	atomic_store(&events->completions, NULL);
+	pthread_mutex_init(&events->lock, NULL);
+	pthread_condattr_init(&attr);
+#ifndef __APPLE__
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+	pthread_cond_init(&events->cond, &attr);
+	pthread_condattr_destroy(&attr);
+	if (pthread_create(&events->thread, NULL, USBEventThread, events) != 0) {
+		LOG(LOG_DEBUG, "Failed to start USB event thread");
+		pthread_cond_destroy(&events->cond);
+		pthread_mutex_destroy(&events->lock);
+		free(events);
+		return;
+	}
+	handle->events = events;
+}
+
+static void stopUSBEventThread(usb_handle_t *handle) {
+	usb_event_thread_t *events = handle->events;
+	if (events == NULL) {
+		return;
+	}
+	atomic_store(&events->running, false);
+	libusb_interrupt_event_handler(events->context);
+	pthread_join(events->thread, NULL);
+	pthread_cond_destroy(&events->cond);
+	pthread_mutex_destroy(&events->lock);
+	free(events);
+	handle->events = NULL;
+}
+
+// Purpose: Sleep until woken by a completion or until the timeout, in nanoseconds, expires
+static void waitUSBEventCondition(usb_event_thread_t *events, uint64_t timeout) {
+	struct timespec ts;
+	timeout = MIN(timeout, USB_EVENT_POLL_INTERVAL * 1000000ULL); // Wake up now and then in case the event thread has gone away
+#ifdef __APPLE__
+	ts.tv_sec = timeout / 1000000000ULL;
+	ts.tv_nsec = timeout % 1000000000ULL;
+	pthread_cond_timedwait_relative_np(&events->cond, &events->lock, &ts);
+#else
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	timeout += ts.tv_nsec;
+	ts.tv_sec += timeout / 1000000000ULL;
+	ts.tv_nsec = timeout % 1000000000ULL;
+	pthread_cond_timedwait(&events->cond, &events->lock, &ts);
+#endif
+}
+
+static void wakeUSBEventWaiters(usb_event_thread_t *events) {
+	if (atomic_load(&events->sleepers) != 0) {
+		pthread_mutex_lock(&events->lock);
+		pthread_cond_broadcast(&events->cond);
+		pthread_mutex_unlock(&events->lock);
+	}
+}
+
+// Runs on the event thread, so only queue the future and leave the rest to the waiters
+static void USBAsyncCallback(struct libusb_transfer *transfer) {
+	usb_future_t *future = transfer->user_data;
+	usb_event_thread_t *events = future->handle->events;
+	usb_future_t *head = atomic_load(&events->completions);
+	future->completed = getMonotonicTime();
+	do {
+		future->next = head;
+	} while (!atomic_compare_exchange_weak(&events->completions, &head, future));
+	wakeUSBEventWaiters(events);
+}
+
+// Purpose: Take every queued completion and fill in the results of their futures
+static void processUSBCompletions(usb_event_thread_t *events) {
+	usb_future_t *future = atomic_exchange(&events->completions, NULL), *next;
+	struct libusb_transfer *transfer;
+	bool processed = future != NULL;
+
+	for (; future != NULL; future = next) {
+		next = future->next; // The future may be reused as soon as it is marked done
+		transfer = future->slot->transfer;
+		future->ret.sz = (uint32_t)transfer->actual_length;
+		if (transfer->status == LIBUSB_TRANSFER_COMPLETED) {
+			future->ret.ret = USB_TRANSFER_OK;
+		} else if (transfer->status == LIBUSB_TRANSFER_STALL) {
+			future->ret.ret = USB_TRANSFER_STALL;
+		} else {
+			future->ret.ret = USB_TRANSFER_ERROR;
+		}
+		atomic_store(&future->done, true);
+	}
+	if (processed) {
+		// Some of these may belong to other waiters
+		wakeUSBEventWaiters(events);
+	}
+}
+
+// Purpose: Collect completions for the futures, sleeping until the deadline if none of them is done yet
+static void pollUSBEvents(usb_future_t **futures, size_t count, uint64_t deadline) {
+	const usb_handle_t *handle = NULL;
+	usb_event_thread_t *events;
+	uint64_t now;
+	size_t i;
+#ifdef ACHILLES_USBFS
+	struct epoll_event event;
+	bool urbOnly = true, urb = false;
+#endif
+
+	for (i = 0; i < count && handle == NULL; i++) {
+		if (futures[i] != NULL) {
+			handle = futures[i]->handle;
+		}
+	}
+	if (handle == NULL) {
+		return;
+	}
+	if (handle->simulated) {
+		pollUSBSimulator(futures, count, deadline);
+		return;
+	}
+#ifdef ACHILLES_USBFS
+	for (i = 0; i < count; i++) {
+		if (futures[i] != NULL) {
+			urbOnly &= futures[i]->urb;
+			urb |= futures[i]->urb;
+		}
+	}
+	if (urb) {
+		reapUSBFSURBs(handle);
+		if (findDoneUSBFuture(futures, count, &i) || (now = getMonotonicTime()) >= deadline) {
+			return;
+		}
+		if (urbOnly) {
+			// epoll_wait() only has millisecond granularity, the caller spins through the last partial millisecond
+			epoll_wait(handle->epollFd, &event, 1, (int)MIN((deadline - now) / 1000000ULL, USB_EVENT_POLL_INTERVAL));
+			reapUSBFSURBs(handle);
+			return;
+		}
+		// Bulk transfers still go through libusb, so keep checking the usbfs node while waiting on the event thread
+		deadline = MIN(deadline, now + 1000000ULL);
+	}
+#endif
+	events = handle->events;
+	processUSBCompletions(events);
+	if (findDoneUSBFuture(futures, count, &i) || (now = getMonotonicTime()) >= deadline) {
+		return;
+	}
+	pthread_mutex_lock(&events->lock);
+	atomic_fetch_add(&events->sleepers, 1);
+	if (atomic_load(&events->completions) == NULL && !findDoneUSBFuture(futures, count, &i)) {
+		waitUSBEventCondition(events, deadline - now);
+	}
+	atomic_fetch_sub(&events->sleepers, 1);
+	pthread_mutex_unlock(&events->lock);
+	processUSBCompletions(events);
+}
+
+usb_future_t *submitUSBControlRequest(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength) {
+	bool out = (bmRequestType & LIBUSB_ENDPOINT_DIR_MASK) == LIBUSB_ENDPOINT_OUT;
+	usb_future_t *future;
+
+#ifdef ACHILLES_USBFS
+	// Requests to an interface need it claimed on the node they are sent on
+	if (handle->fd != -1 && (handle->fdInterface || (bmRequestType & USB_RECIPIENT_MASK) != LIBUSB_RECIPIENT_INTERFACE)) {
+		return submitUSBFSControlRequest(handle, bmRequestType, bRequest, wValue, wIndex, pData, wLength);
+	}
+#endif
+	if ((handle->events == NULL && !handle->simulated) || (future = prepareUSBFuture(handle, true, out, pData, wLength)) == NULL) {
+		return NULL;
+	}
+	future->bmRequestType = bmRequestType;
+	future->bRequest = bRequest;
+	future->wValue = wValue;
+	future->wIndex = wIndex;
+	if (handle->simulated) {
+		future->submitted = getMonotonicTime();
+		if (!replayUSBSimulatorTransfer(future)) {
+			releaseUSBTransferSlot(future->slot);
+			return NULL;
+		}
+		return future;
+	}
+	libusb_fill_control_setup(future->slot->buffer, bmRequestType, bRequest, wValue, wIndex, (uint16_t)wLength);
+	libusb_fill_control_transfer(future->slot->transfer, handle->device, future->slot->buffer, USBAsyncCallback, future, USB_TIMEOUT);
+	future->submitted = getMonotonicTime();
+	if (libusb_submit_transfer(future->slot->transfer) != LIBUSB_SUCCESS) {
+		releaseUSBTransferSlot(future->slot);
+		return NULL;
+	}
+	return future;
+}
+
+usb_future_t *submitUSBBulkUpload(usb_handle_t *handle, void *buffer, size_t length) {
+	usb_future_t *future;
+
+	if (handle->simulated) {
+		if ((future = prepareUSBFuture(handle, false, true, buffer, length)) == NULL) {
+			return NULL;
+		}
+		future->submitted = getMonotonicTime();
+		if (!replayUSBSimulatorTransfer(future)) {
+			releaseUSBTransferSlot(future->slot);
+			return NULL;
+		}
+		return future;
+	}
+	if (handle->events == NULL) {
+		return NULL;
+	}
+#ifdef ACHILLES_USBFS
+	releaseUSBFSInterface(handle);
+#endif
+	// Claiming again is a no-op, the interface is released when the handle is closed
+	if (libusb_claim_interface(handle->device, 0) != LIBUSB_SUCCESS) {
+		LOG(LOG_ERROR, "Failed to claim interface");
+		return NULL;
+	}
+	if ((future = prepareUSBFuture(handle, false, true, buffer, length)) == NULL) {
+		return NULL;
+	}
+	libusb_fill_bulk_transfer(future->slot->transfer, handle->device, USB_BULK_ENDPOINT, buffer, (int)length, USBAsyncCallback, future, USB_BULK_TIMEOUT);
+	future->submitted = getMonotonicTime();
+	if (libusb_submit_transfer(future->slot->transfer) != LIBUSB_SUCCESS) {
+		releaseUSBTransferSlot(future->slot);
+		return NULL;
+	}
+	return future;
+}
+
+void cancelUSBFuture(usb_future_t *future) {
+	future->cancelled = true;
+	if (future->handle->simulated) {
+		cancelUSBSimulatorFuture(future);
+		return;
+	}
+#ifdef ACHILLES_USBFS
+	if (future->urb) {
+		// Fails with EINVAL if the URB has already completed, which is fine
+		ioctl(future->handle->fd, USBDEVFS_DISCARDURB, &future->slot->urb);
+		return;
+	}
+#endif
+	libusb_cancel_transfer(future->slot->transfer);
+}
+
+void closeUSBHandle(usb_handle_t *handle) {
+	atomic_store(&usbFaultDisconnected, false);
+	if (handle->simulated) {
+		destroyUSBTransferPool(handle);
+		closeUSBSimulatorDevice();
+		handle->simulated = false;
+		return;
+	}
+	stopUSBEventThread(handle);
+	destroyUSBTransferPool(handle);
+#ifdef ACHILLES_USBFS
+	closeUSBFSNode(handle);
+#endif
+	libusb_release_interface(handle->device, 0);
+	libusb_close(handle->device);
+	libusb_exit(handle->context);
+	handle->context = NULL;
+}
+
+bool resetUSBHandle(usb_handle_t *handle) {
+	if (atomic_load(&usbFaultDisconnected)) {
+		return false; // Reopen after an injected disconnect, as after a real one
+	}
+	if (handle->simulated) {
+		return resetUSBSimulatorDevice();
+	}
+	// libusb keeps the handle unless the descriptors changed, in which case it reports LIBUSB_ERROR_NOT_FOUND
+	return libusb_reset_device(handle->device) == LIBUSB_SUCCESS;
+}
+
+uint32_t getUSBHostControllerID(const usb_handle_t *handle) {
+	if (handle->simulated) {
+		return getUSBSimulatorBus();
+	}
+	return libusb_get_bus_number(libusb_get_device(handle->device));
+}
+
+bool waitUSBHandleUntil(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg, unsigned timeout, volatile bool *cancel) {
+	uint64_t deadline = getUSBFutureDeadline(timeout);
+
+	if (atomic_load(&usbSimulating)) {
+		// There is no device or event thread, requests are answered from the recording as they are waited on
+		if (!waitUSBSimulatorDevice()) {
+			return false;
+		}
+		handle->simulated = true;
+		createUSBTransferPool(handle);
+		if (usb_check_cb == NULL || usb_check_cb(handle, arg)) {
+			return true;
+		}
+		destroyUSBTransferPool(handle);
+		handle->simulated = false;
+		return false;
+	}
+	if (libusb_init(&handle->context) == LIBUSB_SUCCESS) {
+		for (;;) {
+			if ((handle->device = libusb_open_device_with_vid_pid(handle->context, handle->vid, handle->pid)) != NULL) {
+				LOG(LOG_DEBUG, "Opened device 0x%X, 0x%X", handle->vid, handle->pid);
+				if (libusb_set_configuration(handle->device, 1) == LIBUSB_SUCCESS) {
+#ifdef ACHILLES_USBFS
+					openUSBFSNode(handle);
+#endif
+					// The check callback already sends requests, so everything they need must be ready
+					createUSBTransferPool(handle);
+					startUSBEventThread(handle);
+					if (usb_check_cb == NULL || usb_check_cb(handle, arg)) {
+						return true;
 					}
+					stopUSBEventThread(handle);
+					destroyUSBTransferPool(handle);
+#ifdef ACHILLES_USBFS
+					closeUSBFSNode(handle);
+#endif
 				}
+				libusb_close(handle->device);
 			}
-			free(buf);
+			if (getMonotonicTime() >= deadline || (cancel != NULL && *cancel)) {
+				break;
+			}
+			sleep_ms(USB_TIMEOUT);
 		}
-		libusb_free_transfer(transfer);
+		// The handle was never opened, so closeUSBHandle() will not be called to release the context
+		libusb_exit(handle->context);
 	}
-	return completed != 0;
+	handle->context = NULL;
+	handle->device = NULL;
+	return false;
 }
 
 void initUSBHandle(usb_handle_t *handle, uint16_t vid, uint16_t pid) {
@@ -119,23 +657,13 @@ void initUSBHandle(usb_handle_t *handle, uint16_t vid, uint16_t pid) {
 	handle->pid = pid;
 	handle->device = NULL;
 	handle->context = NULL;
-}
-
-int sendUSBBulkUpload(usb_handle_t *handle, void *buffer, size_t length) {
-	int transferred;
-	int interfaceRet = libusb_claim_interface(handle->device, 0);
-	if (interfaceRet != LIBUSB_SUCCESS) {
-		LOG(LOG_ERROR, "Failed to claim interface");
-		return -1;
-	}
-	int ret = libusb_bulk_transfer(handle->device, 0x2, buffer, length, &transferred, 100);
-	if (ret == LIBUSB_ERROR_PIPE) {
-		LOG(LOG_ERROR, "USB pipe error sending bulk upload");
-	} else if (ret == LIBUSB_ERROR_TIMEOUT) {
-		LOG(LOG_ERROR, "USB timeout sending bulk upload");
-	}
-	libusb_release_interface(handle->device, 0);
-	return transferred;
+	handle->events = NULL;
+	handle->pool = NULL;
+	handle->simulated = false;
+#ifdef ACHILLES_USBFS
+	handle->fd = handle->epollFd = -1;
+	handle->fdInterface = false;
+#endif
 }
 
 #else
@@ -162,7 +690,22 @@ bool queryUSBInterface(io_service_t service, CFUUIDRef plugin_type, CFUUIDRef in
 	return ret;
 }
 
+static void closeUSBInterface(usb_handle_t *handle) {
+	if(handle->interface == NULL) {
+		return;
+	}
+	if(handle->interface_event_source != NULL) {
+		CFRunLoopRemoveSource(CFRunLoopGetCurrent(), handle->interface_event_source, kCFRunLoopDefaultMode);
+		CFRelease(handle->interface_event_source);
+		handle->interface_event_source = NULL;
+	}
+	(*handle->interface)->USBInterfaceClose(handle->interface);
+	(*handle->interface)->Release(handle->interface);
+	handle->interface = NULL;
+}
+
 void closeUSBDevice(usb_handle_t *handle) {
+	closeUSBInterface(handle);
 	CFRunLoopRemoveSource(CFRunLoopGetCurrent(), handle->async_event_source, kCFRunLoopDefaultMode);
 	CFRelease(handle->async_event_source);
 	(*handle->device)->USBDeviceClose(handle->device);
@@ -170,6 +713,8 @@ void closeUSBDevice(usb_handle_t *handle) {
 }
 
 void closeUSBHandle(usb_handle_t *handle) {
+	atomic_store(&usbFaultDisconnected, false);
+	destroyUSBTransferPool(handle);
 	closeUSBDevice(handle);
 }
 
@@ -230,7 +775,23 @@ bool openUSBInterface(uint8_t usb_interface, uint8_t usb_alt_interface, usb_hand
 	return ret;
 }
 
-bool waitUSBHandle(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg) {
+// Purpose: Open the interface the bulk pipe belongs to and deliver its completions through the run loop
+static bool openUSBBulkInterface(usb_handle_t *handle) {
+	if(!openUSBInterface(0, 0, handle)) {
+		handle->interface = NULL;
+		return false;
+	}
+	if((*handle->interface)->CreateInterfaceAsyncEventSource(handle->interface, &handle->interface_event_source) != kIOReturnSuccess) {
+		handle->interface_event_source = NULL;
+		closeUSBInterface(handle);
+		return false;
+	}
+	CFRunLoopAddSource(CFRunLoopGetCurrent(), handle->interface_event_source, kCFRunLoopDefaultMode);
+	return true;
+}
+
+bool waitUSBHandleUntil(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg, unsigned timeout, volatile bool *cancel) {
+	uint64_t deadline = getUSBFutureDeadline(timeout);
 	CFMutableDictionaryRef matching_dict;
 	io_iterator_t iter;
 	io_service_t serv;
@@ -241,112 +802,291 @@ bool waitUSBHandle(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg)
 		if(IOServiceGetMatchingServices(0, matching_dict, &iter) == kIOReturnSuccess) {
 			while((serv = IOIteratorNext(iter)) != IO_OBJECT_NULL) {
 				if(openUSBDevice(serv, handle)) {
+					// The check callback already sends requests through the pool
+					createUSBTransferPool(handle);
 					if(usb_check_cb == NULL || usb_check_cb(handle, arg)) {
 						ret = true;
 						break;
 					}
+					destroyUSBTransferPool(handle);
 					closeUSBDevice(handle);
 				}
 			}
 			IOObjectRelease(iter);
 			IOObjectRelease(serv);
-			if (ret) {
-				break;
-			}
-			sleep_ms(100);
 		}
+		if (ret || getMonotonicTime() >= deadline || (cancel != NULL && *cancel)) {
+			break;
+		}
+		sleep_ms(100);
 	}
 	return ret;
 }
 
-void resetUSBHandle(usb_handle_t *handle) {
+bool resetUSBHandle(usb_handle_t *handle) {
 	(*handle->device)->ResetDevice(handle->device);
 	(*handle->device)->USBDeviceReEnumerate(handle->device, 0);
+	return false; // Re-enumerating always drops the device off the bus
 }
 
-void USBAsyncCallback(void *refcon, IOReturn ret, void *arg) {
-	transfer_ret_t *transfer_ret = refcon;
-	if(transfer_ret != NULL) {
-		memcpy(&transfer_ret->sz, &arg, sizeof(transfer_ret->sz));
-		if(ret == kIOReturnSuccess) {
-			transfer_ret->ret = USB_TRANSFER_OK;
-		} else if(ret == kIOUSBPipeStalled) {
-			transfer_ret->ret = USB_TRANSFER_STALL;
-		} else {
-			transfer_ret->ret = USB_TRANSFER_ERROR;
-		}
-	}
-	CFRunLoopStop(CFRunLoopGetCurrent());
+uint32_t getUSBHostControllerID(const usb_handle_t *handle) {
+	UInt32 locationID = 0;
+	(*handle->device)->GetLocationID(handle->device, &locationID);
+	return locationID >> 24; // The top byte identifies the bus
 }
 
-bool sendUSBControlRequest(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength, transfer_ret_t *transferRet) {
-	IOUSBDevRequestTO req;
-	IOReturn ret;
-
-	// LOG(LOG_DEBUG, "bmRequestType = 0x%02x, bRequest = 0x%02x, wValue = 0x%04x, wIndex = 0x%04x, wLength = %d, pData = %p", bmRequestType, bRequest, wValue, wIndex, wLength, pData);
+// Runs on the run loop of the thread that opened the handle, from inside pollUSBEvents()
+static void USBAsyncCallback(void *refcon, IOReturn ret, void *arg) {
+	usb_future_t *future = refcon;
+	future->ret.sz = (uint32_t)(uintptr_t)arg;
+	if(ret == kIOReturnSuccess) {
+		future->ret.ret = USB_TRANSFER_OK;
+	} else if(ret == kIOUSBPipeStalled) {
+		future->ret.ret = USB_TRANSFER_STALL;
+	} else {
+		future->ret.ret = USB_TRANSFER_ERROR;
+	}
+	future->completed = getMonotonicTime();
+	atomic_store(&future->done, true);
+}
 
-	req.wLenDone = 0;
-	req.pData = pData;
-	req.bRequest = bRequest;
-	req.bmRequestType = bmRequestType;
-	req.wLength = OSSwapLittleToHostInt16(wLength);
-	req.wValue = OSSwapLittleToHostInt16(wValue);
-	req.wIndex = OSSwapLittleToHostInt16(wIndex);
-	req.completionTimeout = req.noDataTimeout = USB_TIMEOUT;
+// Purpose: Run the run loop until one of the futures is done or the deadline passes
+static void pollUSBEvents(usb_future_t **futures, size_t count, uint64_t deadline) {
+	uint64_t now;
+	size_t index;
 
-	ret = (*handle->device)->DeviceRequestTO(handle->device, &req);
-	if(transferRet != NULL) {
-		if(ret == kIOReturnSuccess) {
-			transferRet->sz = req.wLenDone;
-			transferRet->ret = USB_TRANSFER_OK;
-		} else if(ret == kIOUSBPipeStalled) {
-			transferRet->ret = USB_TRANSFER_STALL;
-		} else {
-			transferRet->ret = USB_TRANSFER_ERROR;
-		}
+	// Deliver whatever is already pending, then sleep until the next source fires
+	CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0, true);
+	if(!findDoneUSBFuture(futures, count, &index) && (now = getMonotonicTime()) < deadline) {
+		CFRunLoopRunInMode(kCFRunLoopDefaultMode, MIN(deadline - now, USB_EVENT_POLL_INTERVAL * 1000000ULL) / 1e9, true);
 	}
-	return true;
 }
 
-bool sendUSBControlRequestAsync(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength, unsigned usbAbortTimeout, transfer_ret_t *transferRet) {
-	IOUSBDevRequestTO req;
+usb_future_t *submitUSBControlRequest(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength) {
+	usb_future_t *future;
+	IOUSBDevRequestTO *req;
 
 	// LOG(LOG_DEBUG, "bmRequestType = 0x%02x, bRequest = 0x%02x, wValue = 0x%04x, wIndex = 0x%04x, wLength = %d, pData = %p", bmRequestType, bRequest, wValue, wIndex, wLength, pData);
 
-	req.wLenDone = 0;
-	req.pData = pData;
-	req.bRequest = bRequest;
-	req.bmRequestType = bmRequestType;
-	req.wLength = OSSwapLittleToHostInt16(wLength);
-	req.wValue = OSSwapLittleToHostInt16(wValue);
-	req.wIndex = OSSwapLittleToHostInt16(wIndex);
-	req.completionTimeout = req.noDataTimeout = USB_TIMEOUT;
-	if((*handle->device)->DeviceRequestAsyncTO(handle->device, &req, USBAsyncCallback, transferRet) == kIOReturnSuccess) {
-		sleep_ms(usbAbortTimeout);
-		if((*handle->device)->USBDeviceAbortPipeZero(handle->device) == kIOReturnSuccess) {
-			CFRunLoopRun();
-			return true;
-		}
+	if((future = prepareUSBFuture(handle, true, (bmRequestType & 0x80) == 0, pData, wLength)) == NULL) {
+		return NULL;
 	}
-	return false;
+	future->bmRequestType = bmRequestType;
+	future->bRequest = bRequest;
+	future->wValue = wValue;
+	future->wIndex = wIndex;
+	// The request has to outlive this call, so it lives in the slot
+	req = &future->slot->req;
+	req->wLenDone = 0;
+	req->pData = wLength != 0 ? future->slot->buffer : NULL;
+	req->bRequest = bRequest;
+	req->bmRequestType = bmRequestType;
+	req->wLength = OSSwapLittleToHostInt16(wLength);
+	req->wValue = OSSwapLittleToHostInt16(wValue);
+	req->wIndex = OSSwapLittleToHostInt16(wIndex);
+	req->completionTimeout = req->noDataTimeout = USB_TIMEOUT;
+	future->submitted = getMonotonicTime();
+	if((*handle->device)->DeviceRequestAsyncTO(handle->device, req, USBAsyncCallback, future) != kIOReturnSuccess) {
+		releaseUSBTransferSlot(future->slot);
+		return NULL;
+	}
+	return future;
 }
 
-int sendUSBBulkUpload(usb_handle_t *handle, void *buffer, size_t length) {
-	openUSBInterface(0, 0, handle);
-	return (*handle->interface)->WritePipe((handle->interface), 2, buffer, length);
+usb_future_t *submitUSBBulkUpload(usb_handle_t *handle, void *buffer, size_t length) {
+	usb_future_t *future;
+
+	if((handle->interface == NULL && !openUSBBulkInterface(handle)) || (future = prepareUSBFuture(handle, false, true, buffer, length)) == NULL) {
+		return NULL;
+	}
+	future->submitted = getMonotonicTime();
+	if((*handle->interface)->WritePipeAsync(handle->interface, USB_BULK_ENDPOINT, buffer, (UInt32)length, USBAsyncCallback, future) != kIOReturnSuccess) {
+		releaseUSBTransferSlot(future->slot);
+		return NULL;
+	}
+	return future;
 }
 
+void cancelUSBFuture(usb_future_t *future) {
+	future->cancelled = true;
+	if(future->control) {
+		(*future->handle->device)->USBDeviceAbortPipeZero(future->handle->device);
+	} else {
+		(*future->handle->interface)->AbortPipe(future->handle->interface, USB_BULK_ENDPOINT);
+	}
+}
 
 void initUSBHandle(usb_handle_t *handle, uint16_t vid, uint16_t pid) {
 	handle->vid = vid;
 	handle->pid = pid;
 	handle->device = NULL;
+	handle->interface = NULL;
+	handle->interface_event_source = NULL;
+	handle->pool = NULL;
 }
 
 #endif
 
+// Purpose: Wait until one of the futures is done or the monotonic deadline passes, without releasing it
+static bool waitUSBFuturesUntil(usb_future_t **futures, size_t count, uint64_t deadline, size_t *index) {
+	for (;;) {
+		// Wake up in time for completions held back by injected latency
+		pollUSBEvents(futures, count, atomic_load_explicit(&usbFaulting, memory_order_relaxed) ? getUSBFaultDeadline(futures, count, deadline) : deadline);
+		if (findDoneUSBFuture(futures, count, index)) {
+			return true;
+		}
+		if (getMonotonicTime() >= deadline) {
+			return false;
+		}
+	}
+}
+
+static bool waitUSBFutureUntil(usb_future_t *future, uint64_t deadline) {
+	size_t index;
+	return waitUSBFuturesUntil(&future, 1, deadline, &index);
+}
+
+// Purpose: Hand the results of a done future to the caller and return its slot to the pool
+static void finishUSBFuture(usb_future_t *future, transfer_ret_t *transferRet) {
+	usb_transfer_slot_t *slot = future->slot;
+	if (future->control) {
+		atomic_fetch_add_explicit(&usbControlTransfers, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&usbControlBytes, future->ret.sz, memory_order_relaxed);
+	} else {
+		atomic_fetch_add_explicit(&usbBulkBytes, future->ret.sz, memory_order_relaxed);
+	}
+	recordUSBTransfer(future);
+	if (atomic_load_explicit(&usbTracing, memory_order_relaxed)) {
+		// Bulk uploads are sent straight from the caller's buffer
+		traceUSBTransfer(future, future->control ? slot->buffer + USB_TRANSFER_POOL_DATA_OFFSET : future->pData);
+	}
+	if (future->control && !future->out && future->ret.sz > 0) {
+		slot->dirty = true;
+		if (future->pData != NULL) {
+			memcpy(future->pData, slot->buffer + USB_TRANSFER_POOL_DATA_OFFSET, future->ret.sz);
+		}
+	}
+	if (transferRet != NULL) {
+		transferRet->ret = future->ret.ret;
+		transferRet->sz = future->ret.sz;
+	}
+	releaseUSBTransferSlot(slot);
+}
 
-char *getCPIDFromSerialNumber(char *serial) {
+size_t submitUSBControlRequests(const usb_handle_t *handle, const usb_control_request_t *requests, size_t count, usb_future_t **futures) {
+	size_t i;
+	for (i = 0; i < count; i++) {
+		if ((futures[i] = submitUSBControlRequest(handle, requests[i].bmRequestType, requests[i].bRequest, requests[i].wValue, requests[i].wIndex, requests[i].pData, requests[i].wLength)) == NULL) {
+			break;
+		}
+	}
+	return i;
+}
+
+bool waitUSBFuture(usb_future_t *future, unsigned timeout, transfer_ret_t *transferRet) {
+	if (!waitUSBFutureUntil(future, getUSBFutureDeadline(timeout))) {
+		return false;
+	}
+	finishUSBFuture(future, transferRet);
+	return true;
+}
+
+bool waitAnyUSBFuture(usb_future_t **futures, size_t count, unsigned timeout, size_t *index, transfer_ret_t *transferRet) {
+	size_t i;
+	for (i = 0; i < count && futures[i] == NULL; i++);
+	if (i == count || !waitUSBFuturesUntil(futures, count, getUSBFutureDeadline(timeout), index)) {
+		return false;
+	}
+	finishUSBFuture(futures[*index], transferRet);
+	futures[*index] = NULL;
+	return true;
+}
+
+// Purpose: Wait for a future for up to timeout milliseconds, cancelling it if it is still in flight by then
+static bool waitUSBFutureOrCancel(usb_future_t *future, unsigned timeout, transfer_ret_t *transferRet) {
+	if(waitUSBFuture(future, timeout, transferRet)) {
+		return true;
+	}
+	cancelUSBFuture(future);
+	// A cancelled request completes promptly, but give up after another timeout
+	// rather than hang if the device went away with the request in flight
+	if(!waitUSBFuture(future, timeout, transferRet)) {
+		LOG(LOG_ERROR, "USB request did not complete after being cancelled");
+		if(transferRet != NULL) {
+			transferRet->ret = USB_TRANSFER_ERROR;
+			transferRet->sz = 0;
+		}
+		return false;
+	}
+	return true;
+}
+
+bool sendUSBControlRequest(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength, transfer_ret_t *transferRet) {
+	usb_future_t *future;
+
+	if((future = submitUSBControlRequest(handle, bmRequestType, bRequest, wValue, wIndex, pData, wLength)) == NULL) {
+		if(transferRet != NULL) {
+			transferRet->ret = USB_TRANSFER_ERROR;
+			transferRet->sz = 0;
+		}
+		return false;
+	}
+	// usbfs URBs have no timeout of their own, so enforce USB_TIMEOUT here for every backend
+	waitUSBFutureOrCancel(future, USB_TIMEOUT, transferRet);
+	return true;
+}
+
+bool sendUSBControlRequestAsync(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, void *pData, size_t wLength, unsigned usbAbortDelay, transfer_ret_t *transferRet) {
+	usb_future_t *future;
+	uint64_t abortAt, now;
+	bool completed;
+
+	if(transferRet != NULL) {
+		transferRet->abortDelay = 0;
+	}
+	if((future = submitUSBControlRequest(handle, bmRequestType, bRequest, wValue, wIndex, pData, wLength)) == NULL) {
+		return false;
+	}
+	abortAt = future->submitted + usbAbortDelay * 1000ULL;
+
+	// Collect early completions until just before the abort,
+	// then hand over to the precise sleep for the final stretch
+	completed = waitUSBFutureUntil(future, abortAt - MIN(usbAbortDelay, USB_ABORT_SLACK) * 1000ULL);
+	if(!completed) {
+		now = sleepUntil(abortAt, usbAbortSpin * 1000ULL);
+		cancelUSBFuture(future);
+		if(transferRet != NULL) {
+			transferRet->abortDelay = now - future->submitted;
+		}
+		// A cancelled request always completes
+		completed = waitUSBFutureUntil(future, UINT64_MAX);
+	}
+	finishUSBFuture(future, transferRet);
+	return completed;
+}
+
+int sendUSBBulkUpload(usb_handle_t *handle, void *buffer, size_t length, unsigned timeout) {
+	transfer_ret_t transferRet;
+	usb_future_t *future;
+
+	if((future = submitUSBBulkUpload(handle, buffer, length)) == NULL) {
+		return -1;
+	}
+	waitUSBFutureOrCancel(future, timeout, &transferRet);
+	if(transferRet.ret == USB_TRANSFER_STALL) {
+		LOG(LOG_ERROR, "USB pipe error sending bulk upload");
+	} else if(transferRet.ret == USB_TRANSFER_ERROR) {
+		LOG(LOG_ERROR, "USB error sending bulk upload");
+	}
+	return (int)transferRet.sz;
+}
+
+
+bool waitUSBHandle(usb_handle_t *handle, usb_check_cb_t usb_check_cb, void *arg) {
+	return waitUSBHandleUntil(handle, usb_check_cb, arg, USB_FUTURE_WAIT_FOREVER, NULL);
+}
+
+char *getCPIDFromSerialNumber(const char *serial) {
 	if (strstr(serial, "CPID:") != NULL) {
 		char *cpid = strdup(strstr(serial, "CPID:") + 5);
 		cpid[4] = '\0';
@@ -355,7 +1095,7 @@ char *getCPIDFromSerialNumber(char *serial) {
 	return NULL;
 }
 
-char *getBDIDFromSerialNumer(char *serial) {
+char *getBDIDFromSerialNumer(const char *serial) {
 	if (strstr(serial, "BDID:") != NULL) {
 		char *bdid = strdup(strstr(serial, "BDID:") + 3);
 		bdid[4] = '\0';
@@ -370,6 +1110,12 @@ uint64_t tlbi, nop_gadget, ret_gadget, patch_addr, ttbr0_addr, func_gadget, writ
 
 bool checkm8CheckUSBDevice(usb_handle_t *handle, bool *pwned) {
 	char *usbSerialNumber = getDeviceSerialNumber(handle);
+	bool ret = checkm8CheckSerialNumber(handle, usbSerialNumber, pwned);
+	free(usbSerialNumber);
+	return ret;
+}
+
+bool checkm8CheckSerialNumber(const usb_handle_t *handle, const char *usbSerialNumber, bool *pwned) {
 	bool ret = false;
 
 	if(usbSerialNumber != NULL) {
@@ -379,6 +1125,7 @@ bool checkm8CheckUSBDevice(usb_handle_t *handle, bool *pwned) {
 			return false;
 		}
 		int cpidNum = (int)strtol(stringCPID, NULL, 16);
+		free(stringCPID);
 		cpid = (uint16_t)cpidNum;
 		char *stringBDID = getBDIDFromSerialNumer(usbSerialNumber);
 		if (stringBDID == NULL) {
@@ -386,7 +1133,9 @@ bool checkm8CheckUSBDevice(usb_handle_t *handle, bool *pwned) {
 			return false;
 		}
 		int bdidNum = (int)strtol(stringBDID, NULL, 16);
+		free(stringBDID);
 		bdid = (uint16_t)bdidNum;
+		config_hole = config_large_leak = 0; // Only set for the SoCs that use them, so clear what an earlier device set
 		if (strstr(usbSerialNumber, " SRTG:[iBoot-1704.10]") != NULL) { // A7
 			cpid = 0x8960;
 			config_large_leak = 7936;
@@ -597,29 +1346,11 @@ bool checkm8CheckUSBDevice(usb_handle_t *handle, bool *pwned) {
 }
 
 bool sendUSBControlRequestNoData(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, size_t wLength, transfer_ret_t *transferRet) {
-	bool ret = false;
-	void *pData;
-
-	if(wLength == 0) {
-		ret = sendUSBControlRequest(handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, transferRet);
-	} else if((pData = malloc(wLength)) != NULL) {
-		memset(pData, '\0', wLength);
-		ret = sendUSBControlRequest(handle, bmRequestType, bRequest, wValue, wIndex, pData, wLength, transferRet);
-		free(pData);
-	}
-	return ret;
+	// The request's own pool buffer sends zeroes for OUT data, and IN data is left in it rather than copied out
+	return sendUSBControlRequest(handle, bmRequestType, bRequest, wValue, wIndex, NULL, wLength, transferRet);
 }
 
-bool sendUSBControlRequestAsyncNoData(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, size_t wLength, unsigned USBAbortTimeout, transfer_ret_t *transferRet) {
-	bool ret = false;
-	void *pData;
-
-	if(wLength == 0) {
-		ret = sendUSBControlRequestAsync(handle, bmRequestType, bRequest, wValue, wIndex, NULL, 0, USBAbortTimeout, transferRet);
-	} else if((pData = malloc(wLength)) != NULL) {
-		memset(pData, '\0', wLength);
-		ret = sendUSBControlRequestAsync(handle, bmRequestType, bRequest, wValue, wIndex, pData, wLength, USBAbortTimeout, transferRet);
-		free(pData);
-	}
-	return ret;
+bool sendUSBControlRequestAsyncNoData(const usb_handle_t *handle, uint8_t bmRequestType, uint8_t bRequest, uint16_t wValue, uint16_t wIndex, size_t wLength, unsigned usbAbortDelay, transfer_ret_t *transferRet) {
+	// The async path sends zeroes from its own pool buffer when there is no data
+	return sendUSBControlRequestAsync(handle, bmRequestType, bRequest, wValue, wIndex, NULL, wLength, usbAbortDelay, transferRet);
 }
\ No newline at end of file
@@ -1,16 +1,24 @@
 #include <utils/log.h>
 
-void step(int time, bool endWithNewline, char *text) {
+bool step(int time, bool endWithNewline, char *text, volatile bool *stop) {
 	for (int i = 0; i <= time; i++) {
 		printf(BCYN "\r\033[K%s (%d)" CRESET, text, time - i);
 		fflush(stdout);
-		sleep(1);
+		// Tick in 10ms slices so we can stop as soon as we are told to
+		for (int j = 0; j < 100; j++) {
+			if (stop != NULL && *stop) {
+				printf(CRESET "\n");
+				return false;
+			}
+			usleep(10000);
+		}
 	}
 	if (endWithNewline) {
 		printf(CYN "\r%s (%d)\n" CRESET, text, 0);
 	} else {
 		printf(CYN "\r%s (%d)" CRESET, text, 0);
 	}
+	return true;
 }
 
 int AchillesLog(log_level_t loglevel, bool newline, const char *fname, int lineno, const char *fxname, const char *__restrict format, ...)
@@ -0,0 +1,8 @@
+#include <utils/random.h>
+
+uint64_t getRandom(uint64_t *state) {
+	*state ^= *state >> 12;
+	*state ^= *state << 25;
+	*state ^= *state >> 27;
+	return *state * 0x2545F4914F6CDD1DULL;
+}
@@ -0,0 +1,161 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE // CPU affinity and sched_setaffinity() on Linux
+#endif
+#include <utils/realtime.h>
+
+// Purpose: Touch the stack so that later deep calls do not page-fault while memory is locked
+static void __attribute__((noinline)) prefaultStack(void) {
+	volatile char stack[REALTIME_STACK_PREFAULT];
+	for (size_t i = 0; i < sizeof(stack); i += 0x1000) {
+		stack[i] = 0;
+	}
+}
+
+#ifdef __APPLE__
+
+bool enterRealtimeMode(realtime_state_t *state) {
+	thread_port_t thread = pthread_mach_thread_np(pthread_self());
+	thread_affinity_policy_data_t affinity = { 1 };
+	thread_time_constraint_policy_data_t constraint;
+	mach_timebase_info_data_t timebase;
+	double ticksPerMillisecond;
+
+	memset(state, 0, sizeof(realtime_state_t));
+	state->active = true;
+
+	// macOS has no hard pinning, an affinity tag only keeps the thread off cores shared with other tags
+	state->pinned = thread_policy_set(thread, THREAD_AFFINITY_POLICY, (thread_policy_t)&affinity, THREAD_AFFINITY_POLICY_COUNT) == KERN_SUCCESS;
+	if (!state->pinned) {
+		LOG(LOG_DEBUG, "Thread affinity is not supported on this machine");
+	}
+
+	// Ask for up to 5ms of uninterrupted computation in every 10ms, which covers one race attempt
+	mach_timebase_info(&timebase);
+	ticksPerMillisecond = 1e6 * timebase.denom / timebase.numer;
+	constraint.period = (uint32_t)(10 * ticksPerMillisecond);
+	constraint.computation = (uint32_t)(5 * ticksPerMillisecond);
+	constraint.constraint = (uint32_t)(10 * ticksPerMillisecond);
+	constraint.preemptible = false;
+	state->scheduled = thread_policy_set(thread, THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t)&constraint, THREAD_TIME_CONSTRAINT_POLICY_COUNT) == KERN_SUCCESS;
+	if (!state->scheduled) {
+		LOG(LOG_DEBUG, "Failed to set time constraint policy, raising priority instead");
+		state->oldNice = getpriority(PRIO_PROCESS, 0);
+		setpriority(PRIO_PROCESS, 0, -20);
+	}
+
+	// Only lock what is mapped now, locking future mappings makes allocations fail once RLIMIT_MEMLOCK is hit
+	prefaultStack();
+	state->locked = mlockall(MCL_CURRENT) == 0;
+	if (!state->locked) {
+		LOG(LOG_DEBUG, "Failed to lock memory: %s", strerror(errno));
+	}
+	return state->scheduled;
+}
+
+void exitRealtimeMode(realtime_state_t *state) {
+	thread_port_t thread = pthread_mach_thread_np(pthread_self());
+	thread_standard_policy_data_t standard = { 0 };
+
+	if (!state->active) {
+		return;
+	}
+	if (state->scheduled) {
+		thread_policy_set(thread, THREAD_STANDARD_POLICY, (thread_policy_t)&standard, THREAD_STANDARD_POLICY_COUNT);
+	} else {
+		setpriority(PRIO_PROCESS, 0, state->oldNice);
+	}
+	if (state->locked) {
+		munlockall();
+	}
+	state->active = false;
+}
+
+#else
+
+// Purpose: Pick the core to pin to, preferring one isolated from the scheduler with isolcpus=
+static int getRealtimeCPU(const cpu_set_t *allowed) {
+	FILE *isolated;
+	int cpu = -1, first, last, i;
+
+	if ((isolated = fopen("/sys/devices/system/cpu/isolated", "r")) != NULL) {
+		// The list looks like "2-3,6", take the first isolated core we are allowed to run on
+		while (cpu == -1 && fscanf(isolated, "%d", &first) == 1) {
+			last = first;
+			if (fscanf(isolated, "-%d", &last) != 1) {
+				last = first;
+			}
+			for (i = first; i <= last && i < CPU_SETSIZE; i++) {
+				if (CPU_ISSET(i, allowed)) {
+					cpu = i;
+					break;
+				}
+			}
+			fscanf(isolated, ",");
+		}
+		fclose(isolated);
+	}
+	// Otherwise use the last core, which is the one least likely to be handling interrupts
+	for (i = CPU_SETSIZE - 1; cpu == -1 && i >= 0; i--) {
+		if (CPU_ISSET(i, allowed)) {
+			cpu = i;
+		}
+	}
+	return cpu;
+}
+
+bool enterRealtimeMode(realtime_state_t *state) {
+	struct sched_param param;
+	cpu_set_t affinity;
+	int cpu;
+
+	memset(state, 0, sizeof(realtime_state_t));
+	state->active = true;
+
+	if (sched_getaffinity(0, sizeof(cpu_set_t), &state->oldAffinity) == 0 && (cpu = getRealtimeCPU(&state->oldAffinity)) != -1) {
+		CPU_ZERO(&affinity);
+		CPU_SET(cpu, &affinity);
+		state->pinned = sched_setaffinity(0, sizeof(cpu_set_t), &affinity) == 0;
+		if (state->pinned) {
+			LOG(LOG_DEBUG, "Pinned exploit thread to CPU %d", cpu);
+		}
+	}
+
+	state->oldPolicy = sched_getscheduler(0);
+	sched_getparam(0, &state->oldParam);
+	// Stay one below the maximum so that kernel threads such as the USB interrupt handlers can still run
+	param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+	state->scheduled = sched_setscheduler(0, SCHED_FIFO, &param) == 0;
+	if (!state->scheduled) {
+		LOG(LOG_DEBUG, "Failed to enable SCHED_FIFO (%s), raising priority instead", strerror(errno));
+		state->oldNice = getpriority(PRIO_PROCESS, 0);
+		setpriority(PRIO_PROCESS, 0, -20);
+	}
+
+	// Only lock what is mapped now, locking future mappings makes allocations fail once RLIMIT_MEMLOCK is hit
+	prefaultStack();
+	state->locked = mlockall(MCL_CURRENT) == 0;
+	if (!state->locked) {
+		LOG(LOG_DEBUG, "Failed to lock memory: %s", strerror(errno));
+	}
+	return state->scheduled;
+}
+
+void exitRealtimeMode(realtime_state_t *state) {
+	if (!state->active) {
+		return;
+	}
+	if (state->locked) {
+		munlockall();
+	}
+	if (state->scheduled) {
+		sched_setscheduler(0, state->oldPolicy, &state->oldParam);
+	} else {
+		setpriority(PRIO_PROCESS, 0, state->oldNice);
+	}
+	if (state->pinned) {
+		sched_setaffinity(0, sizeof(cpu_set_t), &state->oldAffinity);
+	}
+	state->active = false;
+}
+
+#endif
@@ -0,0 +1,119 @@
+#include <utils/timeline.h>
+#include <usb/usb.h>
+
+static timeline_span_t timelineSpans[TIMELINE_MAX_SPANS];
+static size_t timelineSpanCount, timelineDropped;
+
+int beginTimelineSpan(const char *category, const char *format, ...) {
+	timeline_span_t *span;
+	va_list args;
+
+	if (timelineSpanCount == TIMELINE_MAX_SPANS) {
+		timelineDropped++;
+		return -1;
+	}
+	span = &timelineSpans[timelineSpanCount];
+	va_start(args, format);
+	vsnprintf(span->name, sizeof(span->name), format, args);
+	va_end(args);
+	span->category = category;
+	span->controlTransfers = usbControlTransfers;
+	span->controlBytes = usbControlBytes;
+	span->bulkBytes = usbBulkBytes;
+	span->recorded = usbRecordedTime;
+	span->replayed = usbReplayedTime;
+	span->end = 0;
+	span->start = getMonotonicTime();
+	return (int)timelineSpanCount++;
+}
+
+void endTimelineSpan(int span) {
+	timeline_span_t *entry;
+	if (span < 0 || span >= timelineSpanCount) {
+		return;
+	}
+	entry = &timelineSpans[span];
+	entry->end = getMonotonicTime();
+	entry->controlTransfers = usbControlTransfers - entry->controlTransfers;
+	entry->controlBytes = usbControlBytes - entry->controlBytes;
+	entry->bulkBytes = usbBulkBytes - entry->bulkBytes;
+	entry->recorded = usbRecordedTime - entry->recorded;
+	entry->replayed = usbReplayedTime - entry->replayed;
+}
+
+size_t getTimelineSpans(const timeline_span_t **spans) {
+	*spans = timelineSpans;
+	return timelineSpanCount;
+}
+
+void resetTimeline(void) {
+	timelineSpanCount = timelineDropped = 0;
+}
+
+// Purpose: Write a string as a JSON string literal
+static void writeTimelineString(FILE *file, const char *str) {
+	fputc('"', file);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\') {
+			fprintf(file, "\\%c", *str);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(file, "\\u%04x", (unsigned char)*str);
+		} else {
+			fputc(*str, file);
+		}
+	}
+	fputc('"', file);
+}
+
+bool writeTimeline(const char *path) {
+	uint64_t origin = timelineSpanCount != 0 ? timelineSpans[0].start : 0, end;
+	timeline_span_t *span;
+	FILE *file;
+	size_t i;
+
+	if ((file = fopen(path, "w")) == NULL) {
+		LOG(LOG_ERROR, "Failed to open %s for writing", path);
+		return false;
+	}
+	fprintf(file, "{\"displayTimeUnit\":\"ms\",\"otherData\":{\"cpid\":\"0x%04X\",\"dropped_spans\":%zu},\"traceEvents\":[", cpid, timelineDropped);
+	for (i = 0; i < timelineSpanCount; i++) {
+		span = &timelineSpans[i];
+		// Spans still open when the timeline is written, e.g. after an early return, end now
+		end = span->end != 0 ? span->end : getMonotonicTime();
+		fprintf(file, "%s\n{\"name\":", i == 0 ? "" : ",");
+		writeTimelineString(file, span->name);
+		fprintf(file, ",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":%.3f,\"dur\":%.3f", span->category, (span->start - origin) / 1e3, (end - span->start) / 1e3);
+		if (span->end != 0) {
+			fprintf(file, ",\"args\":{\"control_transfers\":%llu,\"control_bytes\":%llu,\"bulk_bytes\":%llu,\"recorded_us\":%.3f,\"replayed_us\":%.3f}",
+				(unsigned long long)span->controlTransfers, (unsigned long long)span->controlBytes, (unsigned long long)span->bulkBytes, span->recorded / 1e3, span->replayed / 1e3);
+		}
+		fputc('}', file);
+	}
+	fputs("\n]}\n", file);
+	if (fclose(file) != 0) {
+		LOG(LOG_ERROR, "Failed to write timeline to %s", path);
+		return false;
+	}
+	LOG(LOG_VERBOSE, "Wrote %zu timeline spans to %s", timelineSpanCount, path);
+	return true;
+}
+
+void printTimeline(void) {
+	timeline_span_t *span;
+	double duration;
+	size_t i;
+
+	for (i = 0; i < timelineSpanCount; i++) {
+		span = &timelineSpans[i];
+		if (span->end == 0) {
+			continue;
+		}
+		duration = (span->end - span->start) / 1e6;
+		if (usbRecordedTime != 0) {
+			LOG(LOG_INFO, "%s: %.3fms, transfers and the gaps before them took %.3fms against %.3fms in the recording, %+.3fms host overhead",
+				span->name, duration, span->replayed / 1e6, span->recorded / 1e6, ((double)span->replayed - span->recorded) / 1e6);
+		} else {
+			LOG(LOG_INFO, "%s: %.3fms", span->name, duration);
+		}
+	}
+}
@@ -0,0 +1,30 @@
+#include <utils/timer.h>
+
+uint64_t getMonotonicTime(void) {
+#ifdef __APPLE__
+	// CLOCK_MONOTONIC only has microsecond resolution on macOS
+	return clock_gettime_nsec_np(CLOCK_UPTIME_RAW);
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+uint64_t sleepUntil(uint64_t deadline, uint64_t spin) {
+	struct timespec ts;
+	uint64_t now = getMonotonicTime(), remaining;
+
+	// nanosleep() can wake up early on a signal, so keep going until we reach the spin window
+	while (now + spin < deadline) {
+		remaining = deadline - spin - now;
+		ts.tv_sec = remaining / 1000000000ULL;
+		ts.tv_nsec = remaining % 1000000000ULL;
+		nanosleep(&ts, NULL);
+		now = getMonotonicTime();
+	}
+	while (now < deadline) {
+		now = getMonotonicTime();
+	}
+	return now;
+}
@@ -0,0 +1,441 @@
+#include <Achilles.h>
+#include <utils/log.h>
+#include <utils/timer.h>
+#include <utils/timeline.h>
+#include <usb/simulator.h>
+#include <usb/faults.h>
+#include <exploit/exploit.h>
+#include <exploit/abort-model.h>
+#include <boot/lz4/lz4hc.h>
+#include <fcntl.h>
+#include <ctype.h>
+#ifdef __APPLE__
+#include <malloc/malloc.h>
+#endif
+#include "profiles.h"
+
+#define BENCH_TIME 1000000000ULL // Nanoseconds each benchmark runs for, at least
+#define BENCH_MAX_ITERATIONS 1000000000
+#define BENCH_RUNS 20 // Runs of the end-to-end benchmark, unless -n is passed
+#define BENCH_LATENCY 125 // Microseconds every simulated transfer takes, one high-speed microframe
+#define BENCH_MAX_METRICS 64
+
+// Defined by the generated headers pongo.c includes, which can only be included once
+extern unsigned char build_Pongo_bin[], Pongo_palera1n_bin[];
+extern unsigned int build_Pongo_bin_len, Pongo_palera1n_bin_len;
+
+typedef void (*bench_function_t)(void *context, size_t iterations);
+
+typedef struct {
+    const char *source;
+    int sourceSize;
+    char *destination;
+    int level;
+} bench_lz4_t;
+
+typedef struct {
+    char name[TIMELINE_NAME_SIZE];
+    uint64_t *samples; // One per run that got there, in nanoseconds
+    size_t count; // Samples taken, runs that didn't get there have none
+    size_t lastRun; // The run the last sample came from, so a stage that ran twice adds to it
+} bench_metric_t;
+
+static FILE *benchOutput; // A copy of stdout, which still works while stdout goes to /dev/null
+static bool benchCounting;
+static uint64_t benchAllocations, benchAllocatedBytes;
+static int benchNull = -1, benchStdout = -1;
+
+// Count the allocations made while a benchmark runs, passing them on to the system allocator
+#ifdef __APPLE__
+void *malloc(size_t size) {
+    if (benchCounting) { benchAllocations++; benchAllocatedBytes += size; }
+    return malloc_zone_malloc(malloc_default_zone(), size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (benchCounting) { benchAllocations++; benchAllocatedBytes += count * size; }
+    return malloc_zone_calloc(malloc_default_zone(), count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    if (benchCounting) { benchAllocations++; benchAllocatedBytes += size; }
+    return malloc_zone_realloc(malloc_default_zone(), pointer, size);
+}
+#else
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t count, size_t size);
+extern void *__libc_realloc(void *pointer, size_t size);
+
+void *malloc(size_t size) {
+    if (benchCounting) { benchAllocations++; benchAllocatedBytes += size; }
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t count, size_t size) {
+    if (benchCounting) { benchAllocations++; benchAllocatedBytes += count * size; }
+    return __libc_calloc(count, size);
+}
+
+void *realloc(void *pointer, size_t size) {
+    if (benchCounting) { benchAllocations++; benchAllocatedBytes += size; }
+    return __libc_realloc(pointer, size);
+}
+#endif
+
+// Purpose: Send stdout to /dev/null, so the cost of the terminal isn't measured and the results stay readable
+static bool silenceStdout(void) {
+    fflush(stdout);
+    if ((benchNull = open("/dev/null", O_WRONLY)) == -1 || (benchStdout = dup(STDOUT_FILENO)) == -1 || dup2(benchNull, STDOUT_FILENO) == -1) {
+        LOG(LOG_ERROR, "Failed to send the log to /dev/null");
+        return false;
+    }
+    return true;
+}
+
+// Purpose: Undo silenceStdout()
+static void restoreStdout(void) {
+    fflush(stdout);
+    dup2(benchStdout, STDOUT_FILENO);
+    close(benchNull);
+    close(benchStdout);
+    benchNull = benchStdout = -1;
+}
+
+// Purpose: Run a benchmark for long enough to time it, and print it in the format of Go's benchmarks so benchstat can compare runs
+static void runBenchmark(const char *name, bench_function_t function, void *context, size_t bytes) {
+    size_t iterations = 1, next;
+    uint64_t elapsed;
+
+    for (;;) {
+        benchAllocations = benchAllocatedBytes = 0;
+        benchCounting = true;
+        elapsed = getMonotonicTime();
+        function(context, iterations);
+        elapsed = getMonotonicTime() - elapsed;
+        benchCounting = false;
+        if (elapsed >= BENCH_TIME || iterations >= BENCH_MAX_ITERATIONS) {
+            break;
+        }
+        // Aim a little past the target, growing by at most 100x so one slow run can't overshoot
+        next = elapsed != 0 ? (size_t)((double)iterations * BENCH_TIME * 1.2 / elapsed) : iterations * 100;
+        iterations = MAX(iterations + 1, MIN(next, MIN(iterations * 100, BENCH_MAX_ITERATIONS)));
+    }
+
+    fprintf(benchOutput, "Benchmark%s\t%10zu\t%14.1f ns/op", name, iterations, (double)elapsed / iterations);
+    if (bytes != 0) {
+        fprintf(benchOutput, "\t%10.2f MB/s", (double)bytes * iterations * 1e3 / elapsed);
+    }
+    fprintf(benchOutput, "\t%10llu B/op\t%6llu allocs/op\n", (unsigned long long)(benchAllocatedBytes / iterations),
+        (unsigned long long)(benchAllocations / iterations));
+    fflush(benchOutput);
+}
+
+static void benchLZ4CompressHC(void *context, size_t iterations) {
+    bench_lz4_t *lz4 = context;
+    for (size_t i = 0; i < iterations; i++) {
+        LZ4_compress_HC(lz4->source, lz4->destination, lz4->sourceSize, lz4->sourceSize, lz4->level);
+    }
+}
+
+static void benchGasterPayload(void *context, size_t iterations) {
+    uint8_t *payload;
+    for (size_t i = 0; i < iterations; i++) {
+        if (prepareGasterPayload(&payload) != 0) {
+            free(payload);
+        }
+    }
+}
+
+static void benchCheckm8Payload(void *context, size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        getCheckm8Payload(false);
+    }
+}
+
+static void benchUSBROPCallbacks(void *context, size_t iterations) {
+    // The same chain prepareGasterPayload() builds
+    callback_t callbacks[] = {
+        { write_ttbr0, insecure_memory_base },
+        { tlbi, 0 },
+        { insecure_memory_base + ARM_16K_TT_L2_SIZE + ttbr0_sram_off + 2 * sizeof(uint64_t), 0 },
+        { write_ttbr0, ttbr0_addr },
+        { tlbi, 0 },
+        { ret_gadget, 0 }
+    };
+    for (size_t i = 0; i < iterations; i++) {
+        generateUSBROPCallbacks(context, insecure_memory_base, callbacks, sizeof(callbacks) / sizeof(callbacks[0]));
+    }
+}
+
+static void benchCheckSerialNumber(void *context, size_t iterations) {
+    usb_handle_t handle = { .vid = 0x5ac, .pid = 0x1227 };
+    bool pwned;
+    for (size_t i = 0; i < iterations; i++) {
+        checkm8CheckSerialNumber(&handle, context, &pwned);
+    }
+}
+
+static void benchGetArgumentByName(void *context, size_t iterations) {
+    for (size_t i = 0; i < iterations; i++) {
+        getArgumentByName(context);
+    }
+}
+
+static void benchAchillesLog(void *context, size_t iterations) {
+    log_level_t level = *(log_level_t *)context;
+    for (size_t i = 0; i < iterations; i++) {
+        LOG(level, "Sent %d regular packets in %.3f ms", 6, 1.5);
+    }
+}
+
+// Purpose: Compress each PongoOS image at every level, preparePongoOS() uses the highest
+static void benchLZ4(void) {
+    const struct { const char *name; const unsigned char *image; unsigned int size; } images[] = {
+        { "Pongo", build_Pongo_bin, build_Pongo_bin_len },
+        { "Pongo-palera1n", Pongo_palera1n_bin, Pongo_palera1n_bin_len }
+    };
+    bench_lz4_t lz4;
+    char name[64];
+
+    for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); i++) {
+        lz4.source = (const char *)images[i].image;
+        lz4.sourceSize = (int)images[i].size;
+        lz4.destination = malloc(images[i].size);
+        for (lz4.level = 1; lz4.level <= LZ4HC_CLEVEL_MAX; lz4.level++) {
+            snprintf(name, sizeof(name), "LZ4CompressHC/%s/level=%d", images[i].name, lz4.level);
+            runBenchmark(name, benchLZ4CompressHC, &lz4, images[i].size);
+        }
+        free(lz4.destination);
+    }
+}
+
+// Purpose: Benchmark the per-device work of the exploit, with the configuration of each SoC
+static void benchDevices(void) {
+    usb_handle_t handle = { .vid = 0x5ac, .pid = 0x1227 };
+    uint8_t buffer[DFU_MAX_TRANSFER_SIZE];
+    char serial[128], name[64];
+    bool pwned;
+
+    for (size_t i = 0; i < sizeof(testProfiles) / sizeof(testProfiles[0]); i++) {
+        snprintf(serial, sizeof(serial), TEST_SERIAL_FORMAT, testProfiles[i].cpid, testProfiles[i].bdid, testProfiles[i].srtg);
+        snprintf(name, sizeof(name), "CheckSerialNumber/cpid=%04X", testProfiles[i].cpid);
+        runBenchmark(name, benchCheckSerialNumber, serial, 0);
+
+        // Leave the globals set up for this SoC
+        checkm8CheckSerialNumber(&handle, serial, &pwned);
+        snprintf(name, sizeof(name), "GasterPayload/cpid=%04X", testProfiles[i].cpid);
+        runBenchmark(name, benchGasterPayload, NULL, 0);
+        snprintf(name, sizeof(name), "Checkm8Payload/cpid=%04X", testProfiles[i].cpid);
+        runBenchmark(name, benchCheckm8Payload, NULL, 0);
+        snprintf(name, sizeof(name), "USBROPCallbacks/cpid=%04X", testProfiles[i].cpid);
+        runBenchmark(name, benchUSBROPCallbacks, buffer, 0);
+    }
+}
+
+// Purpose: Benchmark the argument lookups and log formatting done throughout the exploit
+static void benchUtilities(void) {
+    arg_t *verbosityArg = getArgumentByName("Verbosity"), saved = *verbosityArg;
+    log_level_t level = LOG_INFO;
+    char name[64];
+
+    runBenchmark("GetArgumentByName/first", benchGetArgumentByName, "Verbosity", 0);
+    runBenchmark("GetArgumentByName/last", benchGetArgumentByName, "Custom overlay", 0);
+    runBenchmark("GetArgumentByName/missing", benchGetArgumentByName, "Missing", 0);
+
+    if (!silenceStdout()) {
+        return;
+    }
+    verbosityArg->set = true;
+    for (int verbosity = 0; verbosity <= 2; verbosity++) {
+        verbosityArg->intVal = verbosity;
+        snprintf(name, sizeof(name), "AchillesLog/verbosity=%d", verbosity);
+        runBenchmark(name, benchAchillesLog, &level, 0);
+    }
+    *verbosityArg = saved;
+    level = LOG_DEBUG;
+    runBenchmark("AchillesLog/disabled", benchAchillesLog, &level, 0);
+    restoreStdout();
+}
+
+static int compareBenchSamples(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+// Purpose: Find a metric of the end-to-end benchmark by name, adding it the first time it is seen
+static bench_metric_t *getBenchMetric(bench_metric_t *metrics, size_t *count, const char *name, size_t runs) {
+    for (size_t i = 0; i < *count; i++) {
+        if (strcmp(metrics[i].name, name) == 0) {
+            return &metrics[i];
+        }
+    }
+    if (*count == BENCH_MAX_METRICS) {
+        return NULL;
+    }
+    snprintf(metrics[*count].name, sizeof(metrics[*count].name), "%s", name);
+    metrics[*count].samples = calloc(runs, sizeof(uint64_t));
+    metrics[*count].count = 0;
+    metrics[*count].lastRun = SIZE_MAX;
+    return &metrics[(*count)++];
+}
+
+// Purpose: Add a sample to a metric of one run, stages that ran more than once add up
+static void addBenchSample(bench_metric_t *metrics, size_t *count, const char *name, size_t runs, size_t run, uint64_t sample) {
+    bench_metric_t *metric = getBenchMetric(metrics, count, name, runs);
+    if (metric == NULL || metric->samples == NULL) {
+        return;
+    }
+    if (metric->lastRun != run) {
+        metric->lastRun = run;
+        metric->samples[metric->count++] = 0;
+    }
+    metric->samples[metric->count - 1] += sample;
+}
+
+// Purpose: Turn a span name into part of a benchmark name, which can't contain spaces
+static void formatBenchName(char *name, size_t size, const char *prefix, const char *span) {
+    size_t length = (size_t)snprintf(name, size, "%s", prefix);
+    for (; *span != '\0' && length + 1 < size; span++) {
+        if (isalnum((unsigned char)*span) || *span == '-' || *span == '.') {
+            name[length++] = *span;
+        } else if (name[length - 1] != '_') {
+            name[length++] = '_';
+        }
+    }
+    while (name[length - 1] == '_') {
+        length--;
+    }
+    name[length] = '\0';
+}
+
+// Purpose: Record how long each stage of a run took, and when it got to the PongoOS prompt and sent bootx
+static void collectEndToEndRun(bench_metric_t *metrics, size_t *count, size_t runs, size_t run, uint64_t start, uint64_t end) {
+    const timeline_span_t *spans;
+    size_t spanCount = getTimelineSpans(&spans);
+    char name[TIMELINE_NAME_SIZE + 8];
+
+    addBenchSample(metrics, count, "total", runs, run, end - start);
+    for (size_t i = 0; i < spanCount; i++) {
+        if (spans[i].end == 0 || strcmp(spans[i].name, "checkm8") == 0) {
+            continue; // The run as a whole is the total
+        }
+        if (strcmp(spans[i].name, "Pongo wait") == 0) {
+            addBenchSample(metrics, count, "to=PongoOS", runs, run, spans[i].end - start);
+        } else if (strcmp(spans[i].name, "Pongo command: bootx") == 0) {
+            addBenchSample(metrics, count, "to=bootx", runs, run, spans[i].end - start);
+        }
+        formatBenchName(name, sizeof(name), "stage=", spans[i].name);
+        addBenchSample(metrics, count, name, runs, run, spans[i].end - spans[i].start);
+    }
+}
+
+// Purpose: Boot a simulated T8010 from DFU mode to the PongoOS prompt, or through a jailbroken boot with -j, over and over,
+//          and print the median and 99th percentile of the whole run and of each stage
+static int benchEndToEnd(void) {
+    const char *benchmark = getArgumentByName("Jailbreak")->boolVal ? "EndToEnd/jailbreak" : "EndToEnd/pongo";
+    usb_simulator_mode_t expected = getArgumentByName("Jailbreak")->boolVal ? USB_SIMULATOR_MODE_BOOTED : USB_SIMULATOR_MODE_PONGO;
+    arg_t *runsArg = getArgumentByName("Iterations"), *quickArg = getArgumentByName("Quick mode");
+    size_t runs = runsArg->set ? (size_t)MAX(runsArg->intVal, 0) : BENCH_RUNS, passed = 0, count = 0, i;
+    const test_profile_t *profile = NULL;
+    bench_metric_t metrics[BENCH_MAX_METRICS];
+    char home[] = "/tmp/achilles-bench-XXXXXX", model[PATH_MAX];
+    uint64_t start, end;
+    int ret;
+
+    for (i = 0; i < sizeof(testProfiles) / sizeof(testProfiles[0]); i++) {
+        if (testProfiles[i].cpid == 0x8010) {
+            profile = &testProfiles[i];
+        }
+    }
+    usb_simulator_device_t device = { profile->cpid, profile->bdid, profile->srtg, USB_SIMULATOR_MODE_DFU, true, USB_SIMULATOR_FAIL_NONE, 0, BENCH_LATENCY };
+
+    if (runs == 0) {
+        LOG(LOG_ERROR, "-n must be at least 1");
+        return -1;
+    }
+    // Every run starts from a clean abort model, the way a new host would
+    if (mkdtemp(home) == NULL || setenv("HOME", home, 1) != 0) {
+        LOG(LOG_ERROR, "Failed to create a temporary home directory");
+        return -1;
+    }
+    snprintf(model, sizeof(model), "%s/%s", home, ABORT_MODEL_FILE);
+    quickArg->set = quickArg->boolVal = true;
+    // Extra latency, on top of the simulated device's own, comes from the rules file
+    if (getArgumentByName("Faults")->set && !startUSBFaults(getArgumentByName("Faults")->stringVal)) {
+        return -1;
+    }
+    // The milestones go first, the stages follow in the order they ran
+    getBenchMetric(metrics, &count, "total", runs);
+    getBenchMetric(metrics, &count, "to=PongoOS", runs);
+    if (expected == USB_SIMULATOR_MODE_BOOTED) {
+        getBenchMetric(metrics, &count, "to=bootx", runs);
+    }
+    LOG(LOG_INFO, "Running %zu times against a simulated T8010 with %uus of latency per transfer", runs, device.latency);
+
+    for (size_t run = 0; run < runs; run++) {
+        unlink(model);
+        resetTimeline();
+        stopUSBSimulator();
+        startUSBSimulatorDevice(&device);
+        if (!silenceStdout()) {
+            return -1;
+        }
+        start = getMonotonicTime();
+        ret = checkm8();
+        end = getMonotonicTime();
+        restoreStdout();
+        if (ret != 0 || getUSBSimulatorMode() != expected) {
+            LOG(LOG_ERROR, "Run %zu failed, leaving it out", run + 1);
+            continue;
+        }
+        collectEndToEndRun(metrics, &count, runs, passed++, start, end);
+        // One line per run as well, so benchstat can compare the totals of two runs
+        fprintf(benchOutput, "Benchmark%s/total\t%10d\t%14llu ns/op\n", benchmark, 1, (unsigned long long)(end - start));
+        fflush(benchOutput);
+    }
+    stopUSBSimulator();
+    if (getArgumentByName("Faults")->set) {
+        printUSBFaults();
+    }
+    if (passed == 0) {
+        LOG(LOG_ERROR, "Every run failed");
+        return -1;
+    }
+
+    for (i = 0; i < count; i++) {
+        // Only the runs that got to a stage count towards its statistics
+        size_t samples = metrics[i].count;
+        if (samples != 0) {
+            qsort(metrics[i].samples, samples, sizeof(uint64_t), compareBenchSamples);
+            // The 99th percentile by the nearest rank, which is the slowest run when there are fewer than 100
+            fprintf(benchOutput, "Benchmark%s/%s\t%10zu\t%14.3f median-ms\t%14.3f p99-ms\n", benchmark, metrics[i].name, samples,
+                metrics[i].samples[(samples - 1) / 2] / 1e6, metrics[i].samples[(samples * 99 + 99) / 100 - 1] / 1e6);
+        }
+        free(metrics[i].samples);
+    }
+    fflush(benchOutput);
+    if (passed != runs) {
+        LOG(LOG_ERROR, "%zu of %zu runs failed", runs - passed, runs);
+        return -1;
+    }
+    return 0;
+}
+
+int bench(void) {
+    struct utsname system;
+
+    if ((benchOutput = fdopen(dup(STDOUT_FILENO), "w")) == NULL) {
+        benchOutput = stdout;
+    }
+    uname(&system);
+    fprintf(benchOutput, "os: %s\narch: %s\npkg: %s %s\n", system.sysname, system.machine, NAME, VERSION);
+    fflush(benchOutput);
+    if (getArgumentByName("PongoOS")->boolVal || getArgumentByName("Jailbreak")->boolVal) {
+        return benchEndToEnd();
+    }
+    benchLZ4();
+    benchDevices();
+    benchUtilities();
+    fflush(benchOutput);
+    return 0;
+}
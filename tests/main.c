@@ -1,133 +1,249 @@
 #include <Achilles.h>
 #include <utils/log.h>
+#include <utils/timer.h>
 #include <usb/device.h>
+#include <usb/simulator.h>
 #include <exploit/exploit.h>
-
-int tests(void) {
-
-    arg_t *verbosityArg = getArgumentByName("Verbosity");
-    verbosityArg->set = true;
-    verbosityArg->intVal = 1;
-
-    #ifdef ACHILLES_LIBUSB
-    LOG(LOG_INFO, "Running Achilles tests for libusb");
-    #else
-    LOG(LOG_INFO, "Running Achilles tests for IOKit");
-    #endif
-
-    LOG(LOG_INFO, "Test 1: regular exploit");
-    arg_t *exploitArg = getArgumentByName("Exploit");
-    exploitArg->set = true;
-    exploitArg->boolVal = true;
-    arg_t *quickArg = getArgumentByName("Quick mode");
-    quickArg->set = true;
-    quickArg->boolVal = true;
-
-    int i = 0;
+#include <exploit/dfu.h>
+#include <exploit/exploit-utils.h>
+#include <boot/pongo/pongo.h>
+#include "profiles.h"
+
+#define TEST_RESULTS "tests/build/results.json"
+#define TEST_LATENCY 50 // Microseconds every simulated transfer takes
+#define TEST_LIFETIME 4000 // Transfers a device that can't be exploited answers before it goes away
+#define TEST_SHIFTED_WINDOW 7000 // Microseconds into the request where the shifted race is won
+#define TEST_SHIFTED_ATTEMPTS 1000 // Race attempts the abort model gets to find the shifted window
+
+typedef enum {
+    TEST_EXPLOIT, // Expect the device in pwned DFU mode
+    TEST_PONGO, // Expect the device in PongoOS
+    TEST_JAILBREAK, // Expect PongoOS to have booted the kernel
+    TEST_FAILURE // Expect checkm8() to fail and leave the device unpwned
+} test_kind_t;
+
+static FILE *testResults;
+static size_t testsRun, testsFailed;
+
+// Purpose: Point the exploit at a fresh simulated device, and choose which of -e, -p and -j it runs with
+static void startTestDevice(const test_profile_t *profile, test_kind_t kind, usb_simulator_failure_t failure) {
+    usb_simulator_device_t device = {
+        profile->cpid, profile->bdid, profile->srtg, kind == TEST_JAILBREAK ? USB_SIMULATOR_MODE_PONGO : USB_SIMULATOR_MODE_DFU,
+        kind == TEST_PONGO, failure, failure != USB_SIMULATOR_FAIL_NONE && failure != USB_SIMULATOR_FAIL_PAYLOAD ? TEST_LIFETIME : 0,
+        TEST_LATENCY
+    };
+    arg_t *exploitArg = getArgumentByName("Exploit"), *pongoArg = getArgumentByName("PongoOS"), *jailbreakArg = getArgumentByName("Jailbreak");
+
+    exploitArg->set = exploitArg->boolVal = kind == TEST_EXPLOIT || kind == TEST_FAILURE;
+    pongoArg->set = pongoArg->boolVal = kind == TEST_PONGO;
+    jailbreakArg->set = jailbreakArg->boolVal = kind == TEST_JAILBREAK;
+    stopUSBSimulator();
+    startUSBSimulatorDevice(&device);
+}
+
+// Purpose: Check the serial number the device is left with, the way a user would see it,
+// and that a failing device made the exploit fail in the stage the failure was injected into
+static bool checkTestDevice(const test_profile_t *profile, test_kind_t kind, usb_simulator_failure_t failure, int ret) {
+    static const int failedStages[] = {STAGE_DONE, STAGE_RESET, STAGE_HEAP_SPRAY, STAGE_TRIGGER, STAGE_PATCH};
+    dfu_serial_t serial;
     device_t device;
-    while (findDevice(&device, false) == -1)
-    {
-        sleep(1);
-        i++;
-        if (i == 10)
-        {
-            LOG(LOG_ERROR, "No iOS device found after 10 seconds - please connect a device.");
-            return -1;
-        }
-    }
+    bool passed;
 
-    checkm8();
+    if (kind == TEST_JAILBREAK) {
+        return ret == 0 && getUSBSimulatorMode() == USB_SIMULATOR_MODE_BOOTED;
+    }
+    if (findUSBDevice(&device, false) == -1) {
+        return false;
+    }
+    passed = parseDFUSerial(device.serialNumber, &serial) && serial.cpid == profile->cpid && serial.bdid == profile->bdid;
+    if (kind != TEST_FAILURE) {
+        // The handle is kept across the resets between stages, only re-enumerations reopen it
+        passed = passed && checkm8LastResult.connections < checkm8LastResult.stages;
+    }
+    if (kind == TEST_EXPLOIT) {
+        passed = passed && ret == 0 && strcmp(serial.pwnd, "checkm8") == 0 && strcmp(serial.srtg, profile->srtg) == 0;
+    } else if (kind == TEST_PONGO) {
+        passed = passed && ret == 0 && isInPongoOS(device.serialNumber);
+    } else {
+        passed = passed && ret != 0 && serial.pwnd[0] == '\0';
+    }
+    if (checkm8LastResult.failedStage != failedStages[failure]) {
+        LOG(LOG_ERROR, "The first failed stage was %d, expected %d", checkm8LastResult.failedStage, failedStages[failure]);
+        passed = false;
+    }
+    LOG(LOG_DEBUG, "Serial number: %s", device.serialNumber);
+    free(device.serialNumber);
+    return passed;
+}
+
+// Purpose: Log and save the result of a test
+static void recordTestResult(const char *name, const test_profile_t *profile, bool passed, uint64_t elapsed, uint64_t transfers) {
+    if (passed) {
+        LOG(LOG_SUCCESS, "✅ %s passed in %.3f seconds", name, elapsed / 1e9);
+    } else {
+        LOG(LOG_ERROR, "❌ %s failed", name);
+        testsFailed++;
+    }
+    if (testResults != NULL) {
+        fprintf(testResults, "%s\n  {\"name\": \"%s\", \"cpid\": \"0x%04X\", \"passed\": %s, \"seconds\": %.6f, \"transfers\": %llu}",
+            testsRun != 0 ? "," : "", name, profile->cpid, passed ? "true" : "false", elapsed / 1e9, (unsigned long long)transfers);
+    }
+    testsRun++;
+}
+
+// Purpose: Run checkm8() against a simulated device and record how it went
+static void runTest(const char *name, const test_profile_t *profile, test_kind_t kind, usb_simulator_failure_t failure) {
+    uint64_t start, transfers = usbControlTransfers;
+    bool passed;
+    int ret;
+
+    LOG(LOG_INFO, "%s, CPID 0x%04X", name, profile->cpid);
+    startTestDevice(profile, kind, failure);
+    start = getMonotonicTime();
+    ret = checkm8();
+    passed = checkTestDevice(profile, kind, failure, ret);
+    recordTestResult(name, profile, passed, getMonotonicTime() - start, usbControlTransfers - transfers);
+}
+
+// Purpose: Send commands to the payload of a device in pwned DFU mode over one session, and check their replies
+static bool checkCommandSession(const test_profile_t *profile) {
+    usb_simulator_device_t device = { profile->cpid, profile->bdid, profile->srtg, USB_SIMULATOR_MODE_PWND, false, USB_SIMULATOR_FAIL_NONE, 0, TEST_LATENCY };
+    uint64_t arguments[] = { 0x1234, 5, 6 }, retval = 0, transfers;
+    uint8_t written[0x100], read[DFU_MAX_TRANSFER_SIZE + 0x100];
+    checkm8_command_session_t session;
+    char serial[USB_SIMULATOR_SERIAL_SIZE];
+    usb_handle_t handle;
+    bool pwned, passed;
+    size_t i;
+
+    stopUSBSimulator();
+    startUSBSimulatorDevice(&device);
+    // Set up the addresses of the SoC, as checkm8() would have done
+    snprintf(serial, sizeof(serial), TEST_SERIAL_FORMAT " PWND:[checkm8]", profile->cpid, profile->bdid, profile->srtg);
+    initUSBHandle(&handle, 0x5ac, 0x1227);
+    checkm8CheckSerialNumber(&handle, serial, &pwned);
+    if (!checkm8OpenCommandSession(&session, &handle)) {
+        return false;
+    }
 
+    // A command takes its download, the upload that runs it and the three requests that rewind the buffer
+    transfers = usbControlTransfers;
+    passed = checkm8SessionExec(&session, 0x100000000, arguments, sizeof(arguments) / sizeof(arguments[0]), &retval)
+        && retval == arguments[0] && usbControlTransfers - transfers == 5;
 
-    while (findDevice(&device, false) == -1)
-    {
-        sleep(1);
-        i++;
-        if (i == 10)
-        {
-            LOG(LOG_ERROR, "No iOS device found after 10 seconds - please connect a device.");
-            return -1;
-        }
+    // Memory outside the load buffer reads as the low byte of each address
+    passed = passed && checkm8SessionReadMemory(&session, 0x100000000, read, sizeof(read));
+    for (i = 0; passed && i < sizeof(read); i++) {
+        passed = read[i] == (uint8_t)i;
     }
-
-    if (isSerialNumberPwned(device.serialNumber)) {
-        LOG(LOG_SUCCESS, "✅ Test 1 passed");
-    } else {
-        LOG(LOG_ERROR, "❌ Test 1 failed");
-        return -1;
+    for (i = 0; i < sizeof(written); i++) {
+        written[i] = (uint8_t)(0xFF - i);
     }
+    passed = passed && checkm8SessionWriteMemory(&session, insecure_memory_base + 0x400, written, sizeof(written))
+        && checkm8SessionReadMemory(&session, insecure_memory_base + 0x400, read, sizeof(written)) && memcmp(read, written, sizeof(written)) == 0;
+    passed = passed && session.commands == 5 && session.failures == 0 && getUSBSimulatorMode() == USB_SIMULATOR_MODE_PWND;
+    checkm8PrintCommandSession(&session);
+    checkm8CloseCommandSession(&session);
+    return passed;
+}
+
+// Purpose: Run the command session test and record how it went
+static void runCommandTest(const char *name, const test_profile_t *profile) {
+    uint64_t start = getMonotonicTime(), transfers = usbControlTransfers;
+    bool passed;
+
+    LOG(LOG_INFO, "%s, CPID 0x%04X", name, profile->cpid);
+    passed = checkCommandSession(profile);
+    recordTestResult(name, profile, passed, getMonotonicTime() - start, usbControlTransfers - transfers);
+}
+
+// Purpose: Check that an abort model trained on one timing still finds a race window that moved far away
+static bool checkShiftedAbortTiming(uint64_t *attempts) {
+    unsigned sweepDelay = 10000, delay, bucket = 1000 / ABORT_MODEL_BUCKET_WIDTH;
+    abort_model_t model;
+    bool won = false;
+
+    // The host used to win at 1ms, but now only wins in the bucket at TEST_SHIFTED_WINDOW,
+    // well past the neighbours the model tries on its own
+    memset(&model, 0, sizeof(abort_model_t));
+    model.attempts[ABORT_STAGE_STALL][bucket] = 100;
+    model.successes[ABORT_STAGE_STALL][bucket] = 90;
+    for (*attempts = 0; !won && *attempts < TEST_SHIFTED_ATTEMPTS; (*attempts)++) {
+        // The same sweep checkm8Stall() falls back to
+        delay = sampleAbortDelay(&model, ABORT_STAGE_STALL, sweepDelay);
+        won = delay >= TEST_SHIFTED_WINDOW && delay < TEST_SHIFTED_WINDOW + ABORT_MODEL_BUCKET_WIDTH;
+        recordAbortResult(&model, ABORT_STAGE_STALL, delay, won);
+        sweepDelay = (sweepDelay + 1000) % 10000;
+    }
+    LOG(LOG_DEBUG, "%s the shifted race window after %llu attempts", won ? "Found" : "Did not find", (unsigned long long)*attempts);
+    return won;
+}
 
+// Purpose: Run the shifted abort timing test and record how it went
+static void runShiftedAbortTest(const char *name, const test_profile_t *profile) {
+    uint64_t start = getMonotonicTime(), attempts;
+    bool passed;
 
-    LOG(LOG_INFO, "Test 2: boot PongoOS");
+    LOG(LOG_INFO, "%s, CPID 0x%04X", name, profile->cpid);
+    passed = checkShiftedAbortTiming(&attempts);
+    // No transfers, the race is decided by the window alone
+    recordTestResult(name, profile, passed, getMonotonicTime() - start, 0);
+}
 
-    LOG_NO_NEWLINE(LOG_INFO, "Press enter when you're ready to continue...");
-    getchar();
+int tests(void) {
+    static const char *failureNames[] = {NULL, "Reset failure", "Heap spray failure", "UaF trigger failure", "Payload failure"};
+    const test_profile_t *t8010 = NULL, *s8000 = NULL;
+    char home[] = "/tmp/achilles-tests-XXXXXX";
+    size_t i;
 
-    while (findDevice(&device, false) == -1)
-    {
-        sleep(1);
-        i++;
-        if (i == 10)
-        {
-            LOG(LOG_ERROR, "No iOS device found after 10 seconds - please connect a device.");
-            return -1;
-        }
-    }
+    LOG(LOG_INFO, "Running Achilles tests against the simulated device");
 
-    exploitArg->set = false;
-    exploitArg->boolVal = false;
-    arg_t *pongoArg = getArgumentByName("PongoOS");
-    pongoArg->set = true;
-    pongoArg->boolVal = true;
-    checkm8();
-
-    while (findDevice(&device, false) == -1)
-    {
-        sleep(1);
-        i++;
-        if (i == 10)
-        {
-            LOG(LOG_ERROR, "No iOS device found after 10 seconds - please connect a device.");
-            return -1;
-        }
+    // Start from a clean abort model, rather than one learned on a real device
+    if (mkdtemp(home) == NULL || setenv("HOME", home, 1) != 0) {
+        LOG(LOG_ERROR, "Failed to create a temporary home directory");
+        return -1;
     }
+    arg_t *quickArg = getArgumentByName("Quick mode");
+    quickArg->set = true;
+    quickArg->boolVal = true;
 
-    if (isInPongoOS(device.serialNumber)) {
-        LOG(LOG_SUCCESS, "✅ Test 2 passed");
+    mkdir("tests/build", 0755);
+    if ((testResults = fopen(TEST_RESULTS, "w")) == NULL) {
+        LOG(LOG_ERROR, "Failed to open %s, timings will not be saved", TEST_RESULTS);
     } else {
-        LOG(LOG_ERROR, "❌ Test 2 failed");
-        return -1;
+        fprintf(testResults, "[");
     }
 
-    LOG(LOG_INFO, "Test 3: jailbreak");
-
-    LOG_NO_NEWLINE(LOG_INFO, "Press enter when you're ready to continue...");
-    getchar();
-
-    while (findDevice(&device, false) == -1)
-    {
-        sleep(1);
-        i++;
-        if (i == 10)
-        {
-            LOG(LOG_ERROR, "No iOS device found after 10 seconds - please connect a device.");
-            return -1;
+    for (i = 0; i < sizeof(testProfiles) / sizeof(testProfiles[0]); i++) {
+        runTest("Exploit", &testProfiles[i], TEST_EXPLOIT, USB_SIMULATOR_FAIL_NONE);
+        if (testProfiles[i].pongo) {
+            runTest("Boot PongoOS", &testProfiles[i], TEST_PONGO, USB_SIMULATOR_FAIL_NONE);
+        }
+        if (testProfiles[i].cpid == 0x8010) {
+            t8010 = &testProfiles[i];
+        } else if (testProfiles[i].cpid == 0x8000) {
+            s8000 = &testProfiles[i];
         }
     }
-
-    pongoArg->set = false;
-    pongoArg->boolVal = false;
-    arg_t *jailbreakArg = getArgumentByName("Jailbreak");
-    jailbreakArg->set = true;
-    jailbreakArg->boolVal = true;
-    if (checkm8() == 0) {
-        LOG(LOG_SUCCESS, "✅ Test 3 passed");
-    } else {
-        LOG(LOG_ERROR, "❌ Test 3 failed");
+    // A9 sprays the heap differently from the A10 and later
+    for (i = USB_SIMULATOR_FAIL_RESET; i <= USB_SIMULATOR_FAIL_PAYLOAD; i++) {
+        runTest(failureNames[i], t8010, TEST_FAILURE, (usb_simulator_failure_t)i);
+        runTest(failureNames[i], s8000, TEST_FAILURE, (usb_simulator_failure_t)i);
+    }
+    runTest("Jailbreak", t8010, TEST_JAILBREAK, USB_SIMULATOR_FAIL_NONE);
+    runCommandTest("Command session", t8010);
+    runShiftedAbortTest("Shifted abort timing", t8010);
+    stopUSBSimulator();
+
+    if (testResults != NULL) {
+        fprintf(testResults, "\n]\n");
+        fclose(testResults);
+        LOG(LOG_INFO, "Saved the timings to %s", TEST_RESULTS);
+    }
+    if (testsFailed != 0) {
+        LOG(LOG_ERROR, "%zu of %zu tests failed", testsFailed, testsRun);
         return -1;
     }
-
-    LOG(LOG_INFO, "🎉 All tests passed!");
-
+    LOG(LOG_INFO, "🎉 All %zu tests passed!", testsRun);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,30 @@
+#ifndef TESTS_PROFILES_H
+#define TESTS_PROFILES_H
+
+#include <Achilles.h>
+
+// The serial number of a device in DFU mode, filled in from a profile
+#define TEST_SERIAL_FORMAT "CPID:%04X CPRV:11 CPFM:03 SCEP:01 BDID:%02X ECID:001A2B3C4D5E6F70 IBFL:3C SRTG:[%s]"
+
+typedef struct {
+    uint16_t cpid;
+    uint8_t bdid;
+    const char *srtg;
+    bool pongo; // Whether Achilles can boot PongoOS on it
+} test_profile_t;
+
+// One device for every SoC Achilles supports
+static const test_profile_t testProfiles[] = {
+    {0x8960, 0x10, "iBoot-1704.10", false},
+    {0x7000, 0x00, "iBoot-1992.0.0.1.19", true},
+    {0x7001, 0x02, "iBoot-1991.0.0.2.16", true},
+    {0x8003, 0x02, "iBoot-2234.0.0.2.22", true},
+    {0x8000, 0x02, "iBoot-2234.0.0.3.3", true},
+    {0x8001, 0x06, "iBoot-2481.0.0.2.1", true},
+    {0x8010, 0x0C, "iBoot-2696.0.0.1.33", true},
+    {0x8011, 0x06, "iBoot-3135.0.0.2.3", true},
+    {0x8015, 0x0A, "iBoot-3332.0.0.1.23", true},
+    {0x8012, 0x06, "iBoot-3401.0.0.1.16", false}
+};
+
+#endif // TESTS_PROFILES_H